@@ -0,0 +1,848 @@
+#include "tinyxmlrpc.h"
+#include <iostream>
+#include <map>
+#include <malloc.h>
+#include <time.h>
+#include <thread>
+#include <unistd.h>
+#include <atomic>
+
+struct blog_post {
+	std::string title;
+	std::string description;
+	std::string link;
+	int postid;
+	struct tm dateCreated;
+	std::vector<std::string> categories;
+};
+TINYXMLRPC_STRUCT(blog_post, title, description, link, postid, dateCreated, categories)
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile size_t sink;
+static bool json_output = false;
+static double min_time = 0.5;
+static const char* filter = NULL;
+
+static bool selected(const char* name) {
+	return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void report(const char* name, long count, double amount, const char* unit) {
+	if (!selected(name)) return;
+	if (json_output)
+		printf("{\"name\":\"%s\",\"count\":%ld,\"value\":%.1f,\"unit\":\"%s\"}\n", name, count, amount, unit);
+	else
+		printf("%-32s %10ld %14.1f %s\n", name, count, amount, unit);
+	fflush(stdout);
+}
+
+/* returns ns/op, or 0 when filtered out */
+template<class F>
+static double bench(const char* name, size_t bytes, F f) {
+	if (!selected(name)) return 0;
+	long iterations = 0, batch = 1;
+	double start = now(), elapsed;
+	do {
+		for(long n = 0; n < batch; n++)
+			sink = sink + (size_t)f();
+		iterations += batch;
+		elapsed = now() - start;
+		if (batch < (1 << 16)) batch *= 2;
+	} while (elapsed < min_time);
+	if (json_output && bytes) {
+		printf("{\"name\":\"%s\",\"count\":%ld,\"value\":%.1f,\"unit\":\"ns/op\",\"mb_per_s\":%.1f}\n",
+			name, iterations, elapsed * 1e9 / iterations, bytes * iterations / elapsed / 1e6);
+		fflush(stdout);
+	} else if (bytes) {
+		printf("%-32s %10ld %14.1f ns/op %10.1f MB/s\n",
+			name, iterations, elapsed * 1e9 / iterations, bytes * iterations / elapsed / 1e6);
+		fflush(stdout);
+	} else
+		report(name, iterations, elapsed * 1e9 / iterations, "ns/op");
+	return elapsed * 1e9 / iterations;
+}
+
+template<class F>
+static double bench(const char* name, F f) {
+	return bench(name, 0, f);
+}
+
+/* runs f(thread) from several threads for min_time, reports wall time per call */
+template<class F>
+static void bench_concurrent(const char* name, int threads, F f) {
+	if (!selected(name)) return;
+	std::atomic<long> calls(0);
+	std::atomic<bool> stop(false);
+	std::vector<std::thread> workers;
+	double start = now();
+	for(int n = 0; n < threads; n++)
+		workers.push_back(std::thread([&, n]() {
+			while (!stop) {
+				sink = sink + (size_t)f(n);
+				calls++;
+			}
+		}));
+	while (now() - start < min_time)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	stop = true;
+	for(size_t n = 0; n < workers.size(); n++)
+		workers[n].join();
+	report(name, calls, (now() - start) * 1e9 / calls, "ns/op");
+}
+
+static std::vector<blog_post> make_posts(int count) {
+	std::vector<blog_post> posts(count);
+	for(int n = 0; n < count; n++) {
+		blog_post& post = posts[n];
+		char buf[64];
+		sprintf(buf, "post #%d", n);
+		post.title = buf;
+		post.description = std::string(200, 'x') + " <b>bold</b> & more";
+		sprintf(buf, "http://example.com/%d", n);
+		post.link = buf;
+		post.postid = n;
+		memset(&post.dateCreated, 0, sizeof(post.dateCreated));
+		post.dateCreated.tm_year = 109;
+		post.dateCreated.tm_mon = 1;
+		post.dateCreated.tm_mday = 1 + n % 28;
+		post.categories.push_back("diary");
+		post.categories.push_back("c++");
+	}
+	return posts;
+}
+
+static tinyxmlrpc::value to_value(const blog_post& post) {
+	tinyxmlrpc::value::Struct entry;
+	tinyxmlrpc::value::Array categories;
+	entry["title"] = post.title;
+	entry["description"] = post.description;
+	entry["link"] = post.link;
+	entry["postid"] = post.postid;
+	entry["dateCreated"] = tinyxmlrpc::value(post.dateCreated);
+	for(size_t n = 0; n < post.categories.size(); n++)
+		categories.push_back(post.categories[n]);
+	entry["categories"] = categories;
+	return entry;
+}
+
+static void bench_binding() {
+	std::vector<blog_post> posts = make_posts(100);
+	tinyxmlrpc::value::Array params;
+	for(size_t n = 0; n < posts.size(); n++)
+		params.push_back(to_value(posts[n]));
+	tinyxmlrpc::value response = params;
+	std::string strXml = tinyxmlrpc::serialize(response);
+
+	bench("binding/decode/value", [&]() {
+		tinyxmlrpc::value res = tinyxmlrpc::parse(strXml);
+		size_t total = 0;
+		for(int n = 0; n < (int)res.size(); n++) {
+			total += res[n]["title"].to_str().size();
+			total += res[n]["description"].to_str().size();
+			total += res[n]["link"].to_str().size();
+			total += res[n]["postid"].getInt();
+		}
+		return total;
+	});
+	bench("binding/decode/typed", [&]() {
+		std::vector<blog_post> res;
+		tinyxmlrpc::parse(strXml, res);
+		size_t total = 0;
+		for(size_t n = 0; n < res.size(); n++)
+			total += res[n].title.size() + res[n].description.size() + res[n].link.size() + res[n].postid;
+		return total;
+	});
+	bench("binding/encode/value", [&]() {
+		tinyxmlrpc::value::Array requests;
+		tinyxmlrpc::value::Array array;
+		for(size_t n = 0; n < posts.size(); n++)
+			array.push_back(to_value(posts[n]));
+		requests.push_back(array);
+		return tinyxmlrpc::serialize("blogger.newPosts", requests).size();
+	});
+	bench("binding/encode/typed", [&]() {
+		tinyxmlrpc::request req("blogger.newPosts");
+		req << posts;
+		return req.str().size();
+	});
+}
+
+static const char* field_names[] = {
+	"postid", "title", "description", "link", "permaLink",
+	"dateCreated", "userid", "categories", "mt_keywords", "mt_excerpt",
+};
+
+template<class S>
+static void fill_struct(S& s) {
+	for(int n = 0; n < 10; n++)
+		s[field_names[n]] = n;
+}
+
+template<class S>
+static long struct_bytes(int count) {
+	long before = mallinfo2().uordblks;
+	std::vector<S>* structs = new std::vector<S>(count);
+	for(int n = 0; n < count; n++)
+		fill_struct((*structs)[n]);
+	long bytes = mallinfo2().uordblks - before;
+	delete structs;
+	return bytes;
+}
+
+static void bench_struct() {
+	typedef std::map<std::string, tinyxmlrpc::value> map_struct;
+	map_struct m;
+	tinyxmlrpc::value::Struct s;
+	fill_struct(m);
+	fill_struct(s);
+	std::string key = "mt_keywords";
+
+	bench("struct/build/map", [&]() {
+		map_struct tmp;
+		fill_struct(tmp);
+		return tmp.size();
+	});
+	bench("struct/build/flat", [&]() {
+		tinyxmlrpc::value::Struct tmp;
+		fill_struct(tmp);
+		return tmp.size();
+	});
+	bench("struct/lookup/map", [&]() {
+		return m.find(key)->second.getInt();
+	});
+	bench("struct/lookup/flat", [&]() {
+		return s.find(key)->second.getInt();
+	});
+	bench("struct/iterate/map", [&]() {
+		int total = 0;
+		for(map_struct::const_iterator it = m.begin(); it != m.end(); it++)
+			total += it->second.getInt();
+		return total;
+	});
+	bench("struct/iterate/flat", [&]() {
+		int total = 0;
+		for(tinyxmlrpc::value::Struct::const_iterator it = s.begin(); it != s.end(); it++)
+			total += it->second.getInt();
+		return total;
+	});
+	report("struct/memory/map", 1000, struct_bytes<map_struct>(1000), "bytes");
+	report("struct/memory/flat", 1000, struct_bytes<tinyxmlrpc::value::Struct>(1000), "bytes");
+}
+
+static void bench_lazy() {
+	tinyxmlrpc::value::Array posts;
+	tinyxmlrpc::value::Binary blob(2048, 'z');
+	for(int n = 0; n < 2000; n++) {
+		blog_post post = make_posts(1)[0];
+		tinyxmlrpc::value entry = to_value(post);
+		entry["description"] = std::string(1024, 'd') + " &amp; <tail>";
+		entry["enclosure"] = blob;
+		posts.push_back(entry);
+	}
+	tinyxmlrpc::value response = posts;
+	std::string strXml = tinyxmlrpc::serialize(response);
+	report("lazy/document", 1, strXml.size(), "bytes");
+
+	bench("lazy/sparse/eager", [&]() {
+		tinyxmlrpc::value res = tinyxmlrpc::parse(strXml);
+		return res[0]["title"].getString().size() + res[1000]["postid"].getInt() + res[1999]["link"].getString().size();
+	});
+	bench("lazy/sparse/lazy", [&]() {
+		tinyxmlrpc::lazy_value res = tinyxmlrpc::parse_lazy(strXml);
+		return res[0]["title"].getString().size() + res[1000]["postid"].getInt() + res[1999]["link"].getString().size();
+	});
+	bench("lazy/full/lazy", [&]() {
+		return tinyxmlrpc::parse_lazy(strXml).to_value().size();
+	});
+
+	long before = mallinfo2().uordblks;
+	tinyxmlrpc::value* eager = new tinyxmlrpc::value(tinyxmlrpc::parse(strXml));
+	report("lazy/memory/eager", 1, mallinfo2().uordblks - before, "bytes");
+	delete eager;
+	before = mallinfo2().uordblks;
+	tinyxmlrpc::lazy_value* lazy = new tinyxmlrpc::lazy_value(tinyxmlrpc::parse_lazy(strXml));
+	report("lazy/memory/lazy", 1, mallinfo2().uordblks - before, "bytes");
+	delete lazy;
+}
+
+static void bench_copy() {
+	tinyxmlrpc::value::Array posts;
+	std::vector<blog_post> source = make_posts(1000);
+	for(size_t n = 0; n < source.size(); n++)
+		posts.push_back(to_value(source[n]));
+	tinyxmlrpc::value response = posts;
+
+	bench("copy/response", [&]() {
+		tinyxmlrpc::value copy = response;
+		return copy.size();
+	});
+	bench("copy/response+mutate", [&]() {
+		tinyxmlrpc::value copy = response;
+		copy[0]["title"] = "changed";
+		return copy.size();
+	});
+}
+
+static void bench_scalar() {
+	char buf[tinyxmlrpc::scalar::double_size];
+	struct tm tmTime = make_posts(1)[0].dateCreated;
+	int i = 0;
+	long long i8 = 0;
+	double d = 0;
+	bool b = false;
+
+	bench("scalar/int/format/sprintf", [&]() { return sprintf(buf, "%d", 1234567); });
+	bench("scalar/int/format", [&]() { return tinyxmlrpc::scalar::format_int(buf, 1234567); });
+	bench("scalar/int/parse/atol", [&]() { return atol("1234567"); });
+	bench("scalar/int/parse", [&]() { tinyxmlrpc::scalar::parse_int("1234567", i); return i; });
+	bench("scalar/i8/format", [&]() { return tinyxmlrpc::scalar::format_i8(buf, 1234567890123LL); });
+	bench("scalar/i8/parse", [&]() { tinyxmlrpc::scalar::parse_i8("1234567890123", i8); return i8; });
+	bench("scalar/double/format/sprintf", [&]() { return sprintf(buf, "%f", 3.14159265358979); });
+	bench("scalar/double/format", [&]() { return tinyxmlrpc::scalar::format_double(buf, 3.14159265358979); });
+	bench("scalar/double/parse/atof", [&]() { return (size_t)atof("3.14159265358979"); });
+	bench("scalar/double/parse", [&]() { tinyxmlrpc::scalar::parse_double("3.14159265358979", d); return (size_t)d; });
+	bench("scalar/boolean/parse", [&]() { tinyxmlrpc::scalar::parse_boolean("true", b); return b; });
+	bench("scalar/time/format/sprintf", [&]() {
+		return sprintf(buf, "%04d%02d%02dT%02d:%02d:%02d", tmTime.tm_year + 1900, tmTime.tm_mon,
+			tmTime.tm_mday, tmTime.tm_hour, tmTime.tm_min, tmTime.tm_sec);
+	});
+	bench("scalar/time/format", [&]() { return tinyxmlrpc::scalar::format_time(buf, tmTime); });
+	bench("scalar/time/parse", [&]() { tinyxmlrpc::scalar::parse_time("20090201T12:34:56", tmTime); return tmTime.tm_sec; });
+}
+
+static tinyxmlrpc::value deep_struct(int depth) {
+	tinyxmlrpc::value::Struct node;
+	node["level"] = depth;
+	node["name"] = "node";
+	node["weight"] = depth * 0.5;
+	if (depth > 0)
+		node["child"] = deep_struct(depth - 1);
+	return node;
+}
+
+static tinyxmlrpc::value wide_array(int width) {
+	tinyxmlrpc::value::Array items;
+	items.reserve(width);
+	for(int n = 0; n < width; n++) {
+		if (n % 3 == 0)
+			items.push_back(n);
+		else if (n % 3 == 1)
+			items.push_back(n * 0.25);
+		else
+			items.push_back("item");
+	}
+	return items;
+}
+
+static tinyxmlrpc::value big_blob(size_t size) {
+	tinyxmlrpc::value::Binary blob(size);
+	for(size_t n = 0; n < size; n++)
+		blob[n] = (char)(n * 131 + 7);
+	return blob;
+}
+
+static void bench_throughput() {
+	struct {
+		const char* serialize;
+		const char* parse;
+		const char* parse_lazy;
+		tinyxmlrpc::value payload;
+	} cases[] = {
+		{ "serialize/deep_struct", "parse/deep_struct", "parse_lazy/deep_struct", deep_struct(64) },
+		{ "serialize/wide_array", "parse/wide_array", "parse_lazy/wide_array", wide_array(10000) },
+		{ "serialize/big_blob", "parse/big_blob", "parse_lazy/big_blob", big_blob(1 << 20) },
+	};
+	for(size_t n = 0; n < sizeof(cases) / sizeof(cases[0]); n++) {
+		tinyxmlrpc::value& payload = cases[n].payload;
+		std::string strXml = tinyxmlrpc::serialize(payload);
+		bench(cases[n].serialize, strXml.size(), [&]() {
+			return tinyxmlrpc::serialize(payload).size();
+		});
+		bench(cases[n].parse, strXml.size(), [&]() {
+			return tinyxmlrpc::parse(strXml).size();
+		});
+		bench(cases[n].parse_lazy, strXml.size(), [&]() {
+			return tinyxmlrpc::parse_lazy(strXml).to_value().size();
+		});
+	}
+}
+
+static void bench_parallel() {
+	tinyxmlrpc::value::Array rows;
+	for(int n = 0; n < 20000; n++) {
+		tinyxmlrpc::value::Struct row;
+		row["id"] = n;
+		row["name"] = "row <name> & value";
+		row["weight"] = n * 0.25;
+		row["tags"] = wide_array(4);
+		rows.push_back(row);
+	}
+	tinyxmlrpc::value response = rows;
+	std::string strXml = tinyxmlrpc::serialize(response);
+	static const int threads[] = { 1, 2, 4, 8 };
+	double serialize_base = 0, parse_base = 0;
+	for(size_t n = 0; n < sizeof(threads) / sizeof(threads[0]); n++) {
+		char name[64];
+		sprintf(name, "parallel/serialize/%dt", threads[n]);
+		double ns = bench(name, strXml.size(), [&]() {
+			return tinyxmlrpc::serialize(response, threads[n]).size();
+		});
+		if (n == 0)
+			serialize_base = ns;
+		else if (serialize_base > 0 && ns > 0) {
+			sprintf(name, "parallel/serialize/%dt/speedup", threads[n]);
+			report(name, threads[n], serialize_base / ns, "x");
+		}
+		sprintf(name, "parallel/parse/%dt", threads[n]);
+		ns = bench(name, strXml.size(), [&]() {
+			return tinyxmlrpc::parse(strXml, threads[n]).size();
+		});
+		if (n == 0)
+			parse_base = ns;
+		else if (parse_base > 0 && ns > 0) {
+			sprintf(name, "parallel/parse/%dt/speedup", threads[n]);
+			report(name, threads[n], parse_base / ns, "x");
+		}
+	}
+}
+
+static void bench_value() {
+	tinyxmlrpc::value deep = deep_struct(64);
+	tinyxmlrpc::value wide = wide_array(10000);
+
+	bench("value/construct/deep_struct", [&]() { return deep_struct(64).size(); });
+	bench("value/construct/wide_array", [&]() { return wide_array(10000).size(); });
+	bench("value/copy/deep_struct", [&]() {
+		tinyxmlrpc::value copy = deep;
+		return copy.size();
+	});
+	bench("value/copy+detach/wide_array", [&]() {
+		tinyxmlrpc::value copy = wide;
+		copy[0] = 1;
+		return copy.size();
+	});
+	bench("value/destroy/wide_array", [&]() {
+		tinyxmlrpc::value* tmp = new tinyxmlrpc::value(wide_array(1000));
+		size_t size = tmp->size();
+		delete tmp;
+		return size;
+	});
+}
+
+static tinyxmlrpc::value echo(tinyxmlrpc::value::Array& params) {
+	return params.empty() ? tinyxmlrpc::value() : params[0];
+}
+
+/* listens on a free loopback port and starts srv; url is its address */
+static bool start_loopback(tinyxmlrpc::server& srv, char (&url)[64]) {
+	int port = srv.listen("127.0.0.1", 0);
+	if (port < 0) {
+		fprintf(stderr, "bench: cannot listen on loopback\n");
+		return false;
+	}
+	srv.start();
+	sprintf(url, "http://127.0.0.1:%d/RPC2", port);
+	return true;
+}
+
+static void bench_roundtrip() {
+	tinyxmlrpc::server srv;
+	srv.add_method("echo", echo);
+	char url[64];
+	if (!start_loopback(srv, url))
+		return;
+
+	struct {
+		const char* name;
+		tinyxmlrpc::value payload;
+	} cases[] = {
+		{ "call/echo/int", 42 },
+		{ "call/echo/deep_struct", deep_struct(16) },
+		{ "call/echo/wide_array", wide_array(1000) },
+		{ "call/echo/big_blob", big_blob(64 << 10) },
+	};
+	for(size_t n = 0; n < sizeof(cases) / sizeof(cases[0]); n++) {
+		tinyxmlrpc::value::Array requests;
+		requests.push_back(cases[n].payload);
+		size_t bytes = tinyxmlrpc::serialize("echo", requests).size();
+		bench(cases[n].name, bytes, [&]() {
+			tinyxmlrpc::value response = tinyxmlrpc::call(url, "echo", requests);
+			if (tinyxmlrpc::failed(response)) {
+				fprintf(stderr, "bench: %s failed\n", cases[n].name);
+				exit(1);
+			}
+			return response.size();
+		});
+	}
+
+	tinyxmlrpc::value::Array requests;
+	requests.push_back(42);
+	tinyxmlrpc::enable_stats(true);
+	bench("call/echo/int+stats", [&]() {
+		return tinyxmlrpc::call(url, "echo", requests).getInt();
+	});
+	tinyxmlrpc::enable_stats(false);
+	const tinyxmlrpc::method_stats* stats = tinyxmlrpc::find_stats("echo");
+	if (stats == NULL) {
+		srv.stop();
+		return;
+	}
+	report("call/echo/int+stats/p50", stats->calls, stats->latency.percentile(50) * 1e9, "ns");
+	report("call/echo/int+stats/p99", stats->calls, stats->latency.percentile(99) * 1e9, "ns");
+	srv.stop();
+}
+
+/* one keep-alive client over loopback TCP, a Unix domain socket and shared memory */
+static void bench_transport() {
+	tinyxmlrpc::server tcp, uds;
+	tcp.add_method("echo", echo);
+	uds.add_method("echo", echo);
+	char tcp_url[64];
+	if (!start_loopback(tcp, tcp_url))
+		return;
+	char path[64];
+	sprintf(path, "/tmp/tinyxmlrpc-bench-%d.sock", (int)getpid());
+	char shm_name[64];
+	sprintf(shm_name, "tinyxmlrpc-bench-%d", (int)getpid());
+	if (uds.listen_unix(path) < 0 || uds.listen_shm(shm_name, 1, 16, 1 << 20) < 0) {
+		fprintf(stderr, "bench: cannot listen on %s or shm %s\n", path, shm_name);
+		tcp.stop();
+		return;
+	}
+	uds.start();
+	char unix_url[96], shm_url[96];
+	sprintf(unix_url, "unix://%s", path);
+	sprintf(shm_url, "shm://%s", shm_name);
+
+	struct {
+		const char* name;
+		const char* url;
+	} transports[] = {
+		{ "transport/tcp", tcp_url },
+		{ "transport/unix", unix_url },
+		{ "transport/shm", shm_url },
+	};
+	struct {
+		const char* name;
+		tinyxmlrpc::value payload;
+	} cases[] = {
+		{ "int", 42 },
+		{ "big_blob", big_blob(256 << 10) },
+	};
+	for(size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		tinyxmlrpc::value::Array requests;
+		requests.push_back(cases[c].payload);
+		size_t bytes = tinyxmlrpc::serialize("echo", requests).size();
+		for(size_t t = 0; t < sizeof(transports) / sizeof(transports[0]); t++) {
+			std::string name = std::string(transports[t].name) + "/" + cases[c].name;
+			if (!selected(name.c_str())) continue;
+			tinyxmlrpc::client client(transports[t].url);
+			tinyxmlrpc::latency_histogram latency;
+			bench(name.c_str(), bytes, [&]() {
+				double start = now();
+				tinyxmlrpc::value response = client.call("echo", requests);
+				latency.record(now() - start);
+				if (tinyxmlrpc::failed(response)) {
+					fprintf(stderr, "bench: %s failed\n", name.c_str());
+					exit(1);
+				}
+				return response.size();
+			});
+			report((name + "/p50").c_str(), latency.count(), latency.percentile(50) * 1e9, "ns");
+			report((name + "/p99").c_str(), latency.count(), latency.percentile(99) * 1e9, "ns");
+		}
+	}
+	uds.stop();
+	tcp.stop();
+}
+
+/*
+ * Server-side response writing: a handler result rendered per call,
+ * the same result registered with add_constant(), and a thrown fault.
+ */
+static void bench_server() {
+	tinyxmlrpc::value result = wide_array(2000);
+	tinyxmlrpc::server srv;
+	srv.add_method("result", [&](tinyxmlrpc::value::Array&) { return result; });
+	srv.add_constant("constant", result);
+	srv.add_method("fault", [](tinyxmlrpc::value::Array&) -> tinyxmlrpc::value {
+		throw tinyxmlrpc::value::Exception("permission denied", 403);
+	});
+	char url[64];
+	if (!start_loopback(srv, url))
+		return;
+	tinyxmlrpc::value::Array none;
+	std::string bodies[] = {
+		tinyxmlrpc::serialize("result", none),
+		tinyxmlrpc::serialize("constant", none),
+		tinyxmlrpc::serialize("fault", none),
+	};
+	const char* names[] = { "server/result/wide-2000", "server/constant/wide-2000", "server/fault" };
+	std::map<std::string, std::string> headers;
+	for(int n = 0; n < 3; n++) {
+		std::string response;
+		tinyxmlrpc::post(url, "", bodies[n], response, headers);
+		bench(names[n], response.size(), [&]() {
+			tinyxmlrpc::post(url, "", bodies[n], response, headers);
+			return response.size();
+		});
+	}
+	srv.stop();
+}
+
+/*
+ * The first call a fresh thread makes, with and without warmup() run on
+ * that thread beforehand (not timed), against the same call once the
+ * connection is in steady use.
+ */
+static void bench_warmup() {
+	tinyxmlrpc::server srv;
+	srv.add_method("echo", echo);
+	char url[64];
+	if (!start_loopback(srv, url))
+		return;
+	std::vector<std::string> urls(1, url);
+	tinyxmlrpc::value::Array requests;
+	requests.push_back(42);
+
+	const char* names[] = { "warmup/first-call/cold", "warmup/first-call/warmed" };
+	for(int warm = 0; warm < 2; warm++) {
+		if (!selected(names[warm])) continue;
+		long calls = 0;
+		double spent = 0, start = now();
+		while (now() - start < min_time) {
+			std::thread([&]() {
+				if (warm)
+					tinyxmlrpc::warmup(urls);
+				double begin = now();
+				sink = sink + tinyxmlrpc::call(url, "echo", requests).getInt();
+				spent += now() - begin;
+			}).join();
+			calls++;
+		}
+		report(names[warm], calls, spent * 1e9 / calls, "ns/op");
+	}
+	bench("warmup/steady", [&]() {
+		return tinyxmlrpc::call(url, "echo", requests).getInt();
+	});
+	srv.stop();
+}
+
+/*
+ * Concurrent callers against a backend that takes 1ms per call: one
+ * HTTP/1.1 client (and connection) per caller, against a single shared
+ * http2_client multiplexing every caller over one connection.
+ */
+static void bench_http2() {
+	tinyxmlrpc::server srv;
+	srv.add_method("wait", [](tinyxmlrpc::value::Array& params) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return params.empty() ? tinyxmlrpc::value() : params[0];
+	});
+	char url[64];
+	if (!start_loopback(srv, url))
+		return;
+
+	static const int callers[] = { 1, 16, 64 };
+	for(size_t n = 0; n < sizeof(callers) / sizeof(callers[0]); n++) {
+		char name[64];
+		sprintf(name, "concurrent/http1-pool/%dc", callers[n]);
+		std::vector<tinyxmlrpc::client*> pool;
+		for(int c = 0; c < callers[n]; c++)
+			pool.push_back(new tinyxmlrpc::client(url));
+		bench_concurrent(name, callers[n], [&](int thread) {
+			tinyxmlrpc::value::Array requests;
+			requests.push_back(thread);
+			return pool[thread]->call("wait", requests).getInt();
+		});
+		for(int c = 0; c < callers[n]; c++)
+			delete pool[c];
+
+		sprintf(name, "concurrent/http2/%dc", callers[n]);
+		tinyxmlrpc::http2_client shared(url);
+		bench_concurrent(name, callers[n], [&](int thread) {
+			tinyxmlrpc::value::Array requests;
+			requests.push_back(thread);
+			return shared.call("wait", requests).getInt();
+		});
+	}
+	srv.stop();
+}
+
+/* free call() and parse() from several threads at once; the per-thread
+ * curl handle and parser context should keep ns/op flat as threads grow */
+static void bench_threads() {
+	tinyxmlrpc::server srv;
+	srv.add_method("echo", echo);
+	char url[64];
+	if (!start_loopback(srv, url))
+		return;
+	tinyxmlrpc::value response = wide_array(100);
+	std::string xml = tinyxmlrpc::serialize(response);
+
+	static const int threads[] = { 1, 2, 4, 8 };
+	for(size_t n = 0; n < sizeof(threads) / sizeof(threads[0]); n++) {
+		char name[64];
+		sprintf(name, "threads/call/%dt", threads[n]);
+		bench_concurrent(name, threads[n], [&](int thread) {
+			tinyxmlrpc::value::Array requests;
+			requests.push_back(thread);
+			return tinyxmlrpc::call(url, "echo", requests).getInt();
+		});
+		sprintf(name, "threads/parse/%dt", threads[n]);
+		bench_concurrent(name, threads[n], [&](int) {
+			return tinyxmlrpc::parse(xml).size();
+		});
+	}
+	srv.stop();
+}
+
+static void bench_template() {
+	tinyxmlrpc::value::Array params;
+	params.push_back("0123456789abcdef");
+	params.push_back("blog-1234");
+	params.push_back("user");
+	params.push_back("secret & <password>");
+	params.push_back(20);
+	tinyxmlrpc::request_template tmpl("metaWeblog.getRecentPosts");
+	tmpl << params[0] << tinyxmlrpc::value() << params[2] << params[3] << tinyxmlrpc::value();
+	std::vector<tinyxmlrpc::value> args;
+	args.push_back(params[1]);
+	args.push_back(params[4]);
+	std::string out;
+
+	bench("template/serialize", [&]() {
+		return tinyxmlrpc::serialize("metaWeblog.getRecentPosts", params).size();
+	});
+	bench("template/render", [&]() {
+		tmpl.render(args, out);
+		return out.size();
+	});
+}
+
+/* telling a fault from a result, and reading an HTTP error page */
+/*
+ * The text kernels on their own and behind serialize()/parse_lazy(), over
+ * a blog post body: mostly plain text and UTF-8 with some markup.
+ */
+static void bench_text() {
+	std::string plain(1 << 20, 'x'), post;
+	while (post.size() < (1 << 20))
+		post += "\xe4\xbb\x8a\xe6\x97\xa5\xe3\x81\xaf\xe3\x80\x81wassr\xe3\x81\xa7hasegawa\xe3\x81\xab "
+			"<a href=\"http://example.com/?a=1&b=2\">link</a> and some plain words, \"quoted\" too.\r\n";
+	std::string escaped;
+	tinyxmlrpc::detail::write_escaped(escaped, post.data(), post.size());
+
+	bench("text/escape_span/plain-1M", plain.size(), [&]() {
+		return tinyxmlrpc::detail::escape_span(plain.data(), plain.size());
+	});
+	bench("text/text_span/plain-1M", plain.size(), [&]() {
+		return tinyxmlrpc::detail::text_span(plain.data(), plain.size());
+	});
+	std::string out;
+	bench("text/write_escaped/post-1M", post.size(), [&]() {
+		out.clear();
+		tinyxmlrpc::detail::write_escaped(out, post.data(), post.size());
+		return out.size();
+	});
+	bench("text/decode_text/post-1M", escaped.size(), [&]() {
+		out.clear();
+		tinyxmlrpc::detail::decode_text(escaped.data(), escaped.data() + escaped.size(), out);
+		return out.size();
+	});
+
+	tinyxmlrpc::value value(post);
+	std::string document = tinyxmlrpc::serialize(value);
+	bench("text/serialize/post-1M", post.size(), [&]() {
+		return tinyxmlrpc::serialize(value).size();
+	});
+	bench("text/parse_lazy/post-1M", document.size(), [&]() {
+		return tinyxmlrpc::parse_lazy(document).getString().size();
+	});
+}
+
+static void bench_fault() {
+	std::string fault = tinyxmlrpc::value::Exception(std::string(1 << 20, 'e'), 42).to_xml();
+	tinyxmlrpc::value response = wide_array(20000);
+	std::string result = tinyxmlrpc::serialize(response);
+	std::string page = "<html><head><title>502 Bad Gateway</title></head>\r\n<body><table>\r\n";
+	while (page.size() < (1 << 20))
+		page += "<tr><td class=\"k\">upstream</td>\r\n\t<td>connect() failed &amp; retried</td></tr>\r\n";
+	page += "</table></body></html>\r\n";
+
+	bench("fault/failed-raw/fault-1M", fault.size(), [&]() {
+		return tinyxmlrpc::failed(fault);
+	});
+	bench("fault/failed-raw/result", result.size(), [&]() {
+		return tinyxmlrpc::failed(result);
+	});
+	bench("fault/parse/fault-1M", fault.size(), [&]() {
+		return tinyxmlrpc::parse(fault).getType();
+	});
+	bench("fault/extract/html-1M", page.size(), [&]() {
+		return tinyxmlrpc::extract_failt_message(page).size();
+	});
+}
+
+static void bench_trace() {
+#ifdef TINYXMLRPC_TRACE
+	bench("trace/span", [&]() {
+		TINYXMLRPC_TRACE_SPAN("bench");
+		return 1;
+	});
+#endif
+}
+
+int main(int argc, char* argv[]) {
+	const char* trace_file = NULL;
+	for(int n = 1; n < argc; n++) {
+		if (!strcmp(argv[n], "--json"))
+			json_output = true;
+		else if (!strcmp(argv[n], "--time") && n + 1 < argc)
+			min_time = atof(argv[++n]);
+		else if (!strcmp(argv[n], "--filter") && n + 1 < argc)
+			filter = argv[++n];
+		else if (!strcmp(argv[n], "--trace") && n + 1 < argc)
+			trace_file = argv[++n];
+		else {
+			fprintf(stderr, "usage: %s [--json] [--time seconds] [--filter substring] [--trace file]\n", argv[0]);
+			return 1;
+		}
+	}
+	bench_trace();
+	bench_text();
+	bench_fault();
+	bench_template();
+	bench_throughput();
+	bench_parallel();
+	bench_value();
+	bench_roundtrip();
+	bench_http2();
+	bench_server();
+	bench_warmup();
+	bench_threads();
+	bench_transport();
+	bench_binding();
+	bench_struct();
+	bench_lazy();
+	bench_copy();
+	bench_scalar();
+#ifdef TINYXMLRPC_TRACE
+	if (trace_file) {
+		FILE* fp = fopen(trace_file, "w");
+		if (fp) {
+			fputs(tinyxmlrpc::trace::chrome_json().c_str(), fp);
+			fclose(fp);
+		}
+	}
+#else
+	if (trace_file)
+		fprintf(stderr, "bench: built without TINYXMLRPC_TRACE, no trace written\n");
+#endif
+	return 0;
+}
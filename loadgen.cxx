@@ -0,0 +1,386 @@
+#include "tinyxmlrpc.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <signal.h>
+#include <unistd.h>
+
+/*
+ * loadgen [options] URL[,URL...] METHOD [PARAM...]
+ * loadgen --serve [--port N | --unix PATH] [--shm NAME] [--delay ms]
+ *
+ * Drives an XML-RPC endpoint from -c concurrent connections for -d
+ * seconds and reports throughput and latency percentiles. Each PARAM is a
+ * template that is re-rendered for every request:
+ *
+ *   int:V  int:A-B  double:A-B  bool  str=TEXT  str:N  blob:N
+ *
+ * (a constant, a uniform random range, random alphanumerics or random
+ * bytes of length N). With -R the generator runs open-loop at a constant
+ * total rate and measures latency from each request's scheduled start,
+ * so a stalled server is not hidden by coordinated omission. -t sets a
+ * per-call deadline and --hedge adds a replica for hedged requests.
+ * --http2 shares one multiplexed HTTP/2 connection between all workers. A
+ * comma-separated URL list is spread over by an endpoint_group, with
+ * power-of-two-choices unless --least-outstanding is given. --limit puts
+ * each endpoint behind an adaptive concurrency limiter (aimd or gradient);
+ * calls wait up to --queue-timeout seconds for a slot, else are rejected.
+ *
+ * --serve runs the bundled stand-in server with echo, sum and sleep;
+ * --delay adds latency to echo. It answers HTTP/1.1 and h2c alike, on a
+ * TCP port or, with --unix, on a Unix domain socket for unix:// URLs.
+ * --shm also serves shm://NAME through shared memory.
+ */
+
+typedef std::chrono::steady_clock clock_type;
+
+static double seconds(clock_type::duration d) {
+	return std::chrono::duration<double>(d).count();
+}
+
+struct param_template {
+	enum { Int, Double, Bool, Str, RandStr, Blob } kind;
+	double lo, hi;
+	std::string text;
+	size_t size;
+};
+
+static bool parse_template(const std::string& spec, param_template& t) {
+	t.lo = t.hi = 0;
+	t.size = 0;
+	if (spec == "bool") {
+		t.kind = param_template::Bool;
+		return true;
+	}
+	if (spec.compare(0, 4, "str=") == 0) {
+		t.kind = param_template::Str;
+		t.text = spec.substr(4);
+		return true;
+	}
+	size_t colon = spec.find(':');
+	if (colon == std::string::npos) return false;
+	std::string kind = spec.substr(0, colon), arg = spec.substr(colon + 1);
+	if (kind == "str" || kind == "blob") {
+		t.kind = kind == "str" ? param_template::RandStr : param_template::Blob;
+		t.size = strtoul(arg.c_str(), NULL, 10);
+		return true;
+	}
+	if (kind != "int" && kind != "double") return false;
+	t.kind = kind == "int" ? param_template::Int : param_template::Double;
+	size_t dash = arg.find('-', 1);
+	t.lo = atof(arg.substr(0, dash).c_str());
+	t.hi = dash == std::string::npos ? t.lo : atof(arg.substr(dash + 1).c_str());
+	return t.lo <= t.hi;
+}
+
+static tinyxmlrpc::value render(const param_template& t, std::mt19937_64& rng) {
+	static const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	switch (t.kind) {
+	case param_template::Int:
+		return (int)std::uniform_int_distribution<long long>((long long)t.lo, (long long)t.hi)(rng);
+	case param_template::Double:
+		return std::uniform_real_distribution<double>(t.lo, t.hi)(rng);
+	case param_template::Bool:
+		return (bool)(rng() & 1);
+	case param_template::Str:
+		return t.text;
+	case param_template::RandStr: {
+		std::string s(t.size, ' ');
+		for(size_t n = 0; n < t.size; n++)
+			s[n] = alnum[rng() % (sizeof(alnum) - 1)];
+		return s;
+	}
+	case param_template::Blob: {
+		tinyxmlrpc::value::Binary b(t.size);
+		for(size_t n = 0; n < t.size; n++)
+			b[n] = (char)rng();
+		return b;
+	}
+	}
+	return tinyxmlrpc::value();
+}
+
+struct options {
+	std::string url;
+	std::string method;
+	std::vector<param_template> params;
+	int connections;
+	double duration;
+	double rate;
+	bool reuse;
+	tinyxmlrpc::call_options call;
+	tinyxmlrpc::endpoint_group* group;
+	tinyxmlrpc::http2_client* http2;
+};
+
+struct worker_result {
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long faults;
+	unsigned long rejected;
+	unsigned long bytes;
+	worker_result() : calls(0), errors(0), faults(0), rejected(0), bytes(0) {}
+};
+
+static void worker(const options& opt, int id, clock_type::time_point start,
+		tinyxmlrpc::latency_histogram& latency, worker_result& result) {
+	std::mt19937_64 rng(0x9e3779b97f4a7c15ULL * (id + 1));
+	tinyxmlrpc::client client(opt.url);
+	client.options() = opt.call;
+	clock_type::time_point stop = start + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(opt.duration));
+	double interval = opt.rate > 0 ? opt.connections / opt.rate : 0;
+	/* stagger the open-loop schedules so the connections do not fire in step */
+	clock_type::time_point next = start + std::chrono::duration_cast<clock_type::duration>(
+		std::chrono::duration<double>(interval * id / opt.connections));
+
+	while (true) {
+		clock_type::time_point intended = clock_type::now();
+		if (interval > 0) {
+			if (next >= stop) break;
+			std::this_thread::sleep_until(next);
+			intended = next;
+			next += std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(interval));
+		} else if (intended >= stop)
+			break;
+
+		tinyxmlrpc::value::Array requests;
+		for(size_t n = 0; n < opt.params.size(); n++)
+			requests.push_back(render(opt.params[n], rng));
+		tinyxmlrpc::call_stats stats;
+		tinyxmlrpc::value response;
+		if (opt.group)
+			response = opt.group->call(opt.method, requests, stats);
+		else if (opt.http2)
+			response = opt.http2->call(opt.method, requests, stats);
+		else if (opt.reuse)
+			response = client.call(opt.method, requests, stats);
+		else {
+			tinyxmlrpc::client once(opt.url);
+			once.options() = opt.call;
+			response = once.call(opt.method, requests, stats);
+		}
+		latency.record(seconds(clock_type::now() - intended));
+		result.calls++;
+		result.bytes += stats.request_bytes + stats.response_bytes;
+		if (stats.result == -4)
+			result.rejected++;
+		else if (stats.result != 0)
+			result.errors++;
+		else if (stats.fault)
+			result.faults++;
+	}
+}
+
+static int run(const options& opt) {
+	std::vector<tinyxmlrpc::latency_histogram*> latencies;
+	std::vector<worker_result> results(opt.connections);
+	std::vector<std::thread> threads;
+	clock_type::time_point start = clock_type::now();
+	for(int n = 0; n < opt.connections; n++) {
+		latencies.push_back(new tinyxmlrpc::latency_histogram);
+		threads.push_back(std::thread(worker, std::cref(opt), n, start,
+			std::ref(*latencies[n]), std::ref(results[n])));
+	}
+	for(size_t n = 0; n < threads.size(); n++)
+		threads[n].join();
+	double elapsed = seconds(clock_type::now() - start);
+
+	tinyxmlrpc::latency_histogram total;
+	worker_result sum;
+	for(int n = 0; n < opt.connections; n++) {
+		sum.calls += results[n].calls;
+		sum.errors += results[n].errors;
+		sum.faults += results[n].faults;
+		sum.rejected += results[n].rejected;
+		sum.bytes += results[n].bytes;
+		total.merge(*latencies[n]);
+		delete latencies[n];
+	}
+
+	printf("%d connections, %.1f s, %s, %s\n", opt.connections, elapsed,
+		opt.rate > 0 ? "open loop" : "closed loop",
+		opt.http2 ? "HTTP/2 multiplexed" : opt.reuse ? "keep-alive" : "new connection per call");
+	printf("  requests  %lu (%lu errors, %lu faults, %lu rejected)\n", sum.calls, sum.errors, sum.faults, sum.rejected);
+	const tinyxmlrpc::method_stats* hedged = tinyxmlrpc::find_stats(opt.method);
+	if (!opt.call.hedge_urls.empty() && hedged)
+		printf("  hedges    %lu fired, %lu won\n", (unsigned long)hedged->hedges, (unsigned long)hedged->hedge_wins);
+	printf("  rate      %.1f req/s, %.2f MB/s\n", sum.calls / elapsed, sum.bytes / elapsed / 1e6);
+	printf("  latency   p50 %.3f ms  p75 %.3f ms  p90 %.3f ms  p99 %.3f ms  p99.9 %.3f ms  max %.3f ms\n",
+		total.percentile(50) * 1e3, total.percentile(75) * 1e3, total.percentile(90) * 1e3,
+		total.percentile(99) * 1e3, total.percentile(99.9) * 1e3, total.max() * 1e3);
+	if (opt.group) {
+		std::vector<tinyxmlrpc::endpoint_group::endpoint> endpoints = opt.group->snapshot();
+		for(size_t n = 0; n < endpoints.size(); n++)
+			printf("  replica   %s: %lu calls, %lu failures, %lu ejections, ewma %.3f ms\n",
+				endpoints[n].url.c_str(), endpoints[n].calls, endpoints[n].failures,
+				endpoints[n].ejections, endpoints[n].latency * 1e3);
+	}
+	if (opt.call.limit_concurrency) {
+		std::vector<std::string> urls;
+		if (opt.group) {
+			std::vector<tinyxmlrpc::endpoint_group::endpoint> endpoints = opt.group->snapshot();
+			for(size_t n = 0; n < endpoints.size(); n++)
+				urls.push_back(endpoints[n].url);
+		} else
+			urls.push_back(opt.url);
+		for(size_t n = 0; n < urls.size(); n++) {
+			tinyxmlrpc::concurrency_limiter* limiter = tinyxmlrpc::endpoint_limiter(urls[n]);
+			printf("  limiter   %s: limit %d, %lu rejected\n", urls[n].c_str(), limiter->limit(), limiter->rejected());
+		}
+	}
+	return sum.errors ? 1 : 0;
+}
+
+static int serve(int port, const std::string& unix_path, const std::string& shm_name, int delay_ms) {
+	tinyxmlrpc::server srv;
+	srv.add_method("echo", [delay_ms](tinyxmlrpc::value::Array& params) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+		return params.empty() ? tinyxmlrpc::value() : params[0];
+	});
+	srv.add_method("sum", [](tinyxmlrpc::value::Array& params) {
+		double total = 0;
+		for(size_t n = 0; n < params.size(); n++)
+			total += params[n].getType() == tinyxmlrpc::value::TypeDouble ? (double)params[n] : params[n].getInt();
+		return tinyxmlrpc::value(total);
+	});
+	srv.add_method("sleep", [](tinyxmlrpc::value::Array& params) {
+		int ms = params.empty() ? 0 : params[0].getInt();
+		std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+		return tinyxmlrpc::value(ms);
+	});
+	if (!unix_path.empty()) {
+		if (srv.listen_unix(unix_path) < 0) {
+			fprintf(stderr, "loadgen: cannot listen on %s\n", unix_path.c_str());
+			return 1;
+		}
+		printf("listening on %s\n", unix_path.c_str());
+	} else {
+		if (srv.listen("", port) < 0) {
+			fprintf(stderr, "loadgen: cannot listen on port %d\n", port);
+			return 1;
+		}
+		printf("listening on port %d\n", srv.port());
+	}
+	if (!shm_name.empty()) {
+		if (srv.listen_shm(shm_name) < 0) {
+			fprintf(stderr, "loadgen: cannot create shared memory segment %s\n", shm_name.c_str());
+			return 1;
+		}
+		printf("serving shm://%s\n", shm_name.c_str());
+	}
+	fflush(stdout);
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	srv.start();
+	int sig;
+	sigwait(&set, &sig);
+	srv.stop();
+	return 0;
+}
+
+static int usage(const char* name) {
+	fprintf(stderr,
+		"usage: %s [-c connections] [-d seconds] [-R rate] [-t timeout] [--hedge URL] [--no-reuse]\n"
+		"       [--http2] [--least-outstanding] [--limit aimd|gradient] [--queue-timeout s]\n"
+		"       URL[,URL...] METHOD [PARAM...]\n"
+		"       %s --serve [--port N | --unix PATH] [--shm NAME] [--delay ms]\n"
+		"PARAM: int:V int:A-B double:A-B bool str=TEXT str:N blob:N\n", name, name);
+	return 1;
+}
+
+int main(int argc, char* argv[]) {
+	options opt;
+	opt.connections = 1;
+	opt.duration = 10;
+	opt.rate = 0;
+	opt.reuse = true;
+	bool serving = false;
+	int port = 8080, delay_ms = 0;
+	bool least_outstanding = false, http2 = false;
+	tinyxmlrpc::concurrency_limiter::algorithm limit_algorithm = tinyxmlrpc::concurrency_limiter::Gradient;
+	std::string unix_path, shm_name;
+	std::vector<std::string> args;
+	for(int n = 1; n < argc; n++) {
+		std::string arg = argv[n];
+		if (arg == "-c" && n + 1 < argc)
+			opt.connections = atoi(argv[++n]);
+		else if (arg == "-d" && n + 1 < argc)
+			opt.duration = atof(argv[++n]);
+		else if (arg == "-R" && n + 1 < argc)
+			opt.rate = atof(argv[++n]);
+		else if (arg == "-t" && n + 1 < argc)
+			opt.call.timeout = atof(argv[++n]);
+		else if (arg == "--hedge" && n + 1 < argc)
+			opt.call.hedge_urls.push_back(argv[++n]);
+		else if (arg == "--no-reuse")
+			opt.reuse = false;
+		else if (arg == "--http2")
+			http2 = true;
+		else if (arg == "--serve")
+			serving = true;
+		else if (arg == "--port" && n + 1 < argc)
+			port = atoi(argv[++n]);
+		else if (arg == "--unix" && n + 1 < argc)
+			unix_path = argv[++n];
+		else if (arg == "--shm" && n + 1 < argc)
+			shm_name = argv[++n];
+		else if (arg == "--delay" && n + 1 < argc)
+			delay_ms = atoi(argv[++n]);
+		else if (arg == "--least-outstanding")
+			least_outstanding = true;
+		else if (arg == "--limit" && n + 1 < argc) {
+			std::string name = argv[++n];
+			if (name != "aimd" && name != "gradient")
+				return usage(argv[0]);
+			opt.call.limit_concurrency = true;
+			limit_algorithm = name == "aimd" ? tinyxmlrpc::concurrency_limiter::Aimd : tinyxmlrpc::concurrency_limiter::Gradient;
+		} else if (arg == "--queue-timeout" && n + 1 < argc)
+			opt.call.queue_timeout = atof(argv[++n]);
+		else if (arg[0] == '-')
+			return usage(argv[0]);
+		else
+			args.push_back(arg);
+	}
+	if (serving)
+		return serve(port, unix_path, shm_name, delay_ms);
+	if (args.size() < 2 || opt.connections < 1 || opt.duration <= 0)
+		return usage(argv[0]);
+	opt.url = args[0];
+	opt.group = NULL;
+	opt.http2 = NULL;
+	std::vector<std::string> urls;
+	size_t begin = 0, end;
+	do {
+		end = opt.url.find(',', begin);
+		urls.push_back(opt.url.substr(begin, end == std::string::npos ? end : end - begin));
+		begin = end + 1;
+	} while (end != std::string::npos);
+	if (opt.call.limit_concurrency)
+		for(size_t n = 0; n < urls.size(); n++)
+			tinyxmlrpc::endpoint_limiter(urls[n])->set_algorithm(limit_algorithm);
+	if (urls.size() > 1) {
+		opt.group = new tinyxmlrpc::endpoint_group(urls, least_outstanding ?
+			tinyxmlrpc::endpoint_group::LeastOutstanding : tinyxmlrpc::endpoint_group::PowerOfTwo);
+		opt.group->options() = opt.call;
+	} else if (http2) {
+		opt.http2 = new tinyxmlrpc::http2_client(opt.url);
+		opt.http2->options() = opt.call;
+	}
+	opt.method = args[1];
+	for(size_t n = 2; n < args.size(); n++) {
+		param_template t;
+		if (!parse_template(args[n], t)) {
+			fprintf(stderr, "loadgen: bad parameter template '%s'\n", args[n].c_str());
+			return usage(argv[0]);
+		}
+		opt.params.push_back(t);
+	}
+	int ret = run(opt);
+	delete opt.group;
+	delete opt.http2;
+	return ret;
+}
@@ -0,0 +1,164 @@
+#include "tinyxmlrpc.h"
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <deque>
+
+/*
+ * replay [--codec | --url URL | --local] [--max-speed] [--source C|S] FILE
+ *
+ * Feeds a capture file written by capture_start() through the codec
+ * (parse_call/serialize for requests, parse/serialize for responses), or
+ * re-sends the captured requests to URL or to an in-process stand-in
+ * server that answers with the captured responses. Requests go out at
+ * their original pacing unless --max-speed is given.
+ */
+
+static double now() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char* name, size_t count, size_t bytes, double elapsed, const tinyxmlrpc::latency_histogram& latency) {
+	printf("%-10s %8zu records %10.1f ops/s %10.1f MB/s  p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us\n",
+		name, count, count / elapsed, bytes / elapsed / 1e6,
+		latency.percentile(50) * 1e6, latency.percentile(90) * 1e6,
+		latency.percentile(99) * 1e6, latency.max() * 1e6);
+}
+
+static int replay_codec(std::vector<tinyxmlrpc::capture_record>& records) {
+	tinyxmlrpc::latency_histogram requests, responses;
+	size_t request_bytes = 0, response_bytes = 0;
+	double request_time = 0, response_time = 0;
+	for(size_t n = 0; n < records.size(); n++) {
+		tinyxmlrpc::capture_record& record = records[n];
+		double start = now();
+		std::string method;
+		tinyxmlrpc::value::Array params;
+		if (tinyxmlrpc::parse_call(record.request, method, params))
+			tinyxmlrpc::serialize(method, params);
+		double elapsed = now() - start;
+		requests.record(elapsed);
+		request_time += elapsed;
+		request_bytes += record.request.size();
+
+		if (record.result != 0) continue;
+		start = now();
+		tinyxmlrpc::value response = tinyxmlrpc::parse(record.response);
+		tinyxmlrpc::serialize(response);
+		elapsed = now() - start;
+		responses.record(elapsed);
+		response_time += elapsed;
+		response_bytes += record.response.size();
+	}
+	report("request", requests.count(), request_bytes, request_time, requests);
+	report("response", responses.count(), response_bytes, response_time, responses);
+	return 0;
+}
+
+static int replay_url(std::vector<tinyxmlrpc::capture_record>& records, std::string url, bool max_speed) {
+	tinyxmlrpc::latency_histogram latency;
+	std::map<std::string, std::string> headers;
+	size_t bytes = 0, errors = 0;
+	double start = now();
+	for(size_t n = 0; n < records.size(); n++) {
+		tinyxmlrpc::capture_record& record = records[n];
+		if (!max_speed) {
+			double due = start + (record.timestamp_ns - records[0].timestamp_ns) / 1e9;
+			double wait = due - now();
+			if (wait > 0)
+				std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+		}
+		std::string response;
+		double begin = now();
+		if (tinyxmlrpc::post(url, record.method, record.request, response, headers) != 0)
+			errors++;
+		latency.record(now() - begin);
+		bytes += record.request.size() + response.size();
+	}
+	report("call", records.size(), bytes, now() - start, latency);
+	if (errors)
+		fprintf(stderr, "replay: %zu calls failed\n", errors);
+	return errors ? 1 : 0;
+}
+
+static int replay_local(std::vector<tinyxmlrpc::capture_record>& records, bool max_speed) {
+	std::map<std::string, std::deque<tinyxmlrpc::value> > answers;
+	for(size_t n = 0; n < records.size(); n++)
+		if (records[n].result == 0)
+			answers[records[n].method].push_back(tinyxmlrpc::parse(records[n].response));
+
+	tinyxmlrpc::server srv;
+	std::map<std::string, std::deque<tinyxmlrpc::value> >::iterator it;
+	for(it = answers.begin(); it != answers.end(); it++) {
+		std::deque<tinyxmlrpc::value>* queue = &it->second;
+		srv.add_method(it->first, [queue](tinyxmlrpc::value::Array&) {
+			tinyxmlrpc::value answer = queue->front();
+			queue->push_back(answer);
+			queue->pop_front();
+			if (answer.getType() == tinyxmlrpc::value::TypeException)
+				throw answer.getException();
+			return answer;
+		});
+	}
+	int port = srv.listen("127.0.0.1", 0);
+	if (port < 0) {
+		fprintf(stderr, "replay: cannot listen on loopback\n");
+		return 1;
+	}
+	srv.start();
+	char url[64];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/RPC2", port);
+	int ret = replay_url(records, url, max_speed);
+	srv.stop();
+	return ret;
+}
+
+int main(int argc, char* argv[]) {
+	std::string url, filename;
+	bool local = false, max_speed = false;
+	char source = 'C';
+	for(int n = 1; n < argc; n++) {
+		std::string arg = argv[n];
+		if (arg == "--codec")
+			url = "", local = false;
+		else if (arg == "--url" && n + 1 < argc)
+			url = argv[++n];
+		else if (arg == "--local")
+			local = true;
+		else if (arg == "--max-speed")
+			max_speed = true;
+		else if (arg == "--source" && n + 1 < argc)
+			source = argv[++n][0];
+		else if (arg[0] != '-' && filename.empty())
+			filename = arg;
+		else {
+			filename = "";
+			break;
+		}
+	}
+	if (filename.empty()) {
+		fprintf(stderr, "usage: %s [--codec | --url URL | --local] [--max-speed] [--source C|S] FILE\n", argv[0]);
+		return 1;
+	}
+
+	tinyxmlrpc::capture_reader reader(filename);
+	if (!reader.good()) {
+		fprintf(stderr, "replay: %s is not a capture file, or not of this version\n", filename.c_str());
+		return 1;
+	}
+	std::vector<tinyxmlrpc::capture_record> records;
+	tinyxmlrpc::capture_record record;
+	while (reader.next(record))
+		if (record.source == source)
+			records.push_back(record);
+	if (records.empty()) {
+		fprintf(stderr, "replay: no records from source '%c'\n", source);
+		return 1;
+	}
+
+	if (local)
+		return replay_local(records, max_speed);
+	if (!url.empty())
+		return replay_url(records, url, max_speed);
+	return replay_codec(records);
+}
@@ -36,14 +36,12 @@ int main(int argc, char* argv[]) {
 				"metaWeblog.getRecentPosts",
 				(args.first() << "1" << user << pass << 3 << true).list());
 		if (!failed(res)) {
-			for(int n = 0; n < res.size(); n++) {
-				std::vector<std::string> members = res[n].listMembers();
-				std::vector<std::string>::const_iterator it;
+			for(int n = 0; n < (int)res.size(); n++) {
+				const tinyxmlrpc::value::Struct& members = res[n].getStruct();
+				tinyxmlrpc::value::Struct::const_iterator it;
 				std::cout << "{" << std::endl;
-				for(it = members.begin(); it != members.end(); it++) {
-					std::string val = res[n][*it].to_str();
-					std::cout << "  " << it->c_str() << "=" << val.c_str() << std::endl;
-				}
+				for(it = members.begin(); it != members.end(); it++)
+					std::cout << "  " << it->first << "=" << it->second.to_str() << std::endl;
 				std::cout << "}" << std::endl;
 			}
 		} else {
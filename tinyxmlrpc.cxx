@@ -21,15 +21,226 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <libxml/parser.h>
+#include <libxml/SAX2.h>
 #include <curl/curl.h>
 #include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <time.h>
 #include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <mutex>
+#include <unordered_map>
+#include <charconv>
+#include <chrono>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <exception>
+#if defined(TINYXMLRPC_TRACE_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(tinyxmlrpc, name, a, b)
+#else
+#define TRACE_PROBE2(name, a, b) ((void)0)
+#endif
 
 #include "tinyxmlrpc.h"
 
 namespace tinyxmlrpc {
 
+symbol::entry* symbol::intern(const char* s, size_t len) {
+	static std::mutex lock;
+	static std::unordered_map<std::string_view, entry*> table;
+	static thread_local entry* cache[256];
+
+	if (len == 0)
+		return 0;
+	unsigned int h = hash(s, len);
+	entry*& cached = cache[h & 255];
+	if (cached && cached->hash == h && cached->str.size() == len && !memcmp(cached->str.data(), s, len))
+		return cached;
+
+	std::unique_lock<std::mutex> guard(lock);
+	std::unordered_map<std::string_view, entry*>::const_iterator it = table.find(std::string_view(s, len));
+	if (it != table.end())
+		return cached = it->second;
+	bool full = table.size() >= max_interned || len > max_interned_size;
+	if (full)
+		guard.unlock();
+	entry* e = new entry;
+	e->str.assign(s, len);
+	e->hash = h;
+	e->interned = !full;
+	e->refs = 1;
+	if (full)
+		return e;
+	table.insert(std::make_pair(std::string_view(e->str), e));
+	return cached = e;
+}
+
+const std::string& symbol::empty() {
+	static const std::string empty_string;
+	return empty_string;
+}
+
+std::ostream& operator<<(std::ostream& os, const symbol& name) {
+	return os << name.str();
+}
+
+namespace scalar {
+
+static
+std::string_view trim(std::string_view text) {
+	while (!text.empty() && isspace((unsigned char)text.front())) text.remove_prefix(1);
+	while (!text.empty() && isspace((unsigned char)text.back())) text.remove_suffix(1);
+	return text;
+}
+
+template<class T>
+static
+bool parse_integer(std::string_view text, T& v) {
+	text = trim(text);
+	if (!text.empty() && text.front() == '+') text.remove_prefix(1);
+	const char* e = text.data() + text.size();
+	std::from_chars_result r = std::from_chars(text.data(), e, v);
+	return r.ec == std::errc() && r.ptr == e;
+}
+
+size_t format_int(char* buf, int v) {
+	char* e = std::to_chars(buf, buf + int_size - 1, v).ptr;
+	*e = 0;
+	return e - buf;
+}
+
+size_t format_i8(char* buf, long long v) {
+	char* e = std::to_chars(buf, buf + i8_size - 1, v).ptr;
+	*e = 0;
+	return e - buf;
+}
+
+size_t format_double(char* buf, double v) {
+	if (!isfinite(v))
+		throw value::Exception("type error: double is not finite", 4);
+	char* e = std::to_chars(buf, buf + double_size - 1, v, std::chars_format::fixed).ptr;
+	*e = 0;
+	return e - buf;
+}
+
+static
+char* format_digits(char* p, int v, int width) {
+	for (int n = width - 1; n >= 0; n--, v /= 10)
+		p[n] = '0' + v % 10;
+	return p + width;
+}
+
+size_t format_time(char* buf, const struct tm& t) {
+	char* p = buf;
+	int year = t.tm_year + 1900;
+	if (year >= 0 && year <= 9999)
+		p = format_digits(p, year, 4);
+	else
+		p = std::to_chars(p, p + 12, year).ptr;
+	p = format_digits(p, t.tm_mon < 0 || t.tm_mon > 99 ? 0 : t.tm_mon, 2);
+	p = format_digits(p, t.tm_mday < 0 || t.tm_mday > 99 ? 0 : t.tm_mday, 2);
+	*p++ = 'T';
+	p = format_digits(p, t.tm_hour < 0 || t.tm_hour > 99 ? 0 : t.tm_hour, 2);
+	*p++ = ':';
+	p = format_digits(p, t.tm_min < 0 || t.tm_min > 99 ? 0 : t.tm_min, 2);
+	*p++ = ':';
+	p = format_digits(p, t.tm_sec < 0 || t.tm_sec > 99 ? 0 : t.tm_sec, 2);
+	*p = 0;
+	return p - buf;
+}
+
+bool parse_int(std::string_view text, int& v) {
+	long long wide = 0;
+	if (!parse_integer(text, wide) || wide < INT_MIN || wide > INT_MAX)
+		return false;
+	v = (int)wide;
+	return true;
+}
+
+bool parse_i8(std::string_view text, long long& v) {
+	v = 0;
+	return parse_integer(text, v);
+}
+
+bool parse_double(std::string_view text, double& v) {
+	text = trim(text);
+	if (!text.empty() && text.front() == '+') text.remove_prefix(1);
+	const char* e = text.data() + text.size();
+	v = 0.0;
+	std::from_chars_result r = std::from_chars(text.data(), e, v);
+	return r.ec == std::errc() && r.ptr == e;
+}
+
+bool parse_boolean(std::string_view text, bool& v) {
+	text = trim(text);
+	v = text == "1" || text == "true";
+	return v || text == "0" || text == "false";
+}
+
+static
+bool parse_digits(const char*& p, const char* e, int width, int& v) {
+	if (e - p < width) return false;
+	v = 0;
+	for (int n = 0; n < width; n++, p++) {
+		if (*p < '0' || *p > '9') return false;
+		v = v * 10 + (*p - '0');
+	}
+	return true;
+}
+
+static
+bool parse_separator(const char*& p, const char* e, const char* accept) {
+	if (p < e && strchr(accept, *p)) {
+		p++;
+		return true;
+	}
+	return false;
+}
+
+bool parse_time(std::string_view text, struct tm& t) {
+	text = trim(text);
+	const char* p = text.data();
+	const char* e = p + text.size();
+	memset(&t, 0, sizeof(t));
+	int year, mon, mday, hour = 0, min = 0, sec = 0;
+	if (!parse_digits(p, e, 4, year)) return false;
+	bool dashed = parse_separator(p, e, "-/");
+	if (!parse_digits(p, e, 2, mon)) return false;
+	if (dashed && !parse_separator(p, e, "-/")) return false;
+	if (!parse_digits(p, e, 2, mday)) return false;
+	if (parse_separator(p, e, "T ")) {
+		if (!parse_digits(p, e, 2, hour)) return false;
+		bool colon = parse_separator(p, e, ":");
+		if (!parse_digits(p, e, 2, min)) return false;
+		if (colon && !parse_separator(p, e, ":")) return false;
+		if (!parse_digits(p, e, 2, sec)) return false;
+		if (parse_separator(p, e, ".,"))
+			while (p < e && *p >= '0' && *p <= '9') p++;
+	}
+	t.tm_year = year - 1900;
+	t.tm_mon = mon;
+	t.tm_mday = mday;
+	t.tm_hour = hour;
+	t.tm_min = min;
+	t.tm_sec = sec;
+	/* a trailing zone designator is accepted but not applied */
+	return p == e || *p == 'Z' || *p == '+' || *p == '-';
+}
+
+/* an empty element reads as zero, anything else must parse */
+static
+void check(bool ok, std::string_view text, const char* type) {
+	if (!ok && !trim(text).empty())
+		throw value::Exception(std::string("type error: malformed ") + type, 4);
+}
+
+}
+
 static
 const std::string base64_chars = 
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
@@ -42,6 +253,7 @@ const std::string base64_chars =
 
 static
 std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len) {
+	TINYXMLRPC_TRACE_SPAN("base64_encode");
 	std::string ret;
 	int i = 0;
 	int j = 0;
@@ -81,52 +293,9 @@ std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_
 	return ret;
 }
 
-static
-std::string base64_decode(std::string const& encoded_string) {
-	int in_len = encoded_string.size();
-	int i = 0;
-	int j = 0;
-	int in_ = 0;
-	unsigned char char_array_4[4] = {0};
-	unsigned char char_array_3[3] = {0};
-	std::string ret;
-
-	while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-		char_array_4[i++] = encoded_string[in_]; in_++;
-		if (i ==4) {
-			for (i = 0; i <4; i++)
-				char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-			char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-			char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-			char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-			for (i = 0; (i < 3); i++)
-				ret += char_array_3[i];
-			i = 0;
-		}
-	}
-
-	if (i) {
-		for (j = i; j <4; j++)
-			char_array_4[j] = 0;
-
-		for (j = 0; j <4; j++)
-			char_array_4[j] = base64_chars.find(char_array_4[j]);
-
-		char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-		char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-		char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-		for (j = 0; (j < i - 1); j++)
-			ret += char_array_3[j];
-	}
-
-	return ret;
-}
-
 static
 std::vector<char> base64_decode_binary(std::string const& encoded_string) {
+	TINYXMLRPC_TRACE_SPAN("base64_decode");
 	int in_len = encoded_string.size();
 	int i = 0;
 	int j = 0;
@@ -169,45 +338,34 @@ std::vector<char> base64_decode_binary(std::string const& encoded_string) {
 	return ret;
 }
 
-std::ostream& operator<<(std::ostream& os, value& v) {
+std::ostream& operator<<(std::ostream& os, const value& v) {
 	switch (v._type) {
 	default:           break;
 	case value::TypeBoolean:  os << v._value.asBool; break;
 	case value::TypeInt:      os << v._value.asInt; break;
+	case value::TypeI8:       os << v._value.asI8; break;
 	case value::TypeDouble:   os << v._value.asDouble; break;
-	case value::TypeString:   os << *v._value.asString; break;
+	case value::TypeString:   os << v.getString(); break;
 	case value::TypeTime:
 		{
-			char buf[20];
-			snprintf(buf, sizeof(buf)-1, "%4d%02d%02dT%02d:%02d:%02d",
-				v._value.asTime->tm_year+1900,
-				v._value.asTime->tm_mon,
-				v._value.asTime->tm_mday,
-				v._value.asTime->tm_hour,
-				v._value.asTime->tm_min,
-				v._value.asTime->tm_sec);
-			buf[sizeof(buf)-1] = 0;
+			char buf[scalar::time_size];
+			scalar::format_time(buf, *v._value.asTime);
 			os << buf;
 			break;
 		}
 	case value::TypeBinary:
 		{
-			value::Binary::const_iterator itbinary;
-			unsigned char *ptr = new unsigned char[v._value.asBinary->size()];
-			int n;
-			for(n = 0, itbinary = v._value.asBinary->begin(); itbinary != v._value.asBinary->end(); n++, itbinary++)
-				ptr[n] = *itbinary;
-			os << base64_encode((const unsigned char*)ptr, v._value.asBinary->size()).c_str();
-			delete ptr;
+			std::string_view bytes = v.getBinaryView();
+			os << base64_encode((const unsigned char*)bytes.data(), bytes.size());
 			break;
 		}
 	case value::TypeArray:
 		{
-			int s = int(v._value.asArray->size());
+			const value::Array& array = v.getArray();
 			os << '{';
-			for (int i=0; i < s; i++) {
+			for (size_t i=0; i < array.size(); i++) {
 				if (i > 0) os << ',';
-					os << v._value.asArray->at(i);
+					os << array[i];
 			}
 			os << '}';
 			break;
@@ -215,14 +373,13 @@ std::ostream& operator<<(std::ostream& os, value& v) {
 	case value::TypeStruct:
 		{
 			os << "[";
+			const value::Struct& members = v.getStruct();
 			value::Struct::const_iterator it;
-			for (it = v._value.asStruct->begin(); it != v._value.asStruct->end(); it++)
+			for (it = members.begin(); it != members.end(); it++)
 			{
-				if (it != v._value.asStruct->begin())
+				if (it != members.begin())
 					os << ",";
-				os << it->first << ":";
-				value s = it->second;
-				os << s;
+				os << it->first << ":" << it->second;
 			}
 			os << "]";
 			break;
@@ -241,6 +398,51 @@ std::ostream& operator<<(std::ostream& os, value& v) {
 	return os;
 }
 
+namespace detail {
+static xmlNodePtr first_element(xmlNodePtr pNode);
+}
+
+value parse(xmlNodePtr pList);
+
+static
+value parse_value_node(xmlNodePtr pNode) {
+	if (detail::first_element(pNode))
+		return parse(pNode->children);
+	else if (pNode->children && pNode->children->content)
+		return (const char*)pNode->children->content;
+	else
+		return "";
+}
+
+/* a peer may send faultCode as any type; only read the union for integers */
+static
+int fault_code(const value& code) {
+	if (code.getType() == value::TypeInt || code.getType() == value::TypeI8)
+		return code.getInt();
+	int i = 0;
+	scalar::parse_int(code.to_str(), i);
+	return i;
+}
+
+/* siblings fold the way XML-RPC lists them: the first value as is, from
+ * the second on into an array */
+static
+void fold_value(value& retVal, value&& ret) {
+	if (ret.getType() == value::TypeInvalid)
+		return;
+	if (retVal.getType() != value::TypeInvalid) {
+		if (retVal.getType() == value::TypeArray)
+			retVal[(int)retVal.size()] = std::move(ret);
+		else {
+			value::Array valuearray;
+			valuearray.push_back(std::move(retVal));
+			valuearray.push_back(std::move(ret));
+			retVal = std::move(valuearray);
+		}
+	} else
+		retVal = std::move(ret);
+}
+
 value parse(xmlNodePtr pList) {
 	value retVal;
 	xmlNodePtr pNode;
@@ -248,6 +450,7 @@ value parse(xmlNodePtr pList) {
 	while(pNode) {
 		value ret;
 		std::string strName = (char*)pNode->name;
+		const char* content = pNode->children && pNode->children->content ? (char*)pNode->children->content : "";
 		if (strName == "xml") {
 			pNode = pNode->next;
 			continue;
@@ -259,8 +462,14 @@ value parse(xmlNodePtr pList) {
 		if (strName == "methodResponse")
 			return parse(pNode->children);
 		else
-		if (strName == "fault")
-			return parse(pNode->children);
+		if (strName == "fault") {
+			value fault = parse(pNode->children);
+			const value* faultString = fault.find("faultString");
+			const value* faultCode = fault.find("faultCode");
+			if (faultString && faultCode)
+				return new value::Exception(faultString->to_str(), fault_code(*faultCode));
+			return fault;
+		}
 		else
 		if (strName == "params")
 			return parse(pNode->children);
@@ -269,25 +478,27 @@ value parse(xmlNodePtr pList) {
 			return parse(pNode->children);
 		else
 		if (strName == "struct") {
-			xmlNodePtr pMembers, pMember;
+			xmlNodePtr pMembers;
 			pMembers = pNode->children;
-			value::Struct valuestruct;
+			std::vector<value::Struct::value_type> members;
 			while(pMembers) {
 				if ("member" == (std::string)(char*)pMembers->name) {
 					xmlNodePtr pName;
-					std::string member_name;
+					const char* member_name;
 					pName = pMembers->children;
 					while(pName) {
 						if ("name" == (std::string)(char*)pName->name) {
-							member_name = (char*)pName->children->content;
-							valuestruct[member_name] = parse(pMembers->children);
+							member_name = pName->children ? (char*)pName->children->content : "";
+							members.push_back(value::Struct::value_type(member_name, parse(pMembers->children)));
 						}
 						pName = pName->next;
 					}
 				}
 				pMembers = pMembers->next;
 			}
-			ret = valuestruct;
+			value::Struct valuestruct;
+			valuestruct.assign(std::move(members));
+			ret = std::move(valuestruct);
 		}
 		else
 		if (strName == "array") {
@@ -301,177 +512,497 @@ value parse(xmlNodePtr pList) {
 			}
 		}
 		else
-		if (strName == "value") {
-			if (pNode->children) {
-				/*
-				if (pNode->children->type == XML_TEXT_NODE) {
-					ret = (const char*)pNode->children->content;
-				} else
-				*/
-				ret = parse(pNode->children);
-			} else {
-				ret = (const char*)pNode->children->content;
-			}
-		}
-		else
-		if (strName == "i4" || strName == "int")
-			if (pNode->children) ret = (int)atol((char*)pNode->children->content);
-			else ret = 0;
-		else
-		if (strName == "boolean")
-			if (pNode->children) ret = (bool)(std::string((char*)pNode->children->content) == "true");
-			else ret = false;
-		else
-		if (strName == "double")
-			if (pNode->children) ret = (double)atof((char*)pNode->children->content);
-			else ret = 0.0;
+		if (strName == "value")
+			ret = parse_value_node(pNode);
 		else
+		if (strName == "i4" || strName == "int") {
+			int i = 0;
+			scalar::check(scalar::parse_int(content, i), content, "int");
+			ret = i;
+		} else
+		if (strName == "i8") {
+			long long i8 = 0;
+			scalar::check(scalar::parse_i8(content, i8), content, "i8");
+			ret = i8;
+		} else
+		if (strName == "boolean") {
+			bool b = false;
+			scalar::check(scalar::parse_boolean(content, b), content, "boolean");
+			ret = b;
+		} else
+		if (strName == "double") {
+			double d = 0.0;
+			scalar::check(scalar::parse_double(content, d), content, "double");
+			ret = d;
+		} else
 		if (strName == "string")
 			if (pNode->children) ret = (char*)pNode->children->content;
 			else ret = "";
 		else
 		if (strName == "dateTime.iso8601") {
 			struct tm tmTime = {0};
-			if (pNode->children) {
-				char num[64], val[16];
-				strcpy(num, (char*)pNode->children->content);
-				memset(val, 0, sizeof(val)); strncpy(val, num+ 0, 4);
-				tmTime.tm_year = atol(val)-1900;
-				memset(val, 0, sizeof(val)); strncpy(val, num+ 4, 2);
-				tmTime.tm_mon= atol(val);
-				memset(val, 0, sizeof(val)); strncpy(val, num+ 6, 2);
-				tmTime.tm_mday = atol(val);
-				memset(val, 0, sizeof(val)); strncpy(val, num+ 9, 2);
-				tmTime.tm_hour = atol(val);
-				memset(val, 0, sizeof(val)); strncpy(val, num+12, 2);
-				tmTime.tm_min = atol(val);
-				memset(val, 0, sizeof(val)); strncpy(val, num+15, 2);
-				tmTime.tm_sec = atol(val);
-				ret = tmTime;
-			} else {
-				ret = tmTime;
-			}
+			scalar::check(scalar::parse_time(content, tmTime), content, "dateTime.iso8601");
+			ret = tmTime;
 		} else
 		if (strName == "base64") {
 			value::Binary valuebinary;
 			valuebinary = base64_decode_binary((char*)pNode->children->content);
-			ret = valuebinary;
-		}
-
-		if (ret.getType() != value::TypeInvalid) {
-			if (retVal.getType() != value::TypeInvalid) {
-				if (retVal.getType() == value::TypeArray)
-					retVal[(int)retVal._value.asArray->size()] = ret;
-				else {
-					value::Array valuearray;
-					valuearray.push_back(retVal);
-					valuearray.push_back(ret);
-					retVal = valuearray;
-				}
-			} else
-				retVal = ret;
+			ret = std::move(valuebinary);
 		}
+
+		fold_value(retVal, std::move(ret));
 		pNode = pNode->next;
 	}
 	return retVal;
 }
 
-void serialize(xmlNodePtr pValue, const value& param) {
-	xmlDocPtr pDoc = pValue->doc;
-	xmlNodePtr pArray, pData;
-	xmlNodePtr pStruct;
-	xmlNodePtr pSubValue;
+namespace detail {
+
+/*
+ * The text kernels: how many bytes from p on need no attention, sixteen
+ * at a time with SSE2. escape_span() stops at what write_escaped() has to
+ * replace ('<', '>', '&', '\r') or end at (NUL); quotes and bytes above
+ * 0x7f go out as they are, as libxml2 writes them. text_span() stops at
+ * '&' and '<', where decode_text() has a reference or CDATA to decode.
+ * Only the writer and the lazy decoder use them: parse() reads its text
+ * from the libxml2 tree, which has already decoded it.
+ */
+size_t escape_span(const char* p, size_t size) {
+	size_t n = 0;
+#ifdef __SSE2__
+	const __m128i angle = _mm_set1_epi8('>'), two = _mm_set1_epi8(2);
+	const __m128i amp = _mm_set1_epi8('&'), cr = _mm_set1_epi8('\r'), nul = _mm_setzero_si128();
+	for(; n + 16 <= size; n += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + n));
+		/* '<' is '>' with bit 1 clear */
+		__m128i hit = _mm_or_si128(_mm_cmpeq_epi8(_mm_or_si128(v, two), angle),
+			_mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, nul))));
+		int mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return n + __builtin_ctz(mask);
+	}
+#endif
+	for(; n < size; n++)
+		switch (p[n]) {
+		case '<': case '>': case '&': case '\r': case '\0':
+			return n;
+		}
+	return size;
+}
+
+size_t text_span(const char* p, size_t size) {
+	size_t n = 0;
+#ifdef __SSE2__
+	const __m128i lt = _mm_set1_epi8('<'), amp = _mm_set1_epi8('&');
+	for(; n + 16 <= size; n += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + n));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, amp)));
+		if (mask)
+			return n + __builtin_ctz(mask);
+	}
+#endif
+	for(; n < size && p[n] != '<' && p[n] != '&'; n++);
+	return n;
+}
+
+/* mirrors what xmlDocDumpFormatMemoryEnc writes for text content, so the
+ * output is byte-identical to the libxml2 serializer */
+void write_escaped(std::string& out, const char* p, size_t size) {
+	const char* e = p + size;
+	out.reserve(out.size() + size);
+	while (p < e) {
+		size_t run = escape_span(p, e - p);
+		out.append(p, run);
+		p += run;
+		if (p == e || *p == '\0')
+			break;
+		switch (*p++) {
+		case '<': out += "&lt;"; break;
+		case '>': out += "&gt;"; break;
+		case '&': out += "&amp;"; break;
+		default: out += "&#13;"; break;
+		}
+	}
+}
 
-	value::Binary valuebinary;
-	value::Binary::const_iterator itbinary;
+static
+void write_element(std::string& out, const char* tag, size_t len, const char* text, size_t size) {
+	out += '<';
+	out.append(tag, len);
+	out += '>';
+	write_escaped(out, text, size);
+	out += "</";
+	out.append(tag, len);
+	out += '>';
+}
 
-	value::Array valuearray;
-	value::Array::const_iterator itarray;
+void write_value(std::string& out, const value& v, std::vector<std::string>* holes);
 
-	value::Struct valuestruct;
-	value::Struct::const_iterator itstruct;
+static
+void write_member(std::string& out, const value::Struct::value_type& member, std::vector<std::string>* holes) {
+	out += "<member>";
+	write_element(out, "name", 4, member.first.c_str(), member.first.size());
+	write_value(out, member.second, holes);
+	out += "</member>";
+}
 
-	char buf[64];
-	unsigned char *ptr;
-	struct tm *tmTime;
-	int n;
-	switch(param.getType()) {
-	case value::TypeString:
-		xmlNewTextChild(pValue, NULL, (xmlChar*)"string", (xmlChar*)param.getString().c_str());
+/* writes <value>...</value>; with holes set, every TypeInvalid value
+ * ends the current fragment instead */
+void write_value(std::string& out, const value& v, std::vector<std::string>* holes) {
+	char buf[scalar::time_size];
+	switch(v.getType()) {
+	case value::TypeString: {
+		std::string_view s = v.getStringView();
+		out += "<value>";
+		write_element(out, "string", 6, s.data(), s.size());
+		out += "</value>";
 		break;
+	}
 	case value::TypeTime:
-		tmTime = param.getTime();
-		sprintf(buf, "%04d/%02d/%02d %02d:%02d:%02d",
-			tmTime->tm_year+1900,
-			tmTime->tm_mon,
-			tmTime->tm_mday,
-			tmTime->tm_hour,
-			tmTime->tm_min,
-			tmTime->tm_sec);
-		xmlNewTextChild(pValue, NULL, (xmlChar*)"dateTime.iso8601", (xmlChar*)buf);
+		out += "<value>";
+		write_element(out, "dateTime.iso8601", 16, buf, scalar::format_time(buf, *v.getTime()));
+		out += "</value>";
 		break;
 	case value::TypeInt:
-		sprintf(buf, "%d", param.getInt());
-		xmlNewTextChild(pValue, NULL, (xmlChar*)"i4", (xmlChar*)buf);
+		out += "<value>";
+		write_element(out, "i4", 2, buf, scalar::format_int(buf, v.getInt()));
+		out += "</value>";
+		break;
+	case value::TypeI8:
+		out += "<value>";
+		write_element(out, "i8", 2, buf, scalar::format_i8(buf, v.getI8()));
+		out += "</value>";
 		break;
 	case value::TypeDouble:
-		sprintf(buf, "%f", param.getDouble());
-		xmlNewTextChild(pValue, NULL, (xmlChar*)"double", (xmlChar*)buf);
+		out += "<value>";
+		write_element(out, "double", 6, buf, scalar::format_double(buf, v.getDouble()));
+		out += "</value>";
 		break;
 	case value::TypeBoolean:
-		xmlNewTextChild(pValue, NULL, (xmlChar*)"boolean", param.getBoolean() ? (xmlChar*)"true" : (xmlChar*)"false");
+		out += v.getBoolean() ? "<value><boolean>true</boolean></value>" : "<value><boolean>false</boolean></value>";
 		break;
-	case value::TypeBinary:
-		valuebinary = param.getBinary();
-		ptr = new unsigned char[valuebinary.size()];
-		for(n = 0, itbinary = valuebinary.begin(); itbinary != valuebinary.end(); n++, itbinary++)
-			ptr[n] = *itbinary;
-		xmlNewTextChild(pValue, NULL, (xmlChar*)"base64", (xmlChar*)base64_encode((const unsigned char*)ptr, valuebinary.size()).c_str());
-		delete ptr;
+	case value::TypeBinary: {
+		std::string_view bytes = v.getBinaryView();
+		std::string encoded = base64_encode((const unsigned char*)bytes.data(), bytes.size());
+		out += "<value>";
+		write_element(out, "base64", 6, encoded.data(), encoded.size());
+		out += "</value>";
 		break;
-	case value::TypeArray:
-		pArray = xmlNewChild(pValue, NULL, (xmlChar*)"array", NULL);
-		pData = xmlNewChild(pArray, NULL, (xmlChar*)"data", NULL);
-		for(itarray = param._value.asArray->begin(); itarray != param._value.asArray->end(); itarray++) {
-			pSubValue = xmlNewChild(pData, NULL, (xmlChar*)"value", NULL);
-			serialize(pSubValue, *itarray);
+	}
+	case value::TypeArray: {
+		const value::Array& array = v.getArray();
+		if (array.empty()) {
+			out += "<value><array><data/></array></value>";
+			break;
 		}
+		out += "<value><array><data>";
+		for(value::Array::const_iterator it = array.begin(); it != array.end(); it++)
+			write_value(out, *it, holes);
+		out += "</data></array></value>";
 		break;
-	case value::TypeStruct:
-		pStruct = xmlNewChild(pValue, NULL, (xmlChar*)"struct", NULL);
-		for(itstruct = param._value.asStruct->begin(); itstruct != param._value.asStruct->end(); itstruct++) {
-			xmlNodePtr pMember, pParam, pSubValue;
-			pMember = xmlNewChild(pStruct, NULL, (xmlChar*)"member", NULL);
-			xmlNewTextChild(pMember, NULL, (xmlChar*)"name", (xmlChar*)itstruct->first.c_str());
-			pSubValue = xmlNewChild(pMember, NULL, (xmlChar*)"value", NULL);
-			serialize(pSubValue, itstruct->second);
+	}
+	case value::TypeStruct: {
+		const value::Struct& members = v.getStruct();
+		if (members.empty()) {
+			out += "<value><struct/></value>";
+			break;
+		}
+		out += "<value><struct>";
+		for(value::Struct::const_iterator it = members.begin(); it != members.end(); it++) {
+			write_member(out, *it, holes);
+		}
+		out += "</struct></value>";
+		break;
+	}
+	case value::TypeInvalid:
+		if (holes) {
+			holes->push_back(out);
+			out.clear();
+			break;
 		}
+	default:
+		out += "<value/>";
 		break;
 	}
 }
 
-bool failed(std::string& strXml) {
-	xmlDocPtr pDoc;
-	xmlNodePtr pMethodResponse, pFault;
-	bool ret = false;
-	pDoc = xmlParseDoc((xmlChar*)strXml.c_str());
-	pMethodResponse = pDoc->children;
-	while(pMethodResponse) {
-		if ("methodResponse" == (std::string)(char*)pMethodResponse->name) {
-			pFault = pMethodResponse->children;
-			while(pFault) {
-				if ("fault" == (std::string)(char*)pFault->name) {
-					ret = true;
-					break;
-				}
-				pFault = pFault->next;
-			}
-			if (ret) break;
+}
+
+request_template::request_template(std::string method) : _method(method), _params(0) {
+	std::string head = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<methodCall>";
+	detail::write_element(head, "methodName", 10, method.data(), method.size());
+	_fragments.push_back(head);
+}
+
+request_template& request_template::operator<<(const value& param) {
+	std::string& tail = _fragments.back();
+	tail += _params++ ? "<param>" : "<params><param>";
+	std::vector<std::string> holes;
+	detail::write_value(tail, param, &holes);
+	if (!holes.empty()) {
+		std::string rest = tail;
+		_fragments.pop_back();
+		_fragments.insert(_fragments.end(), holes.begin(), holes.end());
+		_fragments.push_back(rest);
+	}
+	_fragments.back() += "</param>";
+	return *this;
+}
+
+void request_template::render(const std::vector<value>& args, std::string& out) const {
+	TINYXMLRPC_TRACE_SPAN("serialize");
+	if (args.size() != _fragments.size() - 1)
+		throw value::Exception("template error: wrong number of slot values", 4);
+	size_t size = 32;
+	for(size_t n = 0; n < _fragments.size(); n++)
+		size += _fragments[n].size();
+	out.clear();
+	out.reserve(size);
+	for(size_t n = 0; n < args.size(); n++) {
+		out += _fragments[n];
+		detail::write_value(out, args[n], NULL);
+	}
+	out += _fragments.back();
+	out += _params ? "</params></methodCall>\n" : "<params/></methodCall>\n";
+}
+
+std::string request_template::render(const std::vector<value>& args) const {
+	std::string out;
+	render(args, out);
+	return out;
+}
+
+/*
+ * One share object for every handle in the process, so DNS answers and
+ * TLS sessions learned on any thread are reused by all. Connections stay
+ * with each handle: libcurl does not support sharing them between
+ * concurrent threads.
+ */
+static CURLSH* curl_share = NULL;
+static std::mutex share_locks[CURL_LOCK_DATA_LAST];
+
+static
+void share_lock(CURL*, curl_lock_data data, curl_lock_access, void*) {
+	share_locks[data].lock();
+}
+
+static
+void share_unlock(CURL*, curl_lock_data data, void*) {
+	share_locks[data].unlock();
+}
+
+void init() {
+	static std::once_flag once;
+	std::call_once(once, [] {
+		curl_global_init(CURL_GLOBAL_DEFAULT);
+		xmlInitParser();
+		if ((curl_share = curl_share_init())) {
+			curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, share_lock);
+			curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+			curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+			curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
 		}
-		pMethodResponse = pMethodResponse->next;
+	});
+}
+
+/* every easy handle comes from here so that it joins the share */
+static
+CURL* new_handle() {
+	init();
+	CURL* curl = curl_easy_init();
+	if (curl && curl_share)
+		curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+	return curl;
+}
+
+static struct initializer {
+	initializer() { init(); }
+} initialize;
+
+static std::atomic<size_t> limit_body(0), limit_elements(0), limit_decoded(0);
+static std::atomic<int> limit_depth(256);
+
+void set_decode_limits(const decode_limits& limits) {
+	limit_body = limits.max_body;
+	limit_depth = limits.max_depth;
+	limit_elements = limits.max_elements;
+	limit_decoded = limits.max_decoded;
+}
+
+decode_limits get_decode_limits() {
+	decode_limits limits;
+	limits.max_body = limit_body;
+	limits.max_depth = limit_depth;
+	limits.max_elements = limit_elements;
+	limits.max_decoded = limit_decoded;
+	return limits;
+}
+
+namespace detail {
+
+value::Exception body_exceeded(size_t limit) {
+	char buf[scalar::i8_size];
+	buf[scalar::format_i8(buf, (long long)limit)] = 0;
+	return value::Exception(std::string("limit exceeded: body over ") + buf + " bytes", -5);
+}
+
+/* counts one document against the decode limits; breach() is the first
+ * limit crossed, if any */
+struct decode_budget {
+	decode_limits limits;
+	size_t elements;
+	size_t decoded;
+	int code;
+
+	decode_budget() : limits(get_decode_limits()), elements(0), decoded(0), code(0) {}
+	bool open(int depth) {
+		if (limits.max_depth && depth > limits.max_depth)
+			code = -6;
+		else if (limits.max_elements && ++elements > limits.max_elements)
+			code = -7;
+		return code == 0;
 	}
-	xmlFreeDoc(pDoc);
-	return ret;
+	bool text(size_t size) {
+		if (limits.max_decoded && (decoded += size) > limits.max_decoded)
+			code = -8;
+		return code == 0;
+	}
+	/* the elements around the <data> of a split document; each part
+	 * counts a <data> of its own */
+	static const int envelope = 5;
+	bool add(const decode_budget& part) {
+		elements += part.elements - 1;
+		decoded += part.decoded;
+		if (limits.max_elements && elements > limits.max_elements)
+			code = -7;
+		else if (limits.max_decoded && decoded > limits.max_decoded)
+			code = -8;
+		return code == 0;
+	}
+	value::Exception breach() const {
+		char buf[scalar::i8_size];
+		switch (code) {
+		case -6:
+			buf[scalar::format_int(buf, limits.max_depth)] = 0;
+			return value::Exception(std::string("limit exceeded: nested deeper than ") + buf + " elements", code);
+		case -7:
+			buf[scalar::format_i8(buf, (long long)limits.max_elements)] = 0;
+			return value::Exception(std::string("limit exceeded: more than ") + buf + " elements", code);
+		default:
+			buf[scalar::format_i8(buf, (long long)limits.max_decoded)] = 0;
+			return value::Exception(std::string("limit exceeded: more than ") + buf + " bytes of text", code);
+		}
+	}
+};
+
+}
+
+/* the budget of the document read_document() is parsing on this thread */
+static thread_local detail::decode_budget* parse_budget;
+
+static
+void budget_start_element(void* ctx, const xmlChar* localname, const xmlChar* prefix, const xmlChar* URI,
+		int nb_namespaces, const xmlChar** namespaces, int nb_attributes, int nb_defaulted, const xmlChar** attributes) {
+	xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr)ctx;
+	if (parse_budget && !parse_budget->open(ctxt->nodeNr + 1)) {
+		xmlStopParser(ctxt);
+		return;
+	}
+	xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces, namespaces, nb_attributes, nb_defaulted, attributes);
+}
+
+static
+void budget_characters(void* ctx, const xmlChar* ch, int len) {
+	if (parse_budget && !parse_budget->text(len)) {
+		xmlStopParser((xmlParserCtxtPtr)ctx);
+		return;
+	}
+	xmlSAX2Characters(ctx, ch, len);
+}
+
+static
+void budget_cdata(void* ctx, const xmlChar* ch, int len) {
+	if (parse_budget && !parse_budget->text(len)) {
+		xmlStopParser((xmlParserCtxtPtr)ctx);
+		return;
+	}
+	xmlSAX2CDataBlock(ctx, ch, len);
+}
+
+/*
+ * Parses with a parser context kept per thread rather than one built and
+ * torn down for every document. Element names go into the context's
+ * dictionary, which never shrinks, so the context is replaced once the
+ * dictionary gets large. size < 0 reads up to the terminating NUL. The
+ * document is counted against budget, when given, and parsing stops at
+ * the first limit it crosses.
+ */
+static
+xmlDocPtr read_document(const char* xml, int size, detail::decode_budget* budget = NULL) {
+	struct context {
+		xmlParserCtxtPtr ctxt;
+		context() : ctxt(NULL) {}
+		~context() { if (ctxt) xmlFreeParserCtxt(ctxt); }
+	};
+	static thread_local context cached;
+	if (cached.ctxt && xmlDictSize(cached.ctxt->dict) > 4096) {
+		xmlFreeParserCtxt(cached.ctxt);
+		cached.ctxt = NULL;
+	}
+	if (!cached.ctxt) {
+		init();
+		if (!(cached.ctxt = xmlNewParserCtxt()))
+			return NULL;
+		cached.ctxt->sax->startElementNs = budget_start_element;
+		cached.ctxt->sax->characters = budget_characters;
+		cached.ctxt->sax->ignorableWhitespace = budget_characters;
+		cached.ctxt->sax->cdataBlock = budget_cdata;
+	}
+	parse_budget = budget;
+	/* not xmlCtxtReadDoc, which takes the text to be UTF-8 whatever
+	 * its encoding declaration says */
+	xmlDocPtr pDoc = xmlCtxtReadMemory(cached.ctxt, xml, size < 0 ? (int)strlen(xml) : size, NULL, NULL, 0);
+	parse_budget = NULL;
+	/* a stopped parser still hands back what it had built */
+	if (pDoc && budget && budget->code) {
+		xmlFreeDoc(pDoc);
+		return NULL;
+	}
+	return pDoc;
+}
+
+/*
+ * The name of the next element start tag at or after pos, passing over
+ * the XML declaration, processing instructions, comments and doctype; ""
+ * at an end tag or the end of the text.
+ */
+static
+std::string_view next_element(const std::string& xml, size_t& pos) {
+	while ((pos = xml.find('<', pos)) != std::string::npos) {
+		if (!xml.compare(pos, 4, "<!--"))
+			pos = xml.find("-->", pos + 4);
+		else if (xml.compare(pos, 2, "<?") && xml.compare(pos, 2, "<!"))
+			break;
+		else
+			pos = xml.find('>', pos + 2);
+		if (pos == std::string::npos)
+			return std::string_view();
+	}
+	if (pos == std::string::npos || xml.compare(pos, 2, "</") == 0)
+		return std::string_view();
+	size_t begin = ++pos;
+	pos = xml.find_first_of(" \t\r\n/>", begin);
+	if (pos == std::string::npos)
+		return std::string_view();
+	return std::string_view(xml.data() + begin, pos - begin);
+}
+
+/* looks no further than the root and its first child */
+bool failed(std::string& strXml) {
+	size_t pos = 0;
+	if (next_element(strXml, pos) != "methodResponse")
+		return false;
+	return next_element(strXml, pos) == "fault";
 }
 
 bool failed(value& res) {
@@ -494,7 +1025,9 @@ std::string extract_method_name(std::string& strXml) {
 	xmlDocPtr pDoc;
 	xmlNodePtr pMethodCall, pMethodName;
 	std::string ret = "";
-	pDoc = xmlParseDoc((xmlChar*)strXml.c_str());
+	pDoc = read_document(strXml.c_str(), -1);
+	if (!pDoc)
+		return ret;
 	pMethodCall = pDoc->children;
 	while(pMethodCall) {
 		if ("methodCall" == (std::string)(char*)pMethodCall->name) {
@@ -515,102 +1048,422 @@ std::string extract_method_name(std::string& strXml) {
 }
 
 value parse(std::string& strXml) {
+	TINYXMLRPC_TRACE_SPAN("parse");
 	xmlDocPtr pDoc;
 	value res;
-	pDoc = xmlParseDoc((xmlChar*)strXml.c_str());
+	detail::decode_budget budget;
+	pDoc = read_document(strXml.c_str(), -1, &budget);
 	if (pDoc) {
-		res = parse(pDoc->children);
+		try {
+			res = parse(pDoc->children);
+		} catch(value::Exception& e) {
+			res = new value::Exception(e);
+		}
 		xmlFreeDoc(pDoc);
-	} else
+	} else if (budget.code)
+		res = new value::Exception(budget.breach());
+	else
 		res = strXml;
 	return res;
 }
 
+/* both build the text directly, byte-identical to what libxml2 writes
+ * for the same tree */
 std::string serialize(std::string method, std::vector<value>& requests) {
-	xmlDocPtr pDoc;
-	xmlNodePtr pNode;
-	xmlNodePtr pMethodCall, pMethodName, pParams;
-	xmlNodePtr pParam, pValue;
+	return serialize(method, requests, 1);
+}
 
-	pDoc = xmlNewDoc((xmlChar*)"1.0");
-	pMethodCall = xmlNewNode(NULL, (xmlChar*)"methodCall");
-	xmlDocSetRootElement(pDoc, pMethodCall);
-	xmlNewTextChild(pMethodCall, NULL, (xmlChar*)"methodName", (xmlChar*)method.c_str());
-	pParams = xmlNewChild(pMethodCall, NULL, (xmlChar*)"params", NULL);
+std::string serialize(value& response) {
+	return serialize(response, 1);
+}
 
-	std::vector<value>::const_iterator it;
-	for(it = requests.begin(); it != requests.end(); it++) {
-		pParam = xmlNewChild(pParams, NULL, (xmlChar*)"param", NULL);
-		pValue = xmlNewChild(pParam, NULL, (xmlChar*)"value", NULL);
-		serialize(pValue, *it);
-	}
+/* below these sizes the threads cost more than they save */
+static const size_t parallel_min_elements = 256;
+static const size_t parallel_min_bytes = 1 << 20;
 
-	xmlChar* pstrXml;
-	int bufsize;
-	xmlDocDumpFormatMemoryEnc(pDoc, &pstrXml, &bufsize, "utf-8", 0);
-	xmlFreeDoc(pDoc);
-	std::string strXml = (char*)pstrXml;
-	xmlFree(pstrXml);
-	return strXml;
+static
+int resolve_threads(int threads) {
+	if (threads <= 0)
+		threads = (int)std::thread::hardware_concurrency();
+	return threads < 1 ? 1 : threads;
 }
 
-std::string parse(value& response) {
-	xmlDocPtr pDoc;
-	xmlNodePtr pNode;
-	xmlNodePtr pFault, pMethodResponse, pParams;
-	xmlNodePtr pParam, pValue;
+namespace detail {
+
+/*
+ * One pool of worker threads for the parallel encoder and decoder, started
+ * as calls first need them and never more than hardware_concurrency() - 1
+ * (at least one), since the caller works too. A call queues a batch of
+ * chunks; idle workers help the oldest batch that still has chunks left,
+ * up to the threads the call asked for. The pool is never torn down.
+ */
+class chunk_pool {
+public:
+	static chunk_pool& get() {
+		static chunk_pool* pool = new chunk_pool;
+		return *pool;
+	}
+
+	void run(int threads, size_t chunks, const std::function<void(size_t)>& work) {
+		batch b;
+		b.work = &work;
+		b.chunks = chunks;
+		b.next = 0;
+		b.done = 0;
+		b.helpers = 0;
+		b.max_helpers = std::min((size_t)threads - 1, chunks - 1);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			while (workers < std::min(b.max_helpers, max_workers)) {
+				std::thread(&chunk_pool::serve, this).detach();
+				workers++;
+			}
+			queue.push_back(&b);
+		}
+		wake.notify_all();
+		size_t ran = drain(b);
+		std::unique_lock<std::mutex> guard(lock);
+		b.done += ran;
+		/* a helper that found no chunk left still holds b until it checks in */
+		finished.wait(guard, [&b]() { return b.done == b.chunks && b.helpers == 0; });
+		queue.erase(std::find(queue.begin(), queue.end(), &b));
+		guard.unlock();
+		if (b.error)
+			std::rethrow_exception(b.error);
+	}
+
+private:
+	struct batch {
+		const std::function<void(size_t)>* work;
+		size_t chunks;
+		std::atomic<size_t> next;
+		size_t done;
+		size_t helpers, max_helpers;
+		std::exception_ptr error;
+	};
+
+	chunk_pool() : workers(0) {
+		unsigned int cores = std::thread::hardware_concurrency();
+		max_workers = cores > 2 ? cores - 1 : 1;
+	}
+
+	/* a chunk that throws is recorded; the caller rethrows the first */
+	size_t drain(batch& b) {
+		size_t ran = 0;
+		for(size_t chunk; (chunk = b.next++) < b.chunks; ran++) {
+			try {
+				(*b.work)(chunk);
+			} catch(...) {
+				std::lock_guard<std::mutex> guard(lock);
+				if (!b.error)
+					b.error = std::current_exception();
+			}
+		}
+		return ran;
+	}
+
+	void serve() {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			batch* b = NULL;
+			for(size_t n = 0; n < queue.size() && !b; n++)
+				if (queue[n]->next < queue[n]->chunks && queue[n]->helpers < queue[n]->max_helpers)
+					b = queue[n];
+			if (!b) {
+				wake.wait(guard);
+				continue;
+			}
+			b->helpers++;
+			guard.unlock();
+			size_t ran = drain(*b);
+			guard.lock();
+			b->helpers--;
+			b->done += ran;
+			if (b->done == b->chunks && b->helpers == 0)
+				finished.notify_all();
+		}
+	}
+
+	std::mutex lock;
+	std::condition_variable wake, finished;
+	std::deque<batch*> queue;
+	size_t workers, max_workers;
+};
+
+}
+
+/* runs work(chunk) for chunk in [0, chunks) on up to threads threads */
+template<class F>
+static
+void run_chunks(int threads, size_t chunks, F work) {
+	if (threads < 2 || chunks < 2) {
+		for(size_t chunk = 0; chunk < chunks; chunk++)
+			work(chunk);
+		return;
+	}
+	detail::chunk_pool::get().run(threads, chunks, std::function<void(size_t)>(work));
+}
+
+/* large arrays and structs are written in chunks, one buffer per chunk,
+ * and stitched together in order */
+static
+void write_value_parallel(std::string& out, const value& v, int threads) {
+	size_t count = v.getType() == value::TypeArray ? v.getArray().size() :
+		v.getType() == value::TypeStruct ? v.getStruct().size() : 0;
+	if (threads < 2 || count < parallel_min_elements) {
+		detail::write_value(out, v, NULL);
+		return;
+	}
+	size_t chunks = std::min(count, (size_t)threads * 8);
+	std::vector<std::string> parts(chunks);
+	run_chunks(threads, chunks, [&](size_t chunk) {
+		size_t begin = count * chunk / chunks, end = count * (chunk + 1) / chunks;
+		std::string& part = parts[chunk];
+		for(size_t n = begin; n < end; n++) {
+			if (v.getType() == value::TypeArray)
+				detail::write_value(part, v.getArray()[n], NULL);
+			else
+				detail::write_member(part, v.getStruct().begin()[n], NULL);
+		}
+	});
+	size_t size = 0;
+	for(size_t n = 0; n < chunks; n++)
+		size += parts[n].size();
+	out.reserve(out.size() + size + 64);
+	out += v.getType() == value::TypeArray ? "<value><array><data>" : "<value><struct>";
+	for(size_t n = 0; n < chunks; n++) {
+		out += parts[n];
+		std::string().swap(parts[n]);
+	}
+	out += v.getType() == value::TypeArray ? "</data></array></value>" : "</struct></value>";
+}
 
-	pDoc = xmlNewDoc((xmlChar*)"1.0");
-	pMethodResponse = xmlNewNode(NULL, (xmlChar*)"methodResponse");
-	xmlDocSetRootElement(pDoc, pMethodResponse);
-	pParams = xmlNewChild(pMethodResponse, NULL, (xmlChar*)"params", NULL);
+std::string serialize(std::string method, std::vector<value>& requests, int threads) {
+	TINYXMLRPC_TRACE_SPAN("serialize");
+	threads = resolve_threads(threads);
+	std::string out = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<methodCall>";
+	detail::write_element(out, "methodName", 10, method.data(), method.size());
+	if (requests.empty())
+		out += "<params/>";
+	else {
+		out += "<params>";
+		for(size_t n = 0; n < requests.size(); n++) {
+			out += "<param>";
+			write_value_parallel(out, requests[n], threads);
+			out += "</param>";
+		}
+		out += "</params>";
+	}
+	out += "</methodCall>\n";
+	return out;
+}
+
+std::string serialize(value& response, int threads) {
+	TINYXMLRPC_TRACE_SPAN("serialize");
+	threads = resolve_threads(threads);
+	std::string out = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<methodResponse><params><param>";
+	write_value_parallel(out, response, threads);
+	out += "</param></params></methodResponse>\n";
+	return out;
+}
+
+namespace detail {
+
+/* just enough of a tokenizer to walk the envelope of a document and find
+ * the <value> elements of its top-level array */
+struct splitter {
+	const char* p;
+	const char* e;
+
+	void skip_space() {
+		while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+	}
+	bool skip_past(const char* token) {
+		const char* found = std::search(p, e, token, token + strlen(token));
+		if (found == e) return false;
+		p = found + strlen(token);
+		return true;
+	}
+	/* skips whitespace, comments and processing instructions */
+	bool skip_misc() {
+		while (true) {
+			skip_space();
+			if (e - p >= 4 && !memcmp(p, "<!--", 4)) {
+				if (!skip_past("-->")) return false;
+			} else if (e - p >= 2 && !memcmp(p, "<?", 2)) {
+				if (!skip_past("?>")) return false;
+			} else
+				return true;
+		}
+	}
+	bool tag(const char* name) {
+		size_t len = strlen(name);
+		if (!skip_misc() || (size_t)(e - p) < len + 2 || *p != '<' || memcmp(p + 1, name, len)) return false;
+		const char* q = p + 1 + len;
+		while (q < e && (*q == ' ' || *q == '\t' || *q == '\r' || *q == '\n')) q++;
+		if (q >= e || *q != '>') return false;
+		p = q + 1;
+		return true;
+	}
+	bool element(const char* name) {
+		std::string close = std::string("</") + name;
+		return tag(name) && skip_past(close.c_str()) && skip_past(">");
+	}
+	bool rest_is(const char* const* closers) {
+		for(; *closers; closers++)
+			if (!tag(*closers)) return false;
+		return skip_misc() && p == e;
+	}
+};
+
+}
 
-	pParam = xmlNewChild(pParams, NULL, (xmlChar*)"param", NULL);
-	pValue = xmlNewChild(pParam, NULL, (xmlChar*)"value", NULL);
-	serialize(pValue, response);
+static
+bool declares_utf8(const std::string& strXml) {
+	size_t end = strXml.find("?>");
+	size_t pos = strXml.find("encoding", 0);
+	if (end == std::string::npos || pos == std::string::npos || pos > end)
+		return true;
+	pos = strXml.find_first_of("\"'", pos);
+	if (pos == std::string::npos || pos > end) return false;
+	std::string name = strXml.substr(pos + 1, 5);
+	std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+	return name == "utf-8" && strXml[pos + 6] == strXml[pos];
+}
 
-	xmlChar* pstrXml;
-	int bufsize;
-	xmlDocDumpFormatMemoryEnc(pDoc, &pstrXml, &bufsize, "utf-8", 0);
+static
+bool parse_values(const char* xml, size_t size, std::vector<value>& values, detail::decode_budget* budget) {
+	xmlDocPtr pDoc = read_document(xml, (int)size, budget);
+	if (!pDoc) return false;
+	xmlNodePtr pData = xmlDocGetRootElement(pDoc);
+	bool ok = true;
+	try {
+		for(xmlNodePtr pNode = pData ? pData->children : NULL; pNode; pNode = pNode->next)
+			if (pNode->type == XML_ELEMENT_NODE && !strcmp((char*)pNode->name, "value"))
+				values.push_back(parse_value_node(pNode));
+	} catch(value::Exception&) {
+		ok = false;
+	}
 	xmlFreeDoc(pDoc);
-	std::string strXml = (char*)pstrXml;
-	xmlFree(pstrXml);
-	return strXml;
+	return ok;
+}
+
+/*
+ * Splits the top-level <data> of a methodResponse or methodCall into
+ * ranges of whole <value> elements. Anything unexpected returns false and
+ * leaves the document to the sequential parser.
+ */
+static
+bool split_values(const std::string& strXml, std::vector<std::pair<size_t, size_t> >& ranges) {
+	static const char* const response_tail[] = { "/array", "/value", "/param", "/params", "/methodResponse", NULL };
+	static const char* const call_tail[] = { "/array", "/value", "/param", "/params", "/methodCall", NULL };
+	detail::splitter sp = { strXml.data(), strXml.data() + strXml.size() };
+	const char* const* tail = response_tail;
+	if (!sp.skip_misc() || (strXml.compare(0, 5, "<?xml") == 0 && !declares_utf8(strXml)))
+		return false;
+	if (!sp.tag("methodResponse")) {
+		if (!sp.tag("methodCall") || !sp.element("methodName")) return false;
+		tail = call_tail;
+	}
+	if (!sp.tag("params") || !sp.tag("param") || !sp.tag("value") || !sp.tag("array") || !sp.tag("data"))
+		return false;
+
+	int depth = 0;
+	const char* begin = NULL;
+	while (true) {
+		if (!sp.skip_misc()) return false;
+		if (depth == 0 && sp.tag("/data"))
+			return sp.rest_is(tail);
+		if (sp.p >= sp.e) return false;
+		if (*sp.p != '<') {
+			if (depth == 0) return false;
+			sp.p = std::find(sp.p, sp.e, '<');
+			continue;
+		}
+		if (sp.e - sp.p >= 9 && !memcmp(sp.p, "<![CDATA[", 9)) {
+			if (!sp.skip_past("]]>")) return false;
+			continue;
+		}
+		if (sp.e - sp.p >= 2 && sp.p[1] == '!') return false;
+		const char* start = sp.p;
+		const char* close = std::find(sp.p, sp.e, '>');
+		if (close == sp.e) return false;
+		bool closing = start[1] == '/', empty = close[-1] == '/';
+		const char* name = start + (closing ? 2 : 1);
+		size_t len = 0;
+		while (name + len < close && name[len] != ' ' && name[len] != '\t' && name[len] != '\r' &&
+				name[len] != '\n' && name[len] != '/' && name[len] != '>') len++;
+		bool is_value = len == 5 && !memcmp(name, "value", 5);
+		sp.p = close + 1;
+		if (depth == 0 && !is_value) return false;
+		if (!is_value || empty) {
+			if (depth == 0) ranges.push_back(std::make_pair((size_t)(start - strXml.data()), (size_t)(sp.p - strXml.data())));
+			continue;
+		}
+		if (!closing) {
+			if (depth++ == 0) begin = start;
+		} else if (--depth == 0)
+			ranges.push_back(std::make_pair((size_t)(begin - strXml.data()), (size_t)(sp.p - strXml.data())));
+		else if (depth < 0)
+			return false;
+	}
+}
+
+value parse(std::string& strXml, int threads) {
+	TINYXMLRPC_TRACE_SPAN("parse");
+	threads = resolve_threads(threads);
+	std::vector<std::pair<size_t, size_t> > ranges;
+	if (threads < 2 || strXml.size() < parallel_min_bytes || !split_values(strXml, ranges) ||
+			ranges.size() < parallel_min_elements)
+		return parse(strXml);
+
+	size_t chunks = std::min(ranges.size(), (size_t)threads * 8);
+	std::vector<std::vector<value> > parts(chunks);
+	std::vector<detail::decode_budget> budgets(chunks);
+	std::atomic<bool> ok(true);
+	run_chunks(threads, chunks, [&](size_t chunk) {
+		size_t first = ranges.size() * chunk / chunks, last = ranges.size() * (chunk + 1) / chunks - 1;
+		std::string segment = "<data>";
+		segment.append(strXml, ranges[first].first, ranges[last].second - ranges[first].first);
+		segment += "</data>";
+		detail::decode_budget& budget = budgets[chunk];
+		if (budget.limits.max_depth)
+			budget.limits.max_depth = std::max(budget.limits.max_depth - detail::decode_budget::envelope, 1);
+		if (!parse_values(segment.data(), segment.size(), parts[chunk], &budget) || parts[chunk].size() != last - first + 1)
+			ok = false;
+	});
+	/* a chunk over a limit is left to the sequential parser to report */
+	if (!ok)
+		return parse(strXml);
+	detail::decode_budget total;
+	total.elements = detail::decode_budget::envelope + 1;
+	for(size_t n = 0; n < chunks; n++)
+		if (!total.add(budgets[n]))
+			return new value::Exception(total.breach());
+
+	value retVal;
+	for(size_t n = 0; n < chunks; n++)
+		for(size_t i = 0; i < parts[n].size(); i++)
+			fold_value(retVal, std::move(parts[n][i]));
+	return retVal;
 }
 
 std::string value::Exception::to_xml() {
-	xmlDocPtr pDoc;
-	xmlNodePtr pMethodResponse, pFault, pValue, pStruct, pMember;
-
-	pDoc = xmlNewDoc((xmlChar*)"1.0");
-	pMethodResponse = xmlNewNode(NULL, (xmlChar*)"methodResponse");
-	xmlDocSetRootElement(pDoc, pMethodResponse);
-	pFault = xmlNewChild(pMethodResponse, NULL, (xmlChar*)"fault", NULL);
-	pValue = xmlNewChild(pFault, NULL, (xmlChar*)"value", NULL);
-	pStruct = xmlNewChild(pValue, NULL, (xmlChar*)"struct", NULL);
-
-	pMember = xmlNewChild(pStruct, NULL, (xmlChar*)"member", NULL);
-	xmlNewTextChild(pMember, NULL, (xmlChar*)"name", (xmlChar*)"faultString");
-	xmlNewTextChild(pMember, NULL, (xmlChar*)"value", (xmlChar*)this->message.c_str());
-
-	pMember = xmlNewChild(pStruct, NULL, (xmlChar*)"member", NULL);
-	xmlNewTextChild(pMember, NULL, (xmlChar*)"name", (xmlChar*)"faultCode");
-	char buf[16];
-	sprintf(buf, "%d", this->code);
-	xmlNewTextChild(pMember, NULL, (xmlChar*)"value", (xmlChar*)buf);
-
-	xmlChar* pstrXml;
-	int bufsize;
-	xmlDocDumpFormatMemoryEnc(pDoc, &pstrXml, &bufsize, "utf-8", 0);
-	xmlFreeDoc(pDoc);
-	std::string strXml = (char*)pstrXml;
-	xmlFree(pstrXml);
-	return strXml;
+	char buf[scalar::int_size];
+	std::string out = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<methodResponse><fault><value><struct>"
+		"<member><name>faultString</name><value><string>";
+	detail::write_escaped(out, message.c_str(), message.size());
+	out += "</string></value></member><member><name>faultCode</name><value><i4>";
+	out.append(buf, scalar::format_int(buf, code));
+	out += "</i4></value></member></struct></value></fault></methodResponse>\n";
+	return out;
 }
 
 typedef struct {
     char* data;     // response data from server
     size_t size;    // response size of data
+    size_t limit;   // most bytes accepted, 0 for no limit
+    bool exceeded;  // the transfer was cut off at limit
 } MEMFILE;
 
 MEMFILE*
@@ -618,6 +1471,8 @@ memfopen() {
     MEMFILE* mf = (MEMFILE*) malloc(sizeof(MEMFILE));
     mf->data = NULL;
     mf->size = 0;
+    mf->limit = 0;
+    mf->exceeded = false;
     return mf;
 }
 
@@ -630,15 +1485,17 @@ memfclose(MEMFILE* mf) {
 size_t
 memfwrite(char* ptr, size_t size, size_t nmemb, void* stream) {
     MEMFILE* mf = (MEMFILE*) stream;
-    int block = size * nmemb;
-    if (!mf->data)
-        mf->data = (char*) malloc(block);
-    else
-        mf->data = (char*) realloc(mf->data, mf->size + block);
-    if (mf->data) {
-        memcpy(mf->data + mf->size, ptr, block);
-        mf->size += block;
+    size_t block = size * nmemb;
+    if (mf->limit && mf->size + block > mf->limit) {
+        mf->exceeded = true;
+        return 0;
     }
+    char* data = (char*) realloc(mf->data, mf->size + block);
+    if (!data)
+        return 0;
+    mf->data = data;
+    memcpy(mf->data + mf->size, ptr, block);
+    mf->size += block;
     return block;
 }
 
@@ -650,13 +1507,26 @@ memfstrdup(MEMFILE* mf) {
     return buf;
 }
 
-int post(std::string url, std::string method, std::string request, std::string& response, std::map<std::string, std::string>& headers) {
-	CURL* curl = curl_easy_init();
-	int ret = -1;
-	if(curl) {
-		response = "";
-		struct curl_slist *headerlist=NULL;
-  		char error[256];
+static const char unix_scheme[] = "unix://";
+static const size_t unix_scheme_size = sizeof(unix_scheme) - 1;
+
+/* one HTTP exchange on an easy handle, split in two so that both
+ * curl_easy_perform and the multi interface can drive it */
+struct transfer {
+	CURL* curl;
+	struct curl_slist* headerlist;
+	MEMFILE* mf;
+	size_t request_size;
+	char error[CURL_ERROR_SIZE];
+
+	transfer() : curl(NULL), headerlist(NULL), mf(NULL), request_size(0) { error[0] = 0; }
+	~transfer() {
+		if (mf) memfclose(mf);
+		if (headerlist) curl_slist_free_all(headerlist);
+	}
+	void setup(CURL* handle, const std::string& url, const std::string& request, std::map<std::string, std::string>& headers, long connect_ms, long timeout_ms) {
+		curl = handle;
+		request_size = request.size();
 		std::map<std::string, std::string>::iterator it;
 		bool have_content_type = false;
 		for (it = headers.begin(); it != headers.end(); it++) {
@@ -665,24 +1535,52 @@ int post(std::string url, std::string method, std::string request, std::string&
 			headerlist = curl_slist_append(headerlist, header.c_str());
 			std::string key = it->first;
 			std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-			if (key == "CONTENT-TYPE") have_content_type = true;
+			if (key == "content-type") have_content_type = true;
 		}
 		if (!have_content_type) headerlist = curl_slist_append(headerlist, "Content-Type: text/xml");
-		MEMFILE* mf = memfopen();
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-  		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, &error);
+		mf = memfopen();
+		mf->limit = limit_body;
+		if (!url.compare(0, unix_scheme_size, unix_scheme)) {
+			curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, url.c_str() + unix_scheme_size);
+			curl_easy_setopt(curl, CURLOPT_URL, "http://localhost/RPC2");
+		} else {
+			curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, NULL);
+			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+		}
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error);
 		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.c_str());
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, request.size());
 		curl_easy_setopt(curl, CURLOPT_POST, 1);
 		curl_easy_setopt(curl, CURLOPT_WRITEDATA, mf);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, memfwrite);
-		CURLcode code = curl_easy_perform(curl);
-  		if (code != CURLE_OK) {
+		curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)mf->limit);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connect_ms);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	}
+	int finish(CURLcode code, std::string& response, call_stats* stats) {
+		int ret = -1;
+		response = "";
+		if (stats) {
+			curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &stats->namelookup);
+			curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &stats->connect);
+			curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &stats->appconnect);
+			curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &stats->pretransfer);
+			curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &stats->starttransfer);
+			curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &stats->total);
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &stats->http_status);
+			stats->request_bytes = request_size;
+			stats->response_bytes = mf->size;
+		}
+		if (mf->exceeded || code == CURLE_FILESIZE_EXCEEDED) {
+			response = detail::body_exceeded(mf->limit).message;
+			ret = -5;
+		} else if (code != CURLE_OK) {
 			response = curl_easy_strerror(code);
 			ret = -2;
 		} else {
-			int status = 200;
+			long status = 200;
 			if (curl_easy_getinfo(curl, CURLINFO_HTTP_CODE, &status) != CURLE_OK) {
 				response = error;
 			} else {
@@ -696,29 +1594,173 @@ int post(std::string url, std::string method, std::string request, std::string&
 				}
 			}
 		}
-		memfclose(mf);
-		curl_easy_cleanup(curl);
-		curl_slist_free_all (headerlist);
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+		curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+		return ret;
+	}
+};
+
+static
+int perform(CURL* curl, const std::string& url, const std::string& request, std::string& response, std::map<std::string, std::string>& headers, call_stats* stats, long connect_ms, long timeout_ms) {
+	transfer t;
+	t.setup(curl, url, request, headers, connect_ms, timeout_ms);
+	CURLcode code;
+	{
+		TINYXMLRPC_TRACE_SPAN("curl_easy_perform");
+		code = curl_easy_perform(curl);
+	}
+	return t.finish(code, response, stats);
+}
+
+/* the thread's easy handle; it keeps its connections open between calls */
+static thread_local struct thread_handle {
+	CURL* curl;
+	bool busy;
+	thread_handle() : curl(NULL), busy(false) {}
+	~thread_handle() { if (curl) curl_easy_cleanup(curl); }
+} thread_curl;
+
+/*
+ * The caller's handle if it has one, else the thread's handle, else (when
+ * that is already in use further up the stack) a fresh one for this call.
+ */
+struct borrowed_handle {
+	CURL* curl;
+	bool cached;
+	bool owned;
+	borrowed_handle(CURL* given) : curl(given), cached(false), owned(false) {
+		if (curl) return;
+		if (!thread_curl.busy) {
+			if (!thread_curl.curl) thread_curl.curl = new_handle();
+			if ((curl = thread_curl.curl)) {
+				thread_curl.busy = cached = true;
+				return;
+			}
+		}
+		owned = (curl = new_handle()) != NULL;
+	}
+	~borrowed_handle() {
+		if (cached) thread_curl.busy = false;
+		if (owned) curl_easy_cleanup(curl);
+	}
+private:
+	borrowed_handle(const borrowed_handle&);
+	borrowed_handle& operator=(const borrowed_handle&);
+};
+
+static const char shm_scheme[] = "shm://";
+static const size_t shm_scheme_size = sizeof(shm_scheme) - 1;
+
+static
+int post_shm(const std::string& url, const std::string& request, std::string& response, call_stats* stats, long timeout_ms) {
+#ifdef __linux__
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int ret = detail::shm_post(url.substr(shm_scheme_size), request, response, timeout_ms);
+	if (stats) {
+		stats->total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats->http_status = ret == 0 ? 200 : 0;
+		stats->request_bytes = request.size();
+		stats->response_bytes = ret == 0 ? response.size() : 0;
 	}
 	return ret;
+#else
+	response = "shm:// urls are not supported on this platform";
+	return -1;
+#endif
+}
+
+int post(std::string url, std::string method, std::string request, std::string& response, std::map<std::string, std::string>& headers) {
+	return post(url, method, request, response, headers, NULL);
+}
+
+int post(std::string url, std::string method, std::string request, std::string& response, std::map<std::string, std::string>& headers, call_stats* stats) {
+	TINYXMLRPC_TRACE_SPAN("post");
+	if (!url.compare(0, shm_scheme_size, shm_scheme))
+		return post_shm(url, request, response, stats, 0);
+	borrowed_handle handle(NULL);
+	if (!handle.curl)
+		return -1;
+	return perform(handle.curl, url, request, response, headers, stats, 0, 0);
+}
+
+static
+size_t discard(char*, size_t size, size_t nmemb, void*) {
+	return size * nmemb;
 }
 
+/* libcurl's own default; it has no getter, and nothing else here
+ * changes it on a thread handle */
+static const long default_maxconnects = 5;
+
+/* OPTIONS is answered without side effects and, unlike CONNECT_ONLY,
+ * leaves a connection libcurl will reuse for the next POST */
+int warmup(const std::vector<std::string>& urls, double timeout) {
+	TINYXMLRPC_TRACE_SPAN("warmup");
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+		std::chrono::microseconds((long long)(timeout * 1e6));
+	borrowed_handle handle(NULL);
+	if (!handle.curl)
+		return 0;
+	CURL* curl = handle.curl;
+	curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, std::max((long)urls.size(), default_maxconnects));
+	int reached = 0;
+	for(size_t n = 0; n < urls.size(); n++) {
+		if (!urls[n].compare(0, shm_scheme_size, shm_scheme))
+			continue;
+		long left = (long)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (left <= 0)
+			break;
+		if (!urls[n].compare(0, unix_scheme_size, unix_scheme)) {
+			curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, urls[n].c_str() + unix_scheme_size);
+			curl_easy_setopt(curl, CURLOPT_URL, "http://localhost/RPC2");
+		} else {
+			curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, NULL);
+			curl_easy_setopt(curl, CURLOPT_URL, urls[n].c_str());
+		}
+		curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+		curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "OPTIONS");
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+		curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)0);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 0L);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, left);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		if (curl_easy_perform(curl) == CURLE_OK)
+			reached++;
+	}
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, NULL);
+	curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, default_maxconnects);
+	return reached;
+}
+
+/*
+ * Turns an HTML or XML error body into text in one pass: tags and \r
+ * are dropped and tabs become spaces. Whitespace right after a tag is
+ * dropped too; other text after a tag is set apart by a space.
+ */
 std::string extract_failt_message(std::string& strXml) {
 	std::string ret;
-	ret = strXml;
-	ret.erase(std::remove(ret.begin(), ret.end(), '\r'), ret.end());
-	std::replace(ret.begin(), ret.end(), '\t', ' ');
-	while (true) {
-		int iPos1 = ret.find_first_of('<');
-		int iPos2 = ret.find_first_of('>');
-		if (iPos1 == -1 || iPos2 == -1) break;
-		ret.erase(iPos1, iPos2-iPos1+1);
-		if (ret[iPos1] == '\n' || ret[iPos1] == ' ') {
-			iPos2 = ret.substr(iPos1).find_first_not_of("\t \n");
-			ret.erase(iPos1, iPos2);
-		} else
-		if (iPos1 > 0 && ret[iPos1-1] != '\n' && ret[iPos1-1] != ' ')
-			ret.insert(iPos1, " ");
+	ret.reserve(strXml.size());
+	const char* p = strXml.data();
+	const char* end = p + strXml.size();
+	bool tags = true;
+	while (p < end) {
+		const char* close;
+		if (*p != '<' || !tags || !(close = (const char*)memchr(p, '>', end - p))) {
+			/* a '<' with no '>' after it ends the markup */
+			if (*p == '<') tags = false;
+			if (*p != '\r') ret += *p == '\t' ? ' ' : *p;
+			p++;
+			continue;
+		}
+		p = close + 1;
+		const char* next = p;
+		while (next < end && *next == '\r') next++;
+		if (next < end && (*next == '\n' || *next == ' ' || *next == '\t')) {
+			while (next < end && (*next == '\n' || *next == ' ' || *next == '\t' || *next == '\r'))
+				next++;
+		} else if (!ret.empty() && ret[ret.size()-1] != '\n' && ret[ret.size()-1] != ' ')
+			ret += ' ';
+		p = next;
 	}
 	if (!ret.empty()) {
 		if (ret[ret.size()-1] == '\n')
@@ -747,8 +1789,7 @@ value::Binary binary_fromfile(std::string filename) {
 		delete[] ptr;
 		return valuebinary;
 	}
-	value empty;
-	return empty;
+	return value::Binary();
 }
 
 bool binary_tofile(std::string filename, value::Binary valuebinary) {
@@ -768,14 +1809,2030 @@ const value call(std::string url, std::string method, std::vector<value>& reques
 	return call(url, method, requests, headers);
 }
 
-const value call(std::string url, std::string method, std::vector<value>& requests, std::map<std::string, std::string>& headers) {
-	int result = 0;
+static std::atomic<bool> stats_enabled(false);
+typedef std::function<void(const call_stats&)> stats_hook_function;
+/* swapped whole so that a call in flight keeps the hook it loaded */
+static std::shared_ptr<const stats_hook_function> stats_hook;
+static std::atomic<bool> stats_hooked(false);
+
+static
+double elapsed_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static
+long remaining_ms(std::chrono::steady_clock::time_point deadline) {
+	long ms = (long)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+	return ms < 1 ? 1 : ms;
+}
+
+/* the delay after which a hedge goes out: explicit, or the method's
+ * observed p95 once there are enough samples to trust it */
+static
+double hedge_delay(const std::string& method, const call_options& options) {
+	if (options.hedge_delay > 0)
+		return options.hedge_delay;
+	const method_stats* entry = find_stats(method);
+	if (!entry || entry->latency.count() < 20)
+		return -1;
+	return entry->latency.percentile(95);
+}
+
+/*
+ * Sends the request to url and, if no answer has arrived after the hedge
+ * delay, a duplicate to the next hedge url. The first successful answer
+ * wins; the other transfer is cancelled by removing it from the multi
+ * handle.
+ */
+static
+int post_hedged(CURL* curl, const std::string& url, const std::string& method, const std::string& request, std::string& response, std::map<std::string, std::string>& headers, call_stats* stats, const call_options& options) {
+	static std::atomic<unsigned> next_replica(0);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point deadline = start + std::chrono::milliseconds((long)(options.timeout * 1000));
+	long connect_ms = (long)(options.connect_timeout * 1000);
+	double delay = hedge_delay(method, options);
+	std::chrono::steady_clock::time_point hedge_at = start + std::chrono::microseconds((long long)(delay * 1e6));
+
+	CURLM* multi = curl_multi_init();
+	borrowed_handle first(curl);
+	CURL* handles[2] = { first.curl, NULL };
+	transfer transfers[2];
+	transfers[0].setup(handles[0], url, request, headers, connect_ms, options.timeout > 0 ? remaining_ms(deadline) : 0);
+	curl_multi_add_handle(multi, handles[0]);
+
+	int pending = 1, winner = -1, last = -1;
+	CURLcode codes[2] = { CURLE_OK, CURLE_OK };
+	while (winner < 0 && pending > 0) {
+		int running;
+		curl_multi_perform(multi, &running);
+		CURLMsg* msg;
+		int queued;
+		while ((msg = curl_multi_info_read(multi, &queued))) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			int n = msg->easy_handle == handles[0] ? 0 : 1;
+			long status = 0;
+			codes[n] = msg->data.result;
+			curl_easy_getinfo(handles[n], CURLINFO_RESPONSE_CODE, &status);
+			pending--;
+			last = n;
+			if (codes[n] == CURLE_OK && status == 200 && winner < 0)
+				winner = n;
+		}
+		if (winner >= 0 || pending == 0) break;
+		if (!handles[1] && delay >= 0 && std::chrono::steady_clock::now() >= hedge_at) {
+			const std::string& replica = options.hedge_urls[next_replica++ % options.hedge_urls.size()];
+			handles[1] = new_handle();
+			if (handles[1]) {
+				transfers[1].setup(handles[1], replica, request, headers, connect_ms, options.timeout > 0 ? remaining_ms(deadline) : 0);
+				curl_multi_add_handle(multi, handles[1]);
+				pending++;
+			}
+		}
+		int wait_ms = 1000;
+		if (!handles[1] && delay >= 0)
+			wait_ms = (int)std::max(0L, (long)std::chrono::duration_cast<std::chrono::milliseconds>(hedge_at - std::chrono::steady_clock::now()).count() + 1);
+		curl_multi_poll(multi, NULL, 0, wait_ms, NULL);
+	}
+	if (winner < 0) winner = last;
+
+	int ret = transfers[winner].finish(codes[winner], response, stats);
+	if (stats) {
+		stats->hedged = handles[1] != NULL;
+		stats->hedge_won = winner == 1;
+	}
+	for(int n = 0; n < 2; n++) {
+		if (!handles[n]) continue;
+		curl_multi_remove_handle(multi, handles[n]);
+		if (n != winner) {
+			std::string ignored;
+			transfers[n].finish(codes[n], ignored, NULL);
+		}
+	}
+	curl_multi_cleanup(multi);
+	if (handles[1]) curl_easy_cleanup(handles[1]);
+	return ret;
+}
+
+/* runs post under the endpoint's limiter when the options ask for one */
+template<class P>
+static
+int post_limited(const std::string& url, std::string& response, call_stats* stats, const call_options* options, P post) {
+	if (!options || !options->limit_concurrency)
+		return post();
+	concurrency_limiter* limiter = endpoint_limiter(url);
+	if (!limiter->acquire(options->queue_timeout)) {
+		response = "concurrency limit reached for " + url;
+		return -4;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int ret = post();
+	limiter->release(elapsed_since(start), ret);
+	return ret;
+}
+
+static
+int post_once(CURL* curl, const std::string& url, const std::string& method, const std::string& request, std::string& response, std::map<std::string, std::string>& headers, call_stats* stats, const call_options* options) {
+	TINYXMLRPC_TRACE_SPAN("post");
+	long connect_ms = options ? (long)(options->connect_timeout * 1000) : 0;
+	long timeout_ms = options ? (long)(options->timeout * 1000) : 0;
+	if (!url.compare(0, shm_scheme_size, shm_scheme))
+		return post_shm(url, request, response, stats, timeout_ms);
+	if (options && !options->hedge_urls.empty())
+		return post_hedged(curl, url, method, request, response, headers, stats, *options);
+	borrowed_handle handle(curl);
+	if (!handle.curl)
+		return -1;
+	return perform(handle.curl, url, request, response, headers, stats, connect_ms, timeout_ms);
+}
+
+static
+int post_with(CURL* curl, const std::string& url, const std::string& method, const std::string& request, std::string& response, std::map<std::string, std::string>& headers, call_stats* stats, const call_options* options) {
+	return post_limited(url, response, stats, options, [&]() {
+		return post_once(curl, url, method, request, response, headers, stats, options);
+	});
+}
+
+/* sends over an easy handle: curl is the handle to reuse, or NULL for the
+ * calling thread's handle */
+struct easy_post {
+	CURL* curl;
+	const std::string& url;
+	std::map<std::string, std::string>& headers;
+	const call_options* options;
+	bool hedging() const { return options && !options->hedge_urls.empty(); }
+	int operator()(const std::string& method, const std::string& request, std::string& response, call_stats* stats) const {
+		return post_with(curl, url, method, request, response, headers, stats, options);
+	}
+};
+
+/* encode renders the request document, post moves it to the server */
+template<class P, class E>
+static
+const value invoke(P post, const std::string& method, E encode, call_stats* pstats) {
 	std::string response;
-	result = post(url, method, serialize(method, requests), response, headers);
-	if (result == 0)
-		return parse(response);
-	else
-		return new value::Exception(response, result);
+	std::string request;
+	bool hedging = post.hedging();
+	if (!pstats && !hedging && !stats_enabled && !stats_hooked && !capturing()) {
+		encode(request);
+		int result = post(method, request, response, NULL);
+		if (result == 0)
+			return parse(response);
+		else
+			return new value::Exception(response, result);
+	}
+
+	call_stats local;
+	call_stats& stats = pstats ? *pstats : local;
+	std::chrono::system_clock::time_point wall = std::chrono::system_clock::now();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	encode(request);
+	stats.method = method;
+	stats.encode = elapsed_since(start);
+
+	stats.result = post(method, request, response, &stats);
+	if (capturing()) {
+		capture_record record;
+		record.source = 'C';
+		record.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wall.time_since_epoch()).count();
+		record.duration = stats.total;
+		record.result = stats.result;
+		record.method = method;
+		record.request = request;
+		record.response = response;
+		capture_write(record);
+	}
+	value ret;
+	if (stats.result == 0) {
+		start = std::chrono::steady_clock::now();
+		ret = parse(response);
+		stats.decode = elapsed_since(start);
+		stats.fault = failed(ret);
+	} else
+		ret = new value::Exception(response, stats.result);
+	if (stats_hooked) {
+		std::shared_ptr<const stats_hook_function> hook = std::atomic_load(&stats_hook);
+		if (hook) (*hook)(stats);
+	}
+	/* hedged calls always feed the registry, which supplies their p95 */
+	if (stats_enabled || hedging) record_stats(stats);
+	return ret;
+}
+
+struct encode_call {
+	const std::string& method;
+	std::vector<value>& requests;
+	void operator()(std::string& out) const { out = serialize(method, requests); }
+};
+
+struct encode_template {
+	const request_template& tmpl;
+	const std::vector<value>& args;
+	void operator()(std::string& out) const { tmpl.render(args, out); }
+};
+
+const value call(std::string url, std::string method, std::vector<value>& requests, std::map<std::string, std::string>& headers) {
+	encode_call encode = { method, requests };
+	easy_post post = { NULL, url, headers, NULL };
+	return invoke(post, method, encode, NULL);
+}
+
+const value call(std::string url, std::string method, std::vector<value>& requests, std::map<std::string, std::string>& headers, call_stats& stats) {
+	encode_call encode = { method, requests };
+	easy_post post = { NULL, url, headers, NULL };
+	return invoke(post, method, encode, &stats);
+}
+
+const value call(std::string url, std::string method, std::vector<value>& requests, const call_options& options) {
+	std::map<std::string, std::string> headers;
+	encode_call encode = { method, requests };
+	easy_post post = { NULL, url, headers, &options };
+	return invoke(post, method, encode, NULL);
+}
+
+const value call(std::string url, const request_template& tmpl, const std::vector<value>& args) {
+	std::map<std::string, std::string> headers;
+	encode_template encode = { tmpl, args };
+	easy_post post = { NULL, url, headers, NULL };
+	return invoke(post, tmpl.method(), encode, NULL);
+}
+
+client::client(std::string url) : _url(url) {
+	_curl = new_handle();
+}
+
+client::~client() {
+	if (_curl) curl_easy_cleanup((CURL*)_curl);
+}
+
+int client::post(std::string request, std::string& response, call_stats* stats) {
+	if (!_curl) return -1;
+	return post_with((CURL*)_curl, _url, "", request, response, _headers, stats, &_options);
 }
 
+const value client::call(std::string method, std::vector<value>& requests) {
+	if (!_curl)
+		return new value::Exception("curl_easy_init failed", -1);
+	encode_call encode = { method, requests };
+	easy_post post = { (CURL*)_curl, _url, _headers, &_options };
+	return invoke(post, method, encode, NULL);
+}
+
+const value client::call(std::string method, std::vector<value>& requests, call_stats& stats) {
+	if (!_curl)
+		return new value::Exception("curl_easy_init failed", -1);
+	encode_call encode = { method, requests };
+	easy_post post = { (CURL*)_curl, _url, _headers, &_options };
+	return invoke(post, method, encode, &stats);
+}
+
+const value client::call(const request_template& tmpl, const std::vector<value>& args) {
+	if (!_curl)
+		return new value::Exception("curl_easy_init failed", -1);
+	encode_template encode = { tmpl, args };
+	easy_post post = { (CURL*)_curl, _url, _headers, &_options };
+	return invoke(post, tmpl.method(), encode, NULL);
+}
+
+/* one call handed to the multiplexing thread */
+struct exchange {
+	transfer t;
+	CURLcode code;
+	bool finished;
+	std::condition_variable done;
+};
+
+struct http2_client::impl {
+	CURLM* multi;
+	long cleartext;
+	std::thread loop;
+	std::mutex lock;
+	std::deque<CURL*> submitted;
+	std::vector<CURL*> transfers;
+	std::vector<CURL*> idle;
+	int waiters;
+	std::condition_variable drained;
+	bool stopping;
+
+	static void fail(CURL* curl) {
+		exchange* x;
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&x);
+		x->code = CURLE_ABORTED_BY_CALLBACK;
+		x->finished = true;
+		x->done.notify_one();
+	}
+	/* run by the loop thread, the only user of multi, with the lock held
+	 * once stopping is set, so no caller waits on a transfer that will
+	 * never finish */
+	void abandon() {
+		for(size_t n = 0; n < transfers.size(); n++) {
+			curl_multi_remove_handle(multi, transfers[n]);
+			fail(transfers[n]);
+		}
+		transfers.clear();
+		for(; !submitted.empty(); submitted.pop_front())
+			fail(submitted.front());
+	}
+	void run() {
+		while (true) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (stopping) {
+					abandon();
+					break;
+				}
+				for(; !submitted.empty(); submitted.pop_front()) {
+					curl_multi_add_handle(multi, submitted.front());
+					transfers.push_back(submitted.front());
+				}
+			}
+			int running;
+			curl_multi_perform(multi, &running);
+			CURLMsg* msg;
+			int queued;
+			while ((msg = curl_multi_info_read(multi, &queued))) {
+				if (msg->msg != CURLMSG_DONE) continue;
+				CURL* curl = msg->easy_handle;
+				CURLcode code = msg->data.result;
+				curl_multi_remove_handle(multi, curl);
+				exchange* x;
+				curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**)&x);
+				std::lock_guard<std::mutex> guard(lock);
+				transfers.erase(std::find(transfers.begin(), transfers.end(), curl));
+				x->code = code;
+				x->finished = true;
+				x->done.notify_one();
+			}
+			curl_multi_poll(multi, NULL, 0, 1000, NULL);
+		}
+	}
+	int post(const std::string& url, const std::string& request, std::string& response, std::map<std::string, std::string>& headers, call_stats* stats, const call_options& options) {
+		CURL* curl = NULL;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (!idle.empty()) {
+				curl = idle.back();
+				idle.pop_back();
+			}
+		}
+		if (!curl && !(curl = new_handle()))
+			return -1;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			waiters++;
+		}
+		exchange x;
+		x.code = CURLE_OK;
+		x.finished = false;
+		x.t.setup(curl, url, request, headers, (long)(options.connect_timeout * 1000), (long)(options.timeout * 1000));
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, !url.compare(0, 8, "https://") ?
+			CURL_HTTP_VERSION_2TLS : cleartext);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+		curl_easy_setopt(curl, CURLOPT_PRIVATE, &x);
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			/* the loop has drained submitted for the last time */
+			if (stopping)
+				fail(curl);
+			else {
+				submitted.push_back(curl);
+				curl_multi_wakeup(multi);
+			}
+			TINYXMLRPC_TRACE_SPAN("http2_wait");
+			while (!x.finished)
+				x.done.wait(guard);
+		}
+		int ret = x.t.finish(x.code, response, stats);
+		std::lock_guard<std::mutex> guard(lock);
+		idle.push_back(curl);
+		if (--waiters == 0)
+			drained.notify_all();
+		return ret;
+	}
+};
+
+/* sends as one stream of an http2_client */
+struct http2_post {
+	http2_client::impl* d;
+	const std::string& url;
+	std::map<std::string, std::string>& headers;
+	const call_options& options;
+	bool hedging() const { return false; }
+	int operator()(const std::string&, const std::string& request, std::string& response, call_stats* stats) const {
+		TINYXMLRPC_TRACE_SPAN("post");
+		return post_limited(url, response, stats, &options, [&]() {
+			return d->post(url, request, response, headers, stats, options);
+		});
+	}
+};
+
+http2_client::http2_client(std::string url, int max_connections) : _url(url), _impl(new impl) {
+	init();
+	_impl->stopping = false;
+	_impl->waiters = 0;
+	_impl->multi = curl_multi_init();
+	/* libcurl before 8.0 cannot reuse a prior-knowledge connection, so
+	 * it reaches h2c through Upgrade on the first request instead */
+	_impl->cleartext = curl_version_info(CURLVERSION_NOW)->version_num < 0x080000 ?
+		CURL_HTTP_VERSION_2_0 : CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+	curl_multi_setopt(_impl->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	curl_multi_setopt(_impl->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)std::max(max_connections, 1));
+	_impl->loop = std::thread(&impl::run, _impl);
+}
+
+http2_client::~http2_client() {
+	{
+		std::lock_guard<std::mutex> guard(_impl->lock);
+		_impl->stopping = true;
+		curl_multi_wakeup(_impl->multi);
+	}
+	_impl->loop.join();
+	{
+		std::unique_lock<std::mutex> guard(_impl->lock);
+		while (_impl->waiters > 0)
+			_impl->drained.wait(guard);
+	}
+	for(size_t n = 0; n < _impl->idle.size(); n++)
+		curl_easy_cleanup(_impl->idle[n]);
+	curl_multi_cleanup(_impl->multi);
+	delete _impl;
+}
+
+int http2_client::post(std::string request, std::string& response, call_stats* stats) {
+	return post_limited(_url, response, stats, &_options, [&]() {
+		return _impl->post(_url, request, response, _headers, stats, _options);
+	});
+}
+
+const value http2_client::call(std::string method, std::vector<value>& requests) {
+	encode_call encode = { method, requests };
+	http2_post post = { _impl, _url, _headers, _options };
+	return invoke(post, method, encode, NULL);
+}
+
+const value http2_client::call(std::string method, std::vector<value>& requests, call_stats& stats) {
+	encode_call encode = { method, requests };
+	http2_post post = { _impl, _url, _headers, _options };
+	return invoke(post, method, encode, &stats);
+}
+
+const value http2_client::call(const request_template& tmpl, const std::vector<value>& args) {
+	encode_template encode = { tmpl, args };
+	http2_post post = { _impl, _url, _headers, _options };
+	return invoke(post, tmpl.method(), encode, NULL);
+}
+
+struct endpoint_group::lock {
+	std::mutex m;
+};
+
+static
+double monotonic_seconds() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+endpoint_group::endpoint_group(const std::vector<std::string>& urls, policy p)
+		: _policy(p), _max_failures(5), _eject_time(10), _seed(0x2545f4914f6cdd1dUL), _lock(new lock) {
+	for(size_t n = 0; n < urls.size(); n++) {
+		endpoint e;
+		e.url = urls[n];
+		e.outstanding = 0;
+		e.latency = 0;
+		e.consecutive_failures = 0;
+		e.ejected_until = 0;
+		e.calls = e.failures = e.ejections = 0;
+		_endpoints.push_back(e);
+	}
+}
+
+endpoint_group::~endpoint_group() {
+	for(size_t n = 0; n < _endpoints.size(); n++)
+		for(size_t i = 0; i < _endpoints[n].idle.size(); i++)
+			delete _endpoints[n].idle[i];
+	delete _lock;
+}
+
+void endpoint_group::set_ejection(int max_failures, double eject_time) {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	_max_failures = max_failures;
+	_eject_time = eject_time;
+}
+
+std::vector<endpoint_group::endpoint> endpoint_group::snapshot() const {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	std::vector<endpoint> ret = _endpoints;
+	for(size_t n = 0; n < ret.size(); n++)
+		ret[n].idle.clear();
+	return ret;
+}
+
+/* called with the lock held */
+size_t endpoint_group::pick() {
+	double now = monotonic_seconds();
+	std::vector<size_t> live;
+	for(size_t n = 0; n < _endpoints.size(); n++)
+		if (_endpoints[n].ejected_until <= now)
+			live.push_back(n);
+	if (live.empty())
+		for(size_t n = 0; n < _endpoints.size(); n++)
+			live.push_back(n);
+
+	_seed ^= _seed << 13;
+	_seed ^= _seed >> 7;
+	_seed ^= _seed << 17;
+	if (_policy == PowerOfTwo && live.size() > 1) {
+		size_t i = _seed % live.size();
+		size_t a = live[i], b = live[(i + 1 + (_seed >> 32) % (live.size() - 1)) % live.size()];
+		double sa = _endpoints[a].latency * (_endpoints[a].outstanding + 1);
+		double sb = _endpoints[b].latency * (_endpoints[b].outstanding + 1);
+		return sa <= sb ? a : b;
+	}
+	/* least outstanding, ties broken by latency, scanning from a random
+	 * start so equal replicas share the load */
+	size_t best = live[_seed % live.size()];
+	for(size_t i = 0; i < live.size(); i++) {
+		const endpoint& e = _endpoints[live[i]];
+		const endpoint& b = _endpoints[best];
+		if (e.outstanding < b.outstanding || (e.outstanding == b.outstanding && e.latency < b.latency))
+			best = live[i];
+	}
+	return best;
+}
+
+const value endpoint_group::call(std::string method, std::vector<value>& requests) {
+	call_stats stats;
+	return call(method, requests, stats);
+}
+
+const value endpoint_group::call(std::string method, std::vector<value>& requests, call_stats& stats) {
+	if (_endpoints.empty())
+		return new value::Exception("endpoint group is empty", -1);
+	size_t n;
+	client* c = NULL;
+	{
+		std::lock_guard<std::mutex> guard(_lock->m);
+		n = pick();
+		endpoint& e = _endpoints[n];
+		e.outstanding++;
+		e.calls++;
+		if (!e.idle.empty()) {
+			c = e.idle.back();
+			e.idle.pop_back();
+		}
+	}
+	if (!c) c = new client(_endpoints[n].url);
+	c->options() = _options;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	value ret = c->call(method, requests, stats);
+	double elapsed = elapsed_since(start);
+
+	std::lock_guard<std::mutex> guard(_lock->m);
+	endpoint& e = _endpoints[n];
+	e.outstanding--;
+	/* only -2 (transfer) and -3 (HTTP status) are the replica's doing;
+	 * -1, -4 and -5 are this process's handle, limiter and body limit */
+	if (stats.result != 0 && stats.result != -2 && stats.result != -3) {
+		if (stats.result == -1)
+			delete c;
+		else
+			e.idle.push_back(c);
+	} else if (stats.result != 0) {
+		/* a replica failing fast must not look attractive */
+		e.latency = std::max(e.latency * 2, 0.001);
+		e.failures++;
+		if (++e.consecutive_failures >= _max_failures && e.ejected_until <= monotonic_seconds()) {
+			e.ejected_until = monotonic_seconds() + _eject_time;
+			e.ejections++;
+			e.consecutive_failures = 0;
+		}
+		delete c;
+	} else {
+		e.consecutive_failures = 0;
+		e.latency = e.latency == 0 ? elapsed : e.latency * 0.7 + elapsed * 0.3;
+		e.idle.push_back(c);
+	}
+	return ret;
+}
+
+struct concurrency_limiter::lock {
+	std::mutex m;
+	std::condition_variable slot;
+};
+
+concurrency_limiter::concurrency_limiter(algorithm a, int initial_limit, int min_limit, int max_limit)
+		: _algorithm(a), _limit(initial_limit), _min_limit(std::max(min_limit, 1)), _max_limit(std::max(max_limit, 1)),
+		_in_flight(0), _waiting(0), _max_queue(1000), _backoff(0.9), _tolerance(1.5), _fastest(0), _window_fastest(0), _samples(0), _rejected(0), _lock(new lock) {
+	_limit = std::min(std::max(_limit, (double)_min_limit), (double)_max_limit);
+}
+
+concurrency_limiter::~concurrency_limiter() {
+	delete _lock;
+}
+
+bool concurrency_limiter::acquire(double max_wait) {
+	std::unique_lock<std::mutex> guard(_lock->m);
+	if (_in_flight < (int)_limit) {
+		_in_flight++;
+		return true;
+	}
+	if (max_wait <= 0 || _waiting >= _max_queue) {
+		_rejected++;
+		return false;
+	}
+	_waiting++;
+	bool got = _lock->slot.wait_for(guard, std::chrono::duration<double>(max_wait), [this]() { return _in_flight < (int)_limit; });
+	_waiting--;
+	if (!got) {
+		_rejected++;
+		return false;
+	}
+	_in_flight++;
+	return true;
+}
+
+void concurrency_limiter::release(double latency, int result) {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	/* judged by the load the call went out under, itself included */
+	bool saturated = _in_flight * 2 >= (int)_limit;
+	_in_flight--;
+	if (result == -2 || result == -3)
+		_limit *= _backoff;
+	else if (result == 0 && _algorithm == Aimd) {
+		if (saturated) _limit += 1 / _limit;
+	} else if (result == 0 && latency > 0) {
+		/* the fastest call of the previous window stands in for the
+		 * latency without queueing, so it can follow a changing backend */
+		if (_fastest == 0 || latency < _fastest) _fastest = latency;
+		if (_window_fastest == 0 || latency < _window_fastest) _window_fastest = latency;
+		if (++_samples == 1000) {
+			_fastest = _window_fastest;
+			_window_fastest = 0;
+			_samples = 0;
+		}
+		if (saturated) {
+			double gradient = std::max(0.5, std::min(1.0, _tolerance * _fastest / latency));
+			_limit = _limit * 0.8 + (_limit * gradient + sqrt(_limit)) * 0.2;
+		}
+	}
+	_limit = std::min(std::max(_limit, (double)_min_limit), (double)_max_limit);
+	_lock->slot.notify_all();
+}
+
+void concurrency_limiter::set_algorithm(algorithm a) {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	_algorithm = a;
+}
+
+void concurrency_limiter::set_bounds(int min_limit, int max_limit) {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	_min_limit = std::max(min_limit, 1);
+	_max_limit = std::max(max_limit, _min_limit);
+	_limit = std::min(std::max(_limit, (double)_min_limit), (double)_max_limit);
+	_lock->slot.notify_all();
+}
+
+void concurrency_limiter::set_max_queue(int max_queue) {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	_max_queue = max_queue;
+}
+
+void concurrency_limiter::set_backoff(double backoff, double tolerance) {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	_backoff = backoff;
+	_tolerance = tolerance;
+}
+
+int concurrency_limiter::limit() const {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	return (int)_limit;
+}
+
+int concurrency_limiter::in_flight() const {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	return _in_flight;
+}
+
+unsigned long concurrency_limiter::rejected() const {
+	std::lock_guard<std::mutex> guard(_lock->m);
+	return _rejected;
+}
+
+concurrency_limiter* endpoint_limiter(const std::string& url) {
+	static std::mutex lock;
+	static std::map<std::string, concurrency_limiter*> limiters;
+	std::lock_guard<std::mutex> guard(lock);
+	concurrency_limiter*& limiter = limiters[url];
+	if (!limiter) limiter = new concurrency_limiter;
+	return limiter;
+}
+
+static
+unsigned long to_us(double seconds) {
+	if (seconds <= 0) return 0;
+	if (seconds >= 4294.967295) return 4294967295UL;
+	return (unsigned long)(seconds * 1e6);
+}
+
+int latency_histogram::bucket_of(unsigned long us) {
+	if (us > 4294967295UL) us = 4294967295UL;
+	if (us < sub_count) return (int)us;
+	int shift = 0;
+	while ((us >> shift) >= 2 * sub_count) shift++;
+	return (shift + 1) * sub_count + (int)(us >> shift) - sub_count;
+}
+
+unsigned long latency_histogram::bucket_limit(int bucket) {
+	if (bucket < sub_count) return bucket + 1;
+	int shift = bucket / sub_count - 1;
+	return ((unsigned long)(bucket % sub_count + sub_count + 1) << shift);
+}
+
+void latency_histogram::record(double seconds) {
+	unsigned long us = to_us(seconds);
+	_buckets[bucket_of(us)]++;
+	_count++;
+	_sum_us += us;
+	unsigned long max = _max_us;
+	while (us > max && !_max_us.compare_exchange_weak(max, us));
+}
+
+void latency_histogram::merge(const latency_histogram& other) {
+	for(int n = 0; n < bucket_count; n++)
+		_buckets[n] += other._buckets[n];
+	_count += other._count;
+	_sum_us += other._sum_us;
+	unsigned long max = _max_us, us = other._max_us;
+	while (us > max && !_max_us.compare_exchange_weak(max, us));
+}
+
+void latency_histogram::reset() {
+	for(int n = 0; n < bucket_count; n++)
+		_buckets[n] = 0;
+	_count = 0;
+	_sum_us = 0;
+	_max_us = 0;
+}
+
+double latency_histogram::percentile(double p) const {
+	unsigned long total = _count;
+	if (total == 0) return 0;
+	unsigned long rank = (unsigned long)(p / 100 * total + 0.5), seen = 0;
+	if (rank < 1) rank = 1;
+	for(int n = 0; n < bucket_count; n++) {
+		seen += _buckets[n];
+		if (seen >= rank) {
+			unsigned long limit = bucket_limit(n) - 1;
+			return (limit < _max_us ? limit : (unsigned long)_max_us) * 1e-6;
+		}
+	}
+	return max();
+}
+
+unsigned long latency_histogram::count_below(double seconds) const {
+	unsigned long us = to_us(seconds), total = 0;
+	for(int n = 0; n < bucket_count && bucket_limit(n) <= us + 1; n++)
+		total += _buckets[n];
+	return total;
+}
+
+void method_stats::reset() {
+	calls = 0;
+	errors = 0;
+	faults = 0;
+	hedges = 0;
+	hedge_wins = 0;
+	request_bytes = 0;
+	response_bytes = 0;
+	encode_us = 0;
+	network_us = 0;
+	decode_us = 0;
+	latency.reset();
+}
+
+static std::mutex stats_lock;
+static std::map<std::string, method_stats*> stats_registry;
+
+static
+method_stats* stats_for(const std::string& method) {
+	std::lock_guard<std::mutex> guard(stats_lock);
+	method_stats*& entry = stats_registry[method];
+	if (!entry) entry = new method_stats;
+	return entry;
+}
+
+void enable_stats(bool enable) {
+	stats_enabled = enable;
+}
+
+void set_stats_hook(std::function<void(const call_stats&)> hook) {
+	std::shared_ptr<const stats_hook_function> installed;
+	if (hook) installed = std::make_shared<const stats_hook_function>(hook);
+	std::atomic_store(&stats_hook, installed);
+	stats_hooked = (bool)hook;
+}
+
+void record_stats(const call_stats& stats) {
+	method_stats* entry = stats_for(stats.method);
+	entry->calls++;
+	if (stats.result != 0) entry->errors++;
+	if (stats.fault) entry->faults++;
+	if (stats.hedged) entry->hedges++;
+	if (stats.hedge_won) entry->hedge_wins++;
+	entry->request_bytes += stats.request_bytes;
+	entry->response_bytes += stats.response_bytes;
+	entry->encode_us += to_us(stats.encode);
+	entry->network_us += to_us(stats.total);
+	entry->decode_us += to_us(stats.decode);
+	entry->latency.record(stats.encode + stats.total + stats.decode);
+}
+
+const method_stats* find_stats(const std::string& method) {
+	std::lock_guard<std::mutex> guard(stats_lock);
+	std::map<std::string, method_stats*>::const_iterator it = stats_registry.find(method);
+	return it == stats_registry.end() ? NULL : it->second;
+}
+
+std::vector<std::string> stats_methods() {
+	std::lock_guard<std::mutex> guard(stats_lock);
+	std::vector<std::string> ret;
+	std::map<std::string, method_stats*>::const_iterator it;
+	for(it = stats_registry.begin(); it != stats_registry.end(); it++)
+		ret.push_back(it->first);
+	return ret;
+}
+
+void reset_stats() {
+	std::lock_guard<std::mutex> guard(stats_lock);
+	std::map<std::string, method_stats*>::iterator it;
+	for(it = stats_registry.begin(); it != stats_registry.end(); it++)
+		it->second->reset();
+}
+
+static
+std::string prometheus_label(const std::string& method) {
+	std::string ret = "method=\"";
+	for(size_t n = 0; n < method.size(); n++) {
+		if (method[n] == '\\' || method[n] == '"') ret += '\\';
+		if (method[n] == '\n')
+			ret += "\\n";
+		else
+			ret += method[n];
+	}
+	return ret + "\"";
+}
+
+static
+void prometheus_line(std::string& out, const char* name, const std::string& labels, double v) {
+	char buf[scalar::double_size];
+	out += name;
+	out += "{" + labels + "} ";
+	out.append(buf, snprintf(buf, sizeof(buf), "%.9g", v));
+	out += "\n";
+}
+
+static
+void prometheus_line(std::string& out, const char* name, const std::string& labels, unsigned long v) {
+	char buf[scalar::double_size];
+	out += name;
+	out += "{" + labels + "} ";
+	out.append(buf, snprintf(buf, sizeof(buf), "%lu", v));
+	out += "\n";
+}
+
+std::string stats_prometheus() {
+	static const double bounds[] = {
+		0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+		0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+	};
+	std::map<std::string, method_stats*> entries;
+	{
+		std::lock_guard<std::mutex> guard(stats_lock);
+		entries = stats_registry;
+	}
+	std::string out;
+	std::map<std::string, method_stats*>::const_iterator it;
+	out += "# TYPE tinyxmlrpc_calls_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++)
+		prometheus_line(out, "tinyxmlrpc_calls_total", prometheus_label(it->first), (unsigned long)it->second->calls);
+	out += "# TYPE tinyxmlrpc_errors_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++)
+		prometheus_line(out, "tinyxmlrpc_errors_total", prometheus_label(it->first), (unsigned long)it->second->errors);
+	out += "# TYPE tinyxmlrpc_faults_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++)
+		prometheus_line(out, "tinyxmlrpc_faults_total", prometheus_label(it->first), (unsigned long)it->second->faults);
+	out += "# TYPE tinyxmlrpc_hedges_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++)
+		prometheus_line(out, "tinyxmlrpc_hedges_total", prometheus_label(it->first), (unsigned long)it->second->hedges);
+	out += "# TYPE tinyxmlrpc_hedge_wins_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++)
+		prometheus_line(out, "tinyxmlrpc_hedge_wins_total", prometheus_label(it->first), (unsigned long)it->second->hedge_wins);
+	out += "# TYPE tinyxmlrpc_request_bytes_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++)
+		prometheus_line(out, "tinyxmlrpc_request_bytes_total", prometheus_label(it->first), (unsigned long)it->second->request_bytes);
+	out += "# TYPE tinyxmlrpc_response_bytes_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++)
+		prometheus_line(out, "tinyxmlrpc_response_bytes_total", prometheus_label(it->first), (unsigned long)it->second->response_bytes);
+	out += "# TYPE tinyxmlrpc_phase_seconds_total counter\n";
+	for(it = entries.begin(); it != entries.end(); it++) {
+		std::string label = prometheus_label(it->first);
+		prometheus_line(out, "tinyxmlrpc_phase_seconds_total", label + ",phase=\"encode\"", it->second->encode_us * 1e-6);
+		prometheus_line(out, "tinyxmlrpc_phase_seconds_total", label + ",phase=\"network\"", it->second->network_us * 1e-6);
+		prometheus_line(out, "tinyxmlrpc_phase_seconds_total", label + ",phase=\"decode\"", it->second->decode_us * 1e-6);
+	}
+	out += "# TYPE tinyxmlrpc_call_duration_seconds histogram\n";
+	for(it = entries.begin(); it != entries.end(); it++) {
+		std::string label = prometheus_label(it->first);
+		const latency_histogram& latency = it->second->latency;
+		for(size_t n = 0; n < sizeof(bounds) / sizeof(bounds[0]); n++) {
+			char le[scalar::double_size];
+			std::string bucket = label + ",le=\"";
+			bucket.append(le, snprintf(le, sizeof(le), "%g", bounds[n]));
+			prometheus_line(out, "tinyxmlrpc_call_duration_seconds_bucket", bucket + "\"", latency.count_below(bounds[n]));
+		}
+		prometheus_line(out, "tinyxmlrpc_call_duration_seconds_bucket", label + ",le=\"+Inf\"", latency.count());
+		prometheus_line(out, "tinyxmlrpc_call_duration_seconds_sum", label, latency.sum());
+		prometheus_line(out, "tinyxmlrpc_call_duration_seconds_count", label, latency.count());
+	}
+	return out;
+}
+
+namespace detail {
+
+static
+xmlNodePtr first_element(xmlNodePtr pNode) {
+	for(pNode = pNode ? pNode->children : NULL; pNode; pNode = pNode->next)
+		if (pNode->type == XML_ELEMENT_NODE) break;
+	return pNode;
+}
+
+void type_error(const char* expected) {
+	throw value::Exception(std::string("type error: expected ") + expected, 4);
+}
+
+std::string post_or_throw(std::string url, std::string request) {
+	std::map<std::string, std::string> headers;
+	std::string response;
+	int result = post(url, "", request, response, headers);
+	if (result != 0)
+		throw value::Exception(response, result);
+	return response;
+}
+
+}
+
+static
+void expect_type(const lazy_value& in, value::Type type, const char* name) {
+	if (in.getType() != type)
+		detail::type_error(name);
+}
+
+void codec<int>::decode(int& v, const lazy_value& in) {
+	expect_type(in, value::TypeInt, "i4");
+	v = in.getInt();
+}
+
+void codec<int>::encode(const int& v, std::string& out) {
+	char buf[scalar::int_size];
+	out += "<value>";
+	detail::write_element(out, "i4", 2, buf, scalar::format_int(buf, v));
+	out += "</value>";
+}
+
+void codec<long long>::decode(long long& v, const lazy_value& in) {
+	if (in.getType() != value::TypeInt)
+		expect_type(in, value::TypeI8, "i8");
+	v = in.getI8();
+}
+
+void codec<long long>::encode(const long long& v, std::string& out) {
+	char buf[scalar::i8_size];
+	out += "<value>";
+	detail::write_element(out, "i8", 2, buf, scalar::format_i8(buf, v));
+	out += "</value>";
+}
+
+void codec<bool>::decode(bool& v, const lazy_value& in) {
+	expect_type(in, value::TypeBoolean, "boolean");
+	v = in.getBoolean();
+}
+
+void codec<bool>::encode(const bool& v, std::string& out) {
+	out += v ? "<value><boolean>true</boolean></value>" : "<value><boolean>false</boolean></value>";
+}
+
+void codec<double>::decode(double& v, const lazy_value& in) {
+	expect_type(in, value::TypeDouble, "double");
+	v = in.getDouble();
+}
+
+void codec<double>::encode(const double& v, std::string& out) {
+	char buf[scalar::double_size];
+	out += "<value>";
+	detail::write_element(out, "double", 6, buf, scalar::format_double(buf, v));
+	out += "</value>";
+}
+
+void codec<std::string>::decode(std::string& v, const lazy_value& in) {
+	expect_type(in, value::TypeString, "string");
+	v = in.getString();
+}
+
+void codec<std::string>::encode(const std::string& v, std::string& out) {
+	out += "<value>";
+	detail::write_element(out, "string", 6, v.data(), v.size());
+	out += "</value>";
+}
+
+void codec<struct tm>::decode(struct tm& v, const lazy_value& in) {
+	expect_type(in, value::TypeTime, "dateTime.iso8601");
+	v = in.getTime();
+}
+
+void codec<struct tm>::encode(const struct tm& v, std::string& out) {
+	char buf[scalar::time_size];
+	out += "<value>";
+	detail::write_element(out, "dateTime.iso8601", 16, buf, scalar::format_time(buf, v));
+	out += "</value>";
+}
+
+void codec<value::Binary>::decode(value::Binary& v, const lazy_value& in) {
+	expect_type(in, value::TypeBinary, "base64");
+	v = in.getBinary();
+}
+
+void codec<value::Binary>::encode(const value::Binary& v, std::string& out) {
+	std::string encoded = base64_encode((const unsigned char*)v.data(), v.size());
+	out += "<value>";
+	detail::write_element(out, "base64", 6, encoded.data(), encoded.size());
+	out += "</value>";
+}
+
+void codec<value::Struct>::decode(value::Struct& v, const lazy_value& in) {
+	expect_type(in, value::TypeStruct, "a struct");
+	std::vector<value::Struct::value_type> members;
+	size_t size = in.size();
+	members.reserve(size);
+	std::string name;
+	for(size_t n = 0; n < size; n++) {
+		lazy_value member = in.member(n, name);
+		members.push_back(value::Struct::value_type(name, member.to_value()));
+	}
+	v.assign(std::move(members));
+}
+
+void codec<value::Struct>::encode(const value::Struct& v, std::string& out) {
+	if (v.empty()) {
+		out += "<value><struct/></value>";
+		return;
+	}
+	out += "<value><struct>";
+	for(value::Struct::const_iterator it = v.begin(); it != v.end(); it++)
+		detail::write_member(out, *it, NULL);
+	out += "</struct></value>";
+}
+
+void codec<value>::decode(value& v, const lazy_value& in) {
+	v = in.to_value();
+}
+
+void codec<value>::encode(const value& v, std::string& out) {
+	detail::write_value(out, v, NULL);
+}
+
+request::request(std::string method) : _params(0) {
+	_xml = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<methodCall>";
+	detail::write_element(_xml, "methodName", 10, method.data(), method.size());
+}
+
+std::string request::str() const {
+	return _xml + (_params ? "</params></methodCall>\n" : "<params/></methodCall>\n");
+}
+
+const value call(std::string url, request& req) {
+	std::map<std::string, std::string> headers;
+	std::string response;
+	int result = post(url, "", req.str(), response, headers);
+	if (result == 0)
+		return parse(response);
+	else
+		return new value::Exception(response, result);
+}
+
+static
+unsigned char base64_value(unsigned char c) {
+	if (c >= 'A' && c <= 'Z') return c - 'A';
+	if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+	if (c >= '0' && c <= '9') return c - '0' + 52;
+	if (c == '+') return 62;
+	if (c == '/') return 63;
+	return 64;
+}
+
+static
+void base64_decode_range(const char* p, const char* e, value::Binary& ret) {
+	TINYXMLRPC_TRACE_SPAN("base64_decode");
+	unsigned int bits = 0;
+	int count = 0;
+	ret.reserve(ret.size() + (e - p) / 4 * 3);
+	for(; p < e && *p != '='; p++) {
+		unsigned char c = base64_value(*p);
+		if (c == 64) continue;
+		bits = (bits << 6) | c;
+		if (++count == 4) {
+			ret.push_back((char)(bits >> 16));
+			ret.push_back((char)(bits >> 8));
+			ret.push_back((char)bits);
+			bits = 0;
+			count = 0;
+		}
+	}
+	if (count == 2) {
+		ret.push_back((char)(bits >> 4));
+	} else if (count == 3) {
+		ret.push_back((char)(bits >> 10));
+		ret.push_back((char)(bits >> 2));
+	}
+}
+
+static
+void append_utf8(std::string& out, unsigned long c) {
+	if (c < 0x80) {
+		out += (char)c;
+	} else if (c < 0x800) {
+		out += (char)(0xc0 | (c >> 6));
+		out += (char)(0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		out += (char)(0xe0 | (c >> 12));
+		out += (char)(0x80 | ((c >> 6) & 0x3f));
+		out += (char)(0x80 | (c & 0x3f));
+	} else {
+		out += (char)(0xf0 | (c >> 18));
+		out += (char)(0x80 | ((c >> 12) & 0x3f));
+		out += (char)(0x80 | ((c >> 6) & 0x3f));
+		out += (char)(0x80 | (c & 0x3f));
+	}
+}
+
+namespace detail {
+
+/* decode character references, predefined entities and CDATA sections */
+void decode_text(const char* p, const char* e, std::string& out) {
+	out.reserve(out.size() + (e - p));
+	while (p < e) {
+		size_t run = text_span(p, e - p);
+		out.append(p, run);
+		p += run;
+		if (p == e)
+			break;
+		if (*p == '&') {
+			const char* semi = (const char*)memchr(p, ';', e - p);
+			if (!semi) { out.append(p, e); break; }
+			std::string_view name(p + 1, semi - p - 1);
+			if (name == "lt") out += '<';
+			else if (name == "gt") out += '>';
+			else if (name == "amp") out += '&';
+			else if (name == "quot") out += '"';
+			else if (name == "apos") out += '\'';
+			else if (name.size() > 1 && name[0] == '#') {
+				char digits[24];
+				std::string_view number = name.substr(name[1] == 'x' ? 2 : 1);
+				unsigned long c;
+				if (number.size() < sizeof(digits)) {
+					memcpy(digits, number.data(), number.size());
+					digits[number.size()] = 0;
+					c = strtoul(digits, NULL, name[1] == 'x' ? 16 : 10);
+				} else
+					c = strtoul(std::string(number).c_str(), NULL, name[1] == 'x' ? 16 : 10);
+				append_utf8(out, c);
+			} else
+				out.append(p, semi + 1);
+			p = semi + 1;
+		} else if (e - p >= 9 && !memcmp(p, "<![CDATA[", 9)) {
+			std::string_view rest(p + 9, e - p - 9);
+			size_t end = rest.find("]]>");
+			if (end == std::string_view::npos) {
+				out.append(rest.data(), rest.size());
+				break;
+			}
+			out.append(rest.data(), end);
+			p = rest.data() + end + 3;
+		} else
+			out += *p++;
+	}
+}
+
+class lazy_scanner {
+public:
+	lazy_scanner(lazy_document& doc_) : doc(doc_), depth(0) {
+		b = p = doc.xml.data();
+		e = b + doc.xml.size();
+	}
+
+	decode_budget budget;
+
+	void document() {
+		skip_misc();
+		read_tag();
+		bool call = false;
+		if (kind != open_tag || !(name == "methodResponse" || (call = name == "methodCall")))
+			error();
+		if (call) {
+			skip_misc();
+			expect_open("methodName");
+			doc.method_begin = (unsigned int)(p - b);
+			text();
+			doc.method_end = (unsigned int)(p - b);
+			expect_close("methodName");
+		}
+		skip_misc();
+		read_tag();
+		if (kind == open_tag && name == "fault") {
+			doc.fault = true;
+			skip_misc();
+			doc.root = parse_value();
+			skip_misc();
+			expect_close("fault");
+		} else if ((kind == open_tag || kind == empty_tag) && name == "params") {
+			unsigned int params = node(value::TypeArray);
+			doc.root = params;
+			if (kind == open_tag) {
+				unsigned int last = 0;
+				while (true) {
+					skip_misc();
+					read_tag();
+					if (kind == close_tag && name == "params") break;
+					if (kind != open_tag || name != "param") error();
+					skip_misc();
+					unsigned int child = parse_value();
+					link(params, last, child);
+					skip_misc();
+					expect_close("param");
+				}
+			}
+			if (doc.nodes[params].count == 1)
+				doc.root = params + 1;
+			else if (doc.nodes[params].count == 0)
+				doc.nodes[params].type = value::TypeInvalid;
+		} else if (call && kind == close_tag && name == "methodCall")
+			doc.root = node(value::TypeInvalid);
+		else
+			error();
+	}
+
+	void index() {
+		for(unsigned int n = 0; n < doc.nodes.size(); n++) {
+			lazy_node& self = doc.nodes[n];
+			if (self.type != value::TypeArray && self.type != value::TypeStruct)
+				continue;
+			self.first = (unsigned int)doc.children.size();
+			unsigned int child = n + 1;
+			for(unsigned int c = 0; c < self.count; c++, child = doc.nodes[child].next)
+				doc.children.push_back(child);
+		}
+	}
+
+private:
+	enum { open_tag, close_tag, empty_tag };
+
+	void error() {
+		throw value::Exception("parse error: malformed document", 4);
+	}
+
+	unsigned int node(value::Type type) {
+		lazy_node n = {0};
+		n.type = type;
+		n.begin = n.end = (unsigned int)(p - b);
+		doc.nodes.push_back(n);
+		return (unsigned int)doc.nodes.size() - 1;
+	}
+
+	void link(unsigned int parent, unsigned int& last, unsigned int child) {
+		if (last) doc.nodes[last].next = child;
+		last = child;
+		doc.nodes[parent].count++;
+	}
+
+	void skip_ws() {
+		while (p < e && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+	}
+
+	void skip_misc() {
+		while (true) {
+			skip_ws();
+			if (e - p >= 4 && !memcmp(p, "<!--", 4)) {
+				const char* q = p + 4;
+				while (q + 3 <= e && memcmp(q, "-->", 3)) q++;
+				if (q + 3 > e) error();
+				p = q + 3;
+			} else if (e - p >= 2 && !memcmp(p, "<?", 2)) {
+				const char* q = p + 2;
+				while (q + 2 <= e && memcmp(q, "?>", 2)) q++;
+				if (q + 2 > e) error();
+				p = q + 2;
+			} else
+				break;
+		}
+	}
+
+	void read_tag() {
+		if (p >= e || *p != '<') error();
+		p++;
+		kind = open_tag;
+		if (p < e && *p == '/') {
+			kind = close_tag;
+			p++;
+		}
+		const char* start = p;
+		while (p < e && *p != '>' && *p != '/' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+		name = std::string_view(start, p - start);
+		while (p < e && *p != '>') {
+			if (*p == '/') kind = empty_tag;
+			p++;
+		}
+		if (p >= e || name.empty()) error();
+		p++;
+		if (kind == close_tag)
+			depth--;
+		else if (!budget.open(kind == open_tag ? ++depth : depth + 1))
+			throw budget.breach();
+	}
+
+	void expect_open(const char* tag) {
+		read_tag();
+		if (kind != open_tag || name != tag) error();
+	}
+
+	void expect_close(const char* tag) {
+		read_tag();
+		if (kind != close_tag || name != tag) error();
+	}
+
+	/* scan character data up to the next tag; returns true if it needs decoding */
+	bool text() {
+		const char* start = p;
+		bool escaped = false;
+		while (true) {
+			const char* q = (const char*)memchr(p, '<', e - p);
+			if (!q) error();
+			if (!escaped && memchr(p, '&', q - p)) escaped = true;
+			p = q;
+			if (e - p >= 9 && !memcmp(p, "<![CDATA[", 9)) {
+				escaped = true;
+				q = p + 9;
+				while (q + 3 <= e && memcmp(q, "]]>", 3)) q++;
+				if (q + 3 > e) error();
+				p = q + 3;
+			} else {
+				if (!budget.text(p - start))
+					throw budget.breach();
+				return escaped;
+			}
+		}
+	}
+
+	void scalar(unsigned int n) {
+		unsigned int begin = (unsigned int)(p - b);
+		doc.nodes[n].escaped = text();
+		doc.nodes[n].begin = begin;
+		doc.nodes[n].end = (unsigned int)(p - b);
+	}
+
+	unsigned int parse_value() {
+		expect_open_or_empty("value");
+		unsigned int n = node(value::TypeString);
+		if (kind == empty_tag)
+			return n;
+		scalar(n);
+		read_tag();
+		if (kind == close_tag && name == "value")
+			return n;
+		if (kind == close_tag) error();
+		bool empty = kind == empty_tag;
+		std::string_view type = name;
+		lazy_node& self = doc.nodes[n];
+		self.begin = self.end = (unsigned int)(p - b);
+		self.escaped = 0;
+		if (type == "i4" || type == "int")
+			self.type = value::TypeInt;
+		else if (type == "i8")
+			self.type = value::TypeI8;
+		else if (type == "boolean")
+			self.type = value::TypeBoolean;
+		else if (type == "double")
+			self.type = value::TypeDouble;
+		else if (type == "string")
+			self.type = value::TypeString;
+		else if (type == "dateTime.iso8601")
+			self.type = value::TypeTime;
+		else if (type == "base64")
+			self.type = value::TypeBinary;
+		else if (type == "nil")
+			self.type = value::TypeInvalid;
+		else if (type == "array")
+			self.type = value::TypeArray;
+		else if (type == "struct")
+			self.type = value::TypeStruct;
+		else
+			error();
+
+		if (!empty) {
+			if (doc.nodes[n].type == value::TypeArray)
+				array(n);
+			else if (doc.nodes[n].type == value::TypeStruct)
+				members(n);
+			else {
+				scalar(n);
+				read_tag();
+				if (kind != close_tag || name != type) error();
+			}
+		}
+		skip_misc();
+		expect_close("value");
+		return n;
+	}
+
+	void expect_open_or_empty(const char* tag) {
+		read_tag();
+		if (kind == close_tag || name != tag) error();
+	}
+
+	void array(unsigned int n) {
+		skip_misc();
+		expect_open_or_empty("data");
+		if (kind == open_tag) {
+			unsigned int last = 0;
+			while (true) {
+				skip_misc();
+				if (e - p >= 2 && p[0] == '<' && p[1] == '/') break;
+				unsigned int child = parse_value();
+				link(n, last, child);
+			}
+			expect_close("data");
+		}
+		skip_misc();
+		expect_close("array");
+	}
+
+	void members(unsigned int n) {
+		unsigned int last = 0;
+		while (true) {
+			skip_misc();
+			read_tag();
+			if (kind == close_tag && name == "struct") break;
+			if (kind != open_tag || name != "member") error();
+			unsigned int name_begin = 0, name_end = 0, child = 0;
+			bool has_name = false;
+			while (true) {
+				skip_misc();
+				if (e - p >= 2 && p[0] == '<' && p[1] == '/') break;
+				if (e - p >= 6 && !memcmp(p, "<value", 6)) {
+					child = parse_value();
+					continue;
+				}
+				read_tag();
+				if (name != "name") error();
+				has_name = true;
+				name_begin = name_end = (unsigned int)(p - b);
+				if (kind == open_tag) {
+					text();
+					name_end = (unsigned int)(p - b);
+					expect_close("name");
+				}
+			}
+			expect_close("member");
+			if (!has_name || !child) error();
+			doc.nodes[child].name_begin = name_begin;
+			doc.nodes[child].name_end = name_end;
+			link(n, last, child);
+		}
+	}
+
+	lazy_document& doc;
+	const char* b;
+	const char* p;
+	const char* e;
+	int kind;
+	int depth;
+	std::string_view name;
+};
+
+}
+
+lazy_value parse_lazy(std::string strXml) {
+	TINYXMLRPC_TRACE_SPAN("parse_lazy");
+	std::shared_ptr<detail::lazy_document> doc(new detail::lazy_document);
+	doc->xml.swap(strXml);
+	doc->root = 0;
+	doc->method_begin = doc->method_end = 0;
+	doc->fault = false;
+	detail::lazy_scanner scanner(*doc);
+	try {
+		if (doc->xml.size() >= 0xffffffffUL)
+			throw value::Exception("parse error: document too large", 4);
+		scanner.document();
+		scanner.index();
+	} catch(value::Exception&) {
+		if (scanner.budget.code)
+			throw;
+		detail::lazy_node n = {0};
+		n.type = value::TypeString;
+		n.end = (unsigned int)std::min(doc->xml.size(), (size_t)0xffffffffUL);
+		doc->nodes.assign(1, n);
+		doc->root = 0;
+		doc->fault = false;
+	}
+	return lazy_value(doc, doc->root);
+}
+
+bool failed(const lazy_value& res) {
+	return res.fault();
+}
+
+namespace detail {
+
+/* the first param of a response, for the typed binding; faults and
+ * malformed documents are thrown */
+lazy_value response_param(std::string strXml) {
+	TINYXMLRPC_TRACE_SPAN("parse_lazy");
+	std::shared_ptr<lazy_document> doc(new lazy_document);
+	doc->xml.swap(strXml);
+	doc->root = 0;
+	doc->method_begin = doc->method_end = 0;
+	doc->fault = false;
+	lazy_scanner scanner(*doc);
+	try {
+		if (doc->xml.size() >= 0xffffffffUL)
+			throw value::Exception("parse error: document too large", 4);
+		scanner.document();
+		scanner.index();
+	} catch(value::Exception&) {
+		if (scanner.budget.code)
+			throw;
+		throw value::Exception("parse error: malformed response", 4);
+	}
+	if (doc->fault) {
+		value fault = lazy_value(doc, doc->root).to_value();
+		const value* faultString = fault.find("faultString");
+		const value* faultCode = fault.find("faultCode");
+		if (faultString && faultCode)
+			throw value::Exception(faultString->to_str(), fault_code(*faultCode));
+		throw value::Exception("fault", 0);
+	}
+	/* node 0 is <params>, its first param follows it */
+	if (doc->nodes.empty() || doc->nodes[0].count == 0)
+		throw value::Exception("range error: no such param", 4);
+	return lazy_value(doc, 1);
+}
+
+}
+
+bool parse_call(std::string strXml, std::string& method, value::Array& params) {
+	TINYXMLRPC_TRACE_SPAN("parse_call");
+	std::shared_ptr<detail::lazy_document> doc(new detail::lazy_document);
+	doc->xml.swap(strXml);
+	doc->root = 0;
+	doc->method_begin = doc->method_end = 0;
+	doc->fault = false;
+	detail::lazy_scanner scanner(*doc);
+	try {
+		if (doc->xml.size() >= 0xffffffffUL)
+			return false;
+		scanner.document();
+	} catch(value::Exception&) {
+		if (scanner.budget.code)
+			throw;
+		return false;
+	}
+	if (doc->method_end == 0 || doc->nodes.empty())
+		return false;
+	method.clear();
+	detail::decode_text(doc->xml.data() + doc->method_begin, doc->xml.data() + doc->method_end, method);
+	params.clear();
+	params.reserve(doc->nodes[0].count);
+	unsigned int child = 1;
+	for(unsigned int n = 0; n < doc->nodes[0].count; n++, child = doc->nodes[child].next)
+		params.push_back(lazy_value(doc, child).to_value());
+	return true;
+}
+
+std::string_view lazy_value::raw() const {
+	if (!_doc) return std::string_view();
+	const detail::lazy_node& n = _doc->nodes[_node];
+	return std::string_view(_doc->xml.data() + n.begin, n.end - n.begin);
+}
+
+bool lazy_value::getBoolean() const {
+	bool b = false;
+	scalar::check(scalar::parse_boolean(raw(), b), raw(), "boolean");
+	return b;
+}
+
+int lazy_value::getInt() const {
+	int i = 0;
+	scalar::check(scalar::parse_int(raw(), i), raw(), "int");
+	return i;
+}
+
+long long lazy_value::getI8() const {
+	long long i8 = 0;
+	scalar::check(scalar::parse_i8(raw(), i8), raw(), "i8");
+	return i8;
+}
+
+double lazy_value::getDouble() const {
+	double d = 0.0;
+	scalar::check(scalar::parse_double(raw(), d), raw(), "double");
+	return d;
+}
+
+struct tm lazy_value::getTime() const {
+	struct tm tmTime = {0};
+	scalar::check(scalar::parse_time(raw(), tmTime), raw(), "dateTime.iso8601");
+	return tmTime;
+}
+
+std::string lazy_value::getString() const {
+	std::string_view s = raw();
+	if (!_doc || !_doc->nodes[_node].escaped)
+		return std::string(s);
+	std::string ret;
+	detail::decode_text(s.data(), s.data() + s.size(), ret);
+	return ret;
+}
+
+value::Binary lazy_value::getBinary() const {
+	value::Binary ret;
+	std::string_view s = raw();
+	base64_decode_range(s.data(), s.data() + s.size(), ret);
+	return ret;
+}
+
+size_t lazy_value::size() const {
+	switch (getType()) {
+	case value::TypeArray:
+	case value::TypeStruct:
+		return _doc->nodes[_node].count;
+	case value::TypeString:
+		return getString().size();
+	case value::TypeBinary:
+		return getBinary().size();
+	default:
+		return 0;
+	}
+}
+
+lazy_value lazy_value::operator[](int i) const {
+	if (getType() != value::TypeArray)
+		throw value::Exception("type error: expected an array", 4);
+	if (i < 0 || (unsigned int)i >= _doc->nodes[_node].count)
+		throw value::Exception("range error: array index too large", 4);
+	return lazy_value(_doc, _doc->children[_doc->nodes[_node].first + i]);
+}
+
+lazy_value lazy_value::operator[](const std::string& name) const {
+	if (getType() != value::TypeStruct)
+		throw value::Exception("type error: expected a struct", 4);
+	const detail::lazy_node& self = _doc->nodes[_node];
+	unsigned int child = _node + 1;
+	for(unsigned int n = 0; n < self.count; n++, child = _doc->nodes[child].next) {
+		const detail::lazy_node& member = _doc->nodes[child];
+		std::string_view member_name(_doc->xml.data() + member.name_begin, member.name_end - member.name_begin);
+		if (member_name == name)
+			return lazy_value(_doc, child);
+		if (member_name.find('&') != std::string_view::npos || member_name.find('<') != std::string_view::npos) {
+			std::string decoded;
+			detail::decode_text(member_name.data(), member_name.data() + member_name.size(), decoded);
+			if (decoded == name)
+				return lazy_value(_doc, child);
+		}
+	}
+	return lazy_value();
+}
+
+lazy_value lazy_value::member(size_t n, std::string& name) const {
+	if (getType() != value::TypeStruct)
+		throw value::Exception("type error: expected a struct", 4);
+	if (n >= _doc->nodes[_node].count)
+		throw value::Exception("range error: struct index too large", 4);
+	unsigned int child = _doc->children[_doc->nodes[_node].first + n];
+	const detail::lazy_node& m = _doc->nodes[child];
+	name.clear();
+	detail::decode_text(_doc->xml.data() + m.name_begin, _doc->xml.data() + m.name_end, name);
+	return lazy_value(_doc, child);
+}
+
+bool lazy_value::hasMember(const std::string& name) const {
+	return getType() == value::TypeStruct && (*this)[name].getType() != value::TypeInvalid;
+}
+
+std::vector<std::string> lazy_value::listMembers() const {
+	std::vector<std::string> ret;
+	if (getType() != value::TypeStruct)
+		return ret;
+	unsigned int child = _node + 1;
+	for(unsigned int n = 0; n < _doc->nodes[_node].count; n++, child = _doc->nodes[child].next) {
+		const detail::lazy_node& member = _doc->nodes[child];
+		std::string name;
+		detail::decode_text(_doc->xml.data() + member.name_begin, _doc->xml.data() + member.name_end, name);
+		ret.push_back(name);
+	}
+	return ret;
+}
+
+value lazy_value::to_value() const {
+	value ret;
+	switch (getType()) {
+	case value::TypeBoolean: ret = getBoolean(); break;
+	case value::TypeInt: ret = getInt(); break;
+	case value::TypeI8: ret = getI8(); break;
+	case value::TypeDouble: ret = getDouble(); break;
+	case value::TypeString: ret = getString(); break;
+	case value::TypeTime: ret = value(getTime()); break;
+	case value::TypeBinary:
+		{
+			ret = getBinary();
+			break;
+		}
+	case value::TypeArray:
+		{
+			value::Array valuearray;
+			valuearray.reserve(_doc->nodes[_node].count);
+			unsigned int child = _node + 1;
+			for(unsigned int n = 0; n < _doc->nodes[_node].count; n++, child = _doc->nodes[child].next)
+				valuearray.push_back(lazy_value(_doc, child).to_value());
+			ret = std::move(valuearray);
+			break;
+		}
+	case value::TypeStruct:
+		{
+			std::vector<value::Struct::value_type> members;
+			members.reserve(_doc->nodes[_node].count);
+			unsigned int child = _node + 1;
+			for(unsigned int n = 0; n < _doc->nodes[_node].count; n++, child = _doc->nodes[child].next) {
+				const detail::lazy_node& member = _doc->nodes[child];
+				std::string name;
+				detail::decode_text(_doc->xml.data() + member.name_begin, _doc->xml.data() + member.name_end, name);
+				members.push_back(value::Struct::value_type(name, lazy_value(_doc, child).to_value()));
+			}
+			value::Struct valuestruct;
+			valuestruct.assign(std::move(members));
+			ret = std::move(valuestruct);
+			break;
+		}
+	default:
+		break;
+	}
+	return ret;
+}
+
+/*
+ * Capture files start with capture_magic and a version byte, followed by
+ * records of a fixed little-endian header (source, timestamp, duration in
+ * ns, result and the three string lengths, 8 bytes each) and the strings
+ * themselves. A reader only accepts its own version.
+ */
+static const char capture_magic[8] = { 'T', 'X', 'R', 'C', 'A', 'P', '1', '\n' };
+static const unsigned char capture_version = 2;
+static std::mutex capture_lock;
+static FILE* capture_fp = NULL;
+static std::atomic<bool> capture_active(false);
+
+static
+void put_le(unsigned char* p, unsigned long long v, int size) {
+	for(int n = 0; n < size; n++, v >>= 8)
+		p[n] = (unsigned char)v;
+}
+
+static
+unsigned long long get_le(const unsigned char* p, int size) {
+	unsigned long long v = 0;
+	for(int n = size - 1; n >= 0; n--)
+		v = (v << 8) | p[n];
+	return v;
+}
+
+enum { capture_header_size = 1 + 8 + 8 + 4 + 8 + 8 + 8 };
+
+static
+bool read_file_header(FILE* fp) {
+	char magic[sizeof(capture_magic) + 1];
+	return fread(magic, sizeof(magic), 1, fp) == 1 && !memcmp(magic, capture_magic, sizeof(capture_magic)) &&
+		(unsigned char)magic[sizeof(capture_magic)] == capture_version;
+}
+
+/* appending to a file of another version would leave it unreadable, so
+ * that fails instead */
+bool capture_start(std::string filename) {
+	std::lock_guard<std::mutex> guard(capture_lock);
+	if (capture_fp) fclose(capture_fp);
+	capture_fp = fopen(filename.c_str(), "a+b");
+	if (capture_fp && fseek(capture_fp, 0, SEEK_END) == 0 && ftell(capture_fp) == 0) {
+		fwrite(capture_magic, sizeof(capture_magic), 1, capture_fp);
+		fwrite(&capture_version, 1, 1, capture_fp);
+	} else if (capture_fp) {
+		/* a read has to be followed by a seek before the next write */
+		rewind(capture_fp);
+		if (!read_file_header(capture_fp) || fseek(capture_fp, 0, SEEK_END) != 0) {
+			fclose(capture_fp);
+			capture_fp = NULL;
+		}
+	}
+	capture_active = capture_fp != NULL;
+	return capture_active;
+}
+
+void capture_stop() {
+	std::lock_guard<std::mutex> guard(capture_lock);
+	capture_active = false;
+	if (capture_fp) fclose(capture_fp);
+	capture_fp = NULL;
+}
+
+bool capturing() {
+	return capture_active;
+}
+
+void capture_write(const capture_record& record) {
+	unsigned char header[capture_header_size];
+	header[0] = (unsigned char)record.source;
+	put_le(header + 1, record.timestamp_ns, 8);
+	put_le(header + 9, (unsigned long long)(record.duration * 1e9), 8);
+	put_le(header + 17, (unsigned int)record.result, 4);
+	put_le(header + 21, record.method.size(), 8);
+	put_le(header + 29, record.request.size(), 8);
+	put_le(header + 37, record.response.size(), 8);
+	std::lock_guard<std::mutex> guard(capture_lock);
+	if (!capture_fp) return;
+	fwrite(header, sizeof(header), 1, capture_fp);
+	fwrite(record.method.data(), 1, record.method.size(), capture_fp);
+	fwrite(record.request.data(), 1, record.request.size(), capture_fp);
+	fwrite(record.response.data(), 1, record.response.size(), capture_fp);
+	fflush(capture_fp);
+}
+
+capture_reader::capture_reader(std::string filename) : _left(0) {
+	_fp = fopen(filename.c_str(), "rb");
+	if (_fp && !read_file_header(_fp)) {
+		fclose(_fp);
+		_fp = NULL;
+	}
+	if (_fp) {
+		long start = ftell(_fp);
+		if (fseek(_fp, 0, SEEK_END) == 0)
+			_left = ftell(_fp) - start;
+		fseek(_fp, start, SEEK_SET);
+	}
+}
+
+capture_reader::~capture_reader() {
+	if (_fp) fclose(_fp);
+}
+
+/* a length past the end of the file is a torn or corrupt record, not an
+ * allocation to attempt */
+static
+bool read_string(FILE* fp, std::string& s, unsigned long long size, unsigned long long& left) {
+	if (size > left)
+		return false;
+	left -= size;
+	s.resize(size);
+	return size == 0 || fread(&s[0], size, 1, fp) == 1;
+}
+
+bool capture_reader::next(capture_record& record) {
+	unsigned char header[capture_header_size];
+	if (!_fp || _left < sizeof(header) || fread(header, sizeof(header), 1, _fp) != 1)
+		return false;
+	_left -= sizeof(header);
+	record.source = (char)header[0];
+	record.timestamp_ns = get_le(header + 1, 8);
+	record.duration = get_le(header + 9, 8) / 1e9;
+	record.result = (int)(unsigned int)get_le(header + 17, 4);
+	return read_string(_fp, record.method, get_le(header + 21, 8), _left) &&
+		read_string(_fp, record.request, get_le(header + 29, 8), _left) &&
+		read_string(_fp, record.response, get_le(header + 37, 8), _left);
+}
+
+#ifdef TINYXMLRPC_TRACE
+namespace trace {
+
+/* each slot carries the sequence number of the span in it, 0 while it
+ * is being written, so chrome_json() can skip slots overwritten under it */
+struct event {
+	std::atomic<unsigned long> seq;
+	std::atomic<const char*> name;
+	std::atomic<unsigned long long> begin;
+	std::atomic<unsigned long long> end;
+	std::atomic<int> tid;
+};
+
+/* only the owning thread writes head; clear() moves floor instead */
+struct ring {
+	event events[ring_size];
+	std::atomic<unsigned long> head;
+	std::atomic<unsigned long> floor;
+	int tid;
+};
+
+static std::mutex rings_lock;
+static std::vector<ring*> rings;
+static std::vector<ring*> free_rings;
+static int next_tid = 1;
+
+/* rings outlive their threads so their spans can still be dumped; a
+ * finished thread's ring is handed to the next new thread under a new
+ * tid, and each span keeps the tid it was recorded with */
+struct ring_holder {
+	ring* r;
+	ring_holder() {
+		std::lock_guard<std::mutex> guard(rings_lock);
+		if (!free_rings.empty()) {
+			r = free_rings.back();
+			free_rings.pop_back();
+		} else {
+			r = new ring;
+			r->head = 0;
+			r->floor = 0;
+			for(int n = 0; n < ring_size; n++)
+				r->events[n].seq = 0;
+			rings.push_back(r);
+		}
+		r->tid = next_tid++;
+	}
+	~ring_holder() {
+		std::lock_guard<std::mutex> guard(rings_lock);
+		free_rings.push_back(r);
+	}
+};
+
+static
+unsigned long long now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+span::span(const char* name) : _name(name) {
+	TRACE_PROBE2(span_begin, name, 0);
+	_begin = now_ns();
+}
+
+span::~span() {
+	static thread_local ring_holder holder;
+	unsigned long long end = now_ns();
+	ring* r = holder.r;
+	unsigned long head = r->head.load(std::memory_order_relaxed);
+	event& e = r->events[head % ring_size];
+	e.seq.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	e.name.store(_name, std::memory_order_relaxed);
+	e.begin.store(_begin, std::memory_order_relaxed);
+	e.end.store(end, std::memory_order_relaxed);
+	e.tid.store(r->tid, std::memory_order_relaxed);
+	e.seq.store(head + 1, std::memory_order_release);
+	r->head.store(head + 1, std::memory_order_release);
+	TRACE_PROBE2(span_end, _name, end - _begin);
+}
+
+std::string chrome_json() {
+	std::string out = "{\"traceEvents\":[";
+	char buf[128];
+	bool first = true;
+	std::lock_guard<std::mutex> guard(rings_lock);
+	for(size_t n = 0; n < rings.size(); n++) {
+		ring* r = rings[n];
+		unsigned long head = r->head.load(std::memory_order_acquire);
+		unsigned long tail = std::max(head > ring_size ? head - ring_size : 0, r->floor.load());
+		for(unsigned long i = tail; i < head; i++) {
+			const event& e = r->events[i % ring_size];
+			if (e.seq.load(std::memory_order_acquire) != i + 1)
+				continue;
+			const char* name = e.name.load(std::memory_order_relaxed);
+			unsigned long long begin = e.begin.load(std::memory_order_relaxed);
+			unsigned long long end = e.end.load(std::memory_order_relaxed);
+			int tid = e.tid.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (e.seq.load(std::memory_order_relaxed) != i + 1)
+				continue;
+			if (!first) out += ",";
+			first = false;
+			out += "{\"name\":\"";
+			out += name;
+			snprintf(buf, sizeof(buf), "\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+				begin / 1e3, (end - begin) / 1e3, tid);
+			out += buf;
+		}
+	}
+	out += "],\"displayTimeUnit\":\"ns\"}\n";
+	return out;
+}
+
+void clear() {
+	std::lock_guard<std::mutex> guard(rings_lock);
+	for(size_t n = 0; n < rings.size(); n++)
+		rings[n]->floor = rings[n]->head.load();
+}
+
+}
+#endif
+
 }
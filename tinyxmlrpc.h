@@ -26,64 +26,377 @@
 #include <vector>
 #include <map>
 #include <string>
+#include <string_view>
+#include <charconv>
+#include <memory>
+#include <atomic>
+#include <utility>
+#include <functional>
 #include <ostream>
 #include <algorithm>
 #include <stdio.h>
+#include <string.h>
 
 namespace tinyxmlrpc {
 
+/*
+ * Interned struct member name. Equal names share one entry in a process
+ * wide symbol table, so structs with the same field names do not each
+ * own a copy of the keys and comparing two symbols is a pointer compare.
+ * Names arrive off the wire, so the table is bounded: once it holds
+ * max_interned names, or for names longer than max_interned_size, the
+ * symbol owns a reference counted entry of its own and compares by text.
+ */
+class symbol {
+public:
+	enum { max_interned = 1 << 16, max_interned_size = 256 };
+	struct entry {
+		std::string str;
+		unsigned int hash;
+		bool interned;
+		std::atomic<unsigned int> refs;
+	};
+	symbol() : _entry(0) {}
+	symbol(const std::string& s) : _entry(intern(s.data(), s.size())) {}
+	symbol(const char* s) : _entry(intern(s, strlen(s))) {}
+	symbol(const char* s, size_t len) : _entry(intern(s, len)) {}
+	symbol(const symbol& other) : _entry(other._entry) { retain(); }
+	symbol(symbol&& other) noexcept : _entry(other._entry) { other._entry = 0; }
+	~symbol() { release(); }
+	symbol& operator=(const symbol& other) {
+		if (_entry != other._entry) {
+			release();
+			_entry = other._entry;
+			retain();
+		}
+		return *this;
+	}
+	symbol& operator=(symbol&& other) noexcept {
+		std::swap(_entry, other._entry);
+		return *this;
+	}
+
+	const std::string& str() const { return _entry ? _entry->str : empty(); }
+	const char* c_str() const { return str().c_str(); }
+	size_t size() const { return str().size(); }
+	unsigned int hash() const { return _entry ? _entry->hash : hash("", 0); }
+	operator const std::string&() const { return str(); }
+
+	bool operator==(const symbol& other) const {
+		return _entry == other._entry || (_entry && other._entry &&
+			!(_entry->interned && other._entry->interned) && _entry->str == other._entry->str);
+	}
+	bool operator!=(const symbol& other) const { return !(*this == other); }
+	bool operator==(const std::string& other) const { return str() == other; }
+	bool operator!=(const std::string& other) const { return str() != other; }
+	bool operator==(const char* other) const { return str() == other; }
+	bool operator!=(const char* other) const { return str() != other; }
+	bool operator<(const symbol& other) const { return str() < other.str(); }
+
+	static unsigned int hash(const char* s, size_t len) {
+		unsigned int h = 2166136261u;
+		while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+		return h;
+	}
+
+private:
+	void retain() {
+		if (_entry && !_entry->interned)
+			_entry->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+	void release() {
+		if (_entry && !_entry->interned && _entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete _entry;
+	}
+	static entry* intern(const char* s, size_t len);
+	static const std::string& empty();
+	entry* _entry;
+};
+
+std::ostream& operator<<(std::ostream& os, const symbol& name);
+
+/*
+ * Struct storage: members live in one vector sorted by name, bytewise as
+ * std::map<std::string, value> kept them, so iteration, to_str() and the
+ * serialized member order are unchanged. Small structs are searched
+ * linearly by hash; once a struct grows past index_threshold members an
+ * open addressing index is kept alongside. Decoders collect members in
+ * wire order and hand them to assign(), which sorts once.
+ */
+template<class V>
+class basic_struct {
+public:
+	typedef symbol key_type;
+	typedef V mapped_type;
+	typedef std::pair<symbol, V> value_type;
+	typedef typename std::vector<value_type>::iterator iterator;
+	typedef typename std::vector<value_type>::const_iterator const_iterator;
+	enum { index_threshold = 16 };
+
+	iterator begin() { return _items.begin(); }
+	iterator end() { return _items.end(); }
+	const_iterator begin() const { return _items.begin(); }
+	const_iterator end() const { return _items.end(); }
+	size_t size() const { return _items.size(); }
+	bool empty() const { return _items.empty(); }
+	void clear() { _items.clear(); _index.clear(); }
+	void reserve(size_t n) { _items.reserve(n); }
+
+	const_iterator find(const char* name, size_t len) const {
+		return _items.begin() + lookup(name, len, symbol::hash(name, len));
+	}
+	const_iterator find(const std::string& name) const { return find(name.data(), name.size()); }
+	const_iterator find(const char* name) const { return find(name, strlen(name)); }
+	const_iterator find(const symbol& name) const {
+		return _items.begin() + lookup(name.c_str(), name.size(), name.hash());
+	}
+	iterator find(const char* name, size_t len) {
+		return _items.begin() + lookup(name, len, symbol::hash(name, len));
+	}
+	iterator find(const std::string& name) { return find(name.data(), name.size()); }
+	iterator find(const char* name) { return find(name, strlen(name)); }
+	iterator find(const symbol& name) {
+		return _items.begin() + lookup(name.c_str(), name.size(), name.hash());
+	}
+	size_t count(const std::string& name) const { return find(name) != end() ? 1 : 0; }
+
+	V& operator[](const symbol& name) {
+		size_t n = lookup(name.c_str(), name.size(), name.hash());
+		if (n == _items.size())
+			n = append(name);
+		return _items[n].second;
+	}
+	V& operator[](const std::string& name) {
+		size_t n = lookup(name.data(), name.size(), symbol::hash(name.data(), name.size()));
+		if (n == _items.size())
+			n = append(symbol(name));
+		return _items[n].second;
+	}
+	V& operator[](const char* name) {
+		size_t len = strlen(name);
+		size_t n = lookup(name, len, symbol::hash(name, len));
+		if (n == _items.size())
+			n = append(symbol(name, len));
+		return _items[n].second;
+	}
+
+	std::pair<iterator, bool> insert(const value_type& item) {
+		size_t n = lookup(item.first.c_str(), item.first.size(), item.first.hash());
+		if (n != _items.size())
+			return std::make_pair(_items.begin() + n, false);
+		n = append(item.first);
+		_items[n].second = item.second;
+		return std::make_pair(_items.begin() + n, true);
+	}
+	iterator erase(iterator it) {
+		size_t n = it - _items.begin();
+		_items.erase(it);
+		reindex();
+		return _items.begin() + n;
+	}
+	size_t erase(const std::string& name) {
+		iterator it = find(name);
+		if (it == end()) return 0;
+		erase(it);
+		return 1;
+	}
+
+	/* members in any order; of a repeated name the last one wins, as
+	 * with operator[] */
+	void assign(std::vector<value_type>&& items) {
+		std::stable_sort(items.begin(), items.end(), [](const value_type& a, const value_type& b) {
+			return before(a.first, b.first.c_str(), b.first.size());
+		});
+		_items.clear();
+		_items.reserve(items.size());
+		for (size_t n = 0; n < items.size(); n++) {
+			if (n + 1 < items.size() && !before(items[n].first, items[n + 1].first.c_str(), items[n + 1].first.size()))
+				continue;
+			_items.push_back(std::move(items[n]));
+		}
+		items.clear();
+		reindex();
+	}
+
+	bool operator==(const basic_struct& other) const {
+		if (size() != other.size())
+			return false;
+		for (const_iterator it = begin(); it != end(); it++) {
+			const_iterator it2 = other.find(it->first);
+			if (it2 == other.end() || !(it->second == it2->second))
+				return false;
+		}
+		return true;
+	}
+	bool operator!=(const basic_struct& other) const { return !(*this == other); }
+
+private:
+	bool matches(size_t n, const char* name, size_t len, unsigned int hash) const {
+		const symbol& key = _items[n].first;
+		return key.hash() == hash && key.size() == len && !memcmp(key.c_str(), name, len);
+	}
+	size_t lookup(const char* name, size_t len, unsigned int hash) const {
+		if (_index.empty()) {
+			for (size_t n = 0; n < _items.size(); n++)
+				if (matches(n, name, len, hash)) return n;
+			return _items.size();
+		}
+		size_t mask = _index.size() - 1;
+		for (size_t slot = hash & mask; _index[slot]; slot = (slot + 1) & mask)
+			if (matches(_index[slot] - 1, name, len, hash)) return _index[slot] - 1;
+		return _items.size();
+	}
+	static bool before(const symbol& key, const char* name, size_t len) {
+		int c = memcmp(key.c_str(), name, std::min(key.size(), len));
+		return c < 0 || (c == 0 && key.size() < len);
+	}
+	size_t append(const symbol& name) {
+		size_t lo = 0, hi = _items.size();
+		if (hi && before(_items[hi - 1].first, name.c_str(), name.size()))
+			lo = hi;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (before(_items[mid].first, name.c_str(), name.size()))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < _items.size()) {
+			_items.insert(_items.begin() + lo, value_type(name, V()));
+			reindex();
+			return lo;
+		}
+		_items.push_back(value_type(name, V()));
+		if (_items.size() > index_threshold) {
+			if (_index.size() < _items.size() * 2)
+				reindex();
+			else
+				place(_items.size() - 1);
+		}
+		return _items.size() - 1;
+	}
+	void place(size_t n) {
+		size_t mask = _index.size() - 1;
+		size_t slot = _items[n].first.hash() & mask;
+		while (_index[slot]) slot = (slot + 1) & mask;
+		_index[slot] = (unsigned int)n + 1;
+	}
+	void reindex() {
+		_index.clear();
+		if (_items.size() <= index_threshold)
+			return;
+		size_t capacity = 16;
+		while (capacity < _items.size() * 4) capacity *= 2;
+		_index.assign(capacity, 0);
+		for (size_t n = 0; n < _items.size(); n++)
+			place(n);
+	}
+
+	std::vector<value_type> _items;
+	std::vector<unsigned int> _index;
+};
+
+/*
+ * Scalar codec for i4, i8, double, boolean and dateTime.iso8601 text.
+ * Nothing here allocates: format_* write into a caller supplied buffer of
+ * at least *_size bytes, NUL terminate it and return the length; parse_*
+ * accept surrounding whitespace and return false on malformed input;
+ * parse_int also rejects values outside the int range, leaving v as is.
+ * Doubles are written in fixed notation (XML-RPC has no exponent form),
+ * with the fewest digits that read back to the same value; format_double
+ * throws a type error for infinities and NaN, which the wire cannot
+ * carry. Times are written as YYYYMMDDTHH:MM:SS; parse_time also accepts
+ * the dashed ISO 8601 form and the YYYY/MM/DD HH:MM:SS form older
+ * versions of this library sent. As elsewhere in this library tm_mon
+ * holds the month as written (1-12).
+ */
+namespace scalar {
+	enum { int_size = 12, i8_size = 21, double_size = 330, time_size = 32 };
+	size_t format_int(char* buf, int v);
+	size_t format_i8(char* buf, long long v);
+	size_t format_double(char* buf, double v);
+	size_t format_time(char* buf, const struct tm& t);
+	bool parse_int(std::string_view text, int& v);
+	bool parse_i8(std::string_view text, long long& v);
+	bool parse_double(std::string_view text, double& v);
+	bool parse_boolean(std::string_view text, bool& v);
+	bool parse_time(std::string_view text, struct tm& t);
+}
+
 class value {
 public:
 	typedef std::vector<char> Binary;
 	typedef std::vector<value> Array;
-	typedef std::map<std::string, value> Struct;
+	typedef basic_struct<value> Struct;
 	class Exception {
 	public:
 		std::string message;
 		int code;
-		Exception(std::string message_, int code_) {
-			message = message_;
-			code = code_;
-		}
+		Exception(std::string message_, int code_) : message(std::move(message_)), code(code_) {}
 		std::string to_xml();
 	};
 	enum Type {
 	  TypeInvalid, TypeBoolean, TypeInt, TypeDouble, TypeTime,
 	  TypeString, TypeBinary, TypeList, TypeArray, TypeStruct,
-	  TypeException
+	  TypeException, TypeI8
 	};
 protected:
+	/* string and container payloads are shared between copies and
+	   cloned on the first mutation (see unshare) */
+	template<class T> struct shared {
+		std::atomic<long> refs;
+		T data;
+		shared(const T& data_) : refs(1), data(data_) {}
+		shared(T&& data_) : refs(1), data(std::move(data_)) {}
+	};
 	typedef union {
-		bool			asBool;
-		int				asInt;
-		double			asDouble;
-		struct tm*		asTime;
-		std::string*	asString;
-		Binary*			asBinary;
-		Array*			asArray;
-		Struct*			asStruct;
-		Exception*		asException;
+		bool					asBool;
+		int						asInt;
+		long long				asI8;
+		double					asDouble;
+		struct tm*				asTime;
+		shared<std::string>*	asString;
+		shared<Binary>*			asBinary;
+		shared<Array>*			asArray;
+		shared<Struct>*			asStruct;
+		Exception*				asException;
 	} Value;
+	template<class T> static T* retain(T* p) {
+		p->refs.fetch_add(1, std::memory_order_relaxed);
+		return p;
+	}
+	template<class T> static void release(shared<T>* p) {
+		if (p->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete p;
+	}
+	template<class T> static T& unshare(shared<T>*& p) {
+		if (p->refs.load(std::memory_order_acquire) != 1) {
+			shared<T>* copy = new shared<T>(p->data);
+			release(p);
+			p = copy;
+		}
+		return p->data;
+	}
 public:
 	Type _type;
 	Value _value;
 	char* operator=(char* x) {
 		invalidate();
-		_value.asString = new std::string(x);
+		_value.asString = new shared<std::string>(std::string(x));
 		_type = TypeString;
-		return (char*)_value.asString;
+		return x;
 	}
 	const char* operator=(const char* x) {
 		invalidate();
-		_value.asString = new std::string(x);
+		_value.asString = new shared<std::string>(std::string(x));
 		_type = TypeString;
-		return (char*)_value.asString;
+		return x;
 	}
 	std::string operator=(std::string x) {
 		invalidate();
-		_value.asString = new std::string(x);
+		_value.asString = new shared<std::string>(x);
 		_type = TypeString;
-		return (char*)_value.asString;
+		return x;
 	}
 	bool operator=(bool x) {
 		invalidate();
@@ -97,6 +410,12 @@ public:
 		_type = TypeInt;
 		return _value.asInt;
 	}
+	long long operator=(long long x) {
+		invalidate();
+		_value.asI8 = x;
+		_type = TypeI8;
+		return _value.asI8;
+	}
 	double operator=(double x) {
 		invalidate();
 		_value.asDouble = x;
@@ -109,20 +428,16 @@ public:
 		_type = TypeException;
 		return _value.asException;
 	}
-	value() {
-		_type = TypeInvalid;
-	}
+	value() : _type(TypeInvalid), _value() {}
 	~value() {
 		invalidate();
 	}
 	value(const char* _string) {
-		_value.asString = new std::string();
-		*_value.asString = _string;
+		_value.asString = new shared<std::string>(std::string(_string));
 		_type = TypeString;
 	}
 	value(std::string _string) {
-		_value.asString = new std::string();
-		*_value.asString = _string;
+		_value.asString = new shared<std::string>(std::move(_string));
 		_type = TypeString;
 	}
 	value(bool _bool) {
@@ -137,6 +452,10 @@ public:
 		_value.asInt = _long;
 		_type = TypeInt;
 	}
+	value(long long _i8) {
+		_value.asI8 = _i8;
+		_type = TypeI8;
+	}
 	value(double _double) {
 		_value.asDouble = _double;
 		_type = TypeDouble;
@@ -145,8 +464,12 @@ public:
 		_value.asTime = new struct tm(_tm);
 		_type = TypeTime;
 	}
-	value(Binary& _binary) {
-		_value.asBinary = new Binary(_binary);
+	value(const Binary& _binary) {
+		_value.asBinary = new shared<Binary>(_binary);
+		_type = TypeBinary;
+	}
+	value(Binary&& _binary) {
+		_value.asBinary = new shared<Binary>(std::move(_binary));
 		_type = TypeBinary;
 	}
 	value(Exception* _exception) {
@@ -160,7 +483,10 @@ public:
 		return _value.asBool;
 	}
 	int getInt() const {
-		return _value.asInt;
+		return _type == TypeI8 ? (int)_value.asI8 : _value.asInt;
+	}
+	long long getI8() const {
+		return _type == TypeI8 ? _value.asI8 : _value.asInt;
 	}
 	double getDouble() const {
 		return _value.asDouble;
@@ -168,20 +494,49 @@ public:
 	struct tm* getTime() const {
 		return _value.asTime;
 	}
-	std::string getString() const {
-		return *(_value.asString);
+	const std::string& getString() const {
+		return _value.asString->data;
 	}
-	Binary getBinary() const {
-		return *(_value.asBinary);
+	std::string_view getStringView() const {
+		return _type == TypeString ? std::string_view(_value.asString->data) : std::string_view();
+	}
+	const Binary& getBinary() const {
+		return _value.asBinary->data;
+	}
+	std::string_view getBinaryView() const {
+		if (_type != TypeBinary || _value.asBinary->data.empty())
+			return std::string_view();
+		return std::string_view(&_value.asBinary->data.front(), _value.asBinary->data.size());
+	}
+	const Array& getArray() const {
+		if (_type != TypeArray)
+		  throw Exception("type error: expected an array", 4);
+		return _value.asArray->data;
+	}
+	const Struct& getStruct() const {
+		if (_type != TypeStruct)
+		  throw Exception("type error: expected a struct", 4);
+		return _value.asStruct->data;
+	}
+	const value* find(const std::string& name) const {
+		if (_type != TypeStruct) return 0;
+		Struct::const_iterator it = _value.asStruct->data.find(name);
+		return it != _value.asStruct->data.end() ? &it->second : 0;
+	}
+	value* find(const std::string& name) {
+		if (_type != TypeStruct) return 0;
+		Struct& members = unshare(_value.asStruct);
+		Struct::iterator it = members.find(name);
+		return it != members.end() ? &it->second : 0;
 	}
 	bool hasMember(const std::string& name) const {
-		return _type == TypeStruct && _value.asStruct->find(name) != _value.asStruct->end();
+		return find(name) != 0;
 	}
 	std::vector<std::string> listMembers() const {
 		std::vector<std::string> ret;
 		Struct::const_iterator it;
 		if (_type == TypeStruct) {
-			for(it = _value.asStruct->begin(); it != _value.asStruct->end(); it++)
+			for(it = _value.asStruct->data.begin(); it != _value.asStruct->data.end(); it++)
 				ret.push_back(it->first);
 		}
 		return ret;
@@ -192,13 +547,13 @@ public:
 	size_t size() const {
 		switch(_type) {
 		case TypeString:
-			return int(_value.asString->size());
+			return int(_value.asString->data.size());
 		case TypeBinary:
-			return int(_value.asBinary->size());
+			return int(_value.asBinary->data.size());
 		case TypeArray: 
-			return int(_value.asArray->size());
+			return int(_value.asArray->data.size());
 		case TypeStruct:
-			return int(_value.asStruct->size());
+			return int(_value.asStruct->data.size());
 		default:
 			break;
 		}
@@ -206,19 +561,24 @@ public:
 	}
 	std::string to_str() const {
 		std::string ret;
-		static char buf[256];
+		char buf[scalar::double_size];
 		value::Array::const_iterator itarray;
 		value::Struct::const_iterator itstruct;
 		switch(_type) {
 		case TypeString:
-			ret = *_value.asString;
+			ret = _value.asString->data;
 			break;
 		case TypeInt:
-			sprintf(buf, "%d", _value.asInt);
-			ret = buf;
+			ret.assign(buf, scalar::format_int(buf, _value.asInt));
+			break;
+		case TypeI8:
+			ret.assign(buf, scalar::format_i8(buf, _value.asI8));
+			break;
+		case TypeDouble:
+			ret.assign(buf, std::to_chars(buf, buf + sizeof(buf), _value.asDouble, std::chars_format::fixed, 6).ptr);
 			break;
 		case TypeTime:
-			sprintf(buf, "%04d/%02d/%02d %02d:%02d:%02d",
+			snprintf(buf, sizeof(buf), "%04d/%02d/%02d %02d:%02d:%02d",
 				_value.asTime->tm_year+1900,
 				_value.asTime->tm_mon,
 				_value.asTime->tm_mday,
@@ -232,8 +592,8 @@ public:
 			break;
 		case TypeArray:
 			ret += "[";
-			for(itarray = _value.asArray->begin(); itarray != _value.asArray->end(); itarray++) {
-				if (itarray != _value.asArray->begin())
+			for(itarray = _value.asArray->data.begin(); itarray != _value.asArray->data.end(); itarray++) {
+				if (itarray != _value.asArray->data.begin())
 					ret += ", ";
 				ret += itarray->to_str();
 			}
@@ -241,8 +601,8 @@ public:
 			break;
 		case TypeStruct:
 			ret += "[";
-			for(itstruct = _value.asStruct->begin(); itstruct != _value.asStruct->end(); itstruct++) {
-				if (itstruct != _value.asStruct->begin())
+			for(itstruct = _value.asStruct->data.begin(); itstruct != _value.asStruct->data.end(); itstruct++) {
+				if (itstruct != _value.asStruct->data.begin())
 					ret += ", ";
 				ret += itstruct->first.c_str();
 				ret += "=\"";
@@ -251,17 +611,19 @@ public:
 			}
 			ret += "]";
 			break;
+		default:
+			break;
 		}
 		return ret;
 	}
 
 	operator int&() { return _value.asInt; }
 	operator struct tm*() { return _value.asTime; }
-	operator const char*() { return _value.asString->c_str(); }
-	operator std::string&() { return *_value.asString; }
-	operator Binary&() { return *_value.asBinary; }
-	operator Array&() { return *_value.asArray; }
-	operator Struct&() { return *_value.asStruct; }
+	operator const char*() { return _value.asString->data.c_str(); }
+	operator std::string&() { return unshare(_value.asString); }
+	operator Binary&() { return unshare(_value.asBinary); }
+	operator Array&() { return unshare(_value.asArray); }
+	operator Struct&() { return unshare(_value.asStruct); }
 	operator Exception&() { return *_value.asException; }
 
 	value(value const& rhs) {
@@ -275,12 +637,13 @@ public:
 			switch (_type) {
 			case TypeBoolean:	_value.asBool = rhs._value.asBool; break;
 			case TypeInt:		_value.asInt = rhs._value.asInt; break;
+			case TypeI8:		_value.asI8 = rhs._value.asI8; break;
 			case TypeDouble:	_value.asDouble = rhs._value.asDouble; break;
 			case TypeTime:		_value.asTime = new struct tm(*rhs._value.asTime); break;
-			case TypeString:	_value.asString = new std::string(*rhs._value.asString); break;
-			case TypeBinary:	_value.asBinary = new Binary(*rhs._value.asBinary); break;
-			case TypeArray:		_value.asArray = new Array(*rhs._value.asArray); break;
-			case TypeStruct:	_value.asStruct = new Struct(*rhs._value.asStruct); break;
+			case TypeString:	_value.asString = retain(rhs._value.asString); break;
+			case TypeBinary:	_value.asBinary = retain(rhs._value.asBinary); break;
+			case TypeArray:		_value.asArray = retain(rhs._value.asArray); break;
+			case TypeStruct:	_value.asStruct = retain(rhs._value.asStruct); break;
 			case TypeException:	_value.asException = new Exception(*rhs._value.asException); break;
 			default:
 				_value.asBinary = 0;
@@ -290,27 +653,45 @@ public:
 		}
 		return *this;
 	}
-	value(Array& _array) {
-		invalidate();
-		_value.asArray = new Array(_array);
+	value(value&& rhs) : _type(rhs._type), _value(rhs._value) {
+		rhs._type = TypeInvalid;
+	}
+	value& operator=(value&& rhs) {
+		if (this != &rhs) {
+			invalidate();
+			_type = rhs._type;
+			_value = rhs._value;
+			rhs._type = TypeInvalid;
+		}
+		return *this;
+	}
+	value(const Array& _array) {
+		_value.asArray = new shared<Array>(_array);
 		_type = TypeArray;
 	}
-	value(Struct& _struct) {
-		invalidate();
-		_value.asStruct = new Struct(_struct);
+	value(Array&& _array) {
+		_value.asArray = new shared<Array>(std::move(_array));
+		_type = TypeArray;
+	}
+	value(const Struct& _struct) {
+		_value.asStruct = new shared<Struct>(_struct);
+		_type = TypeStruct;
+	}
+	value(Struct&& _struct) {
+		_value.asStruct = new shared<Struct>(std::move(_struct));
 		_type = TypeStruct;
 	}
 
-    value const& operator[](int i) const { assertArray(i+1); return _value.asArray->at(i); }
-    value& operator[](int i)             { assertArray(i+1); return _value.asArray->at(i); }
+    value const& operator[](int i) const { assertArray(i+1); return _value.asArray->data.at(i); }
+    value& operator[](int i)             { assertArray(i+1); return unshare(_value.asArray).at(i); }
 
-    value& operator[](std::string const& k) { assertStruct(); return (*_value.asStruct)[k]; }
-    value& operator[](const char* k) { assertStruct(); std::string s(k); return (*_value.asStruct)[s]; }
+    value& operator[](std::string const& k) { assertStruct(); return unshare(_value.asStruct)[k]; }
+    value& operator[](const char* k) { assertStruct(); return unshare(_value.asStruct)[k]; }
 
 	static bool tmEq(struct tm* const& t1, struct tm* const& t2) {
 	return
 		t1->tm_sec == t2->tm_sec && t1->tm_min == t2->tm_min &&
-		t1->tm_hour == t2->tm_hour && t1->tm_mday == t1->tm_mday &&
+		t1->tm_hour == t2->tm_hour && t1->tm_mday == t2->tm_mday &&
 		t1->tm_mon == t2->tm_mon && t1->tm_year == t2->tm_year;
 	}
 
@@ -323,28 +704,13 @@ public:
 		case TypeBoolean:  return ( !_value.asBool && !other._value.asBool) ||
 					( _value.asBool && other._value.asBool);
 		case TypeInt:      return _value.asInt == other._value.asInt;
+		case TypeI8:       return _value.asI8 == other._value.asI8;
 		case TypeDouble:   return _value.asDouble == other._value.asDouble;
 		case TypeTime:     return tmEq(_value.asTime, other._value.asTime);
-		case TypeString:   return *_value.asString == *other._value.asString;
-		case TypeBinary:   return *_value.asBinary == *other._value.asBinary;
-		case TypeArray:    return *_value.asArray == *other._value.asArray;
-		case TypeStruct:
-			{
-				if (_value.asStruct->size() != other._value.asStruct->size())
-					return false;
-
-				Struct::const_iterator it1=_value.asStruct->begin();
-				Struct::const_iterator it2=other._value.asStruct->begin();
-				while (it1 != _value.asStruct->end()) {
-					const value& v1 = it1->second;
-					const value& v2 = it2->second;
-					if ( ! (v1 == v2))
-						return false;
-					it1++;
-					it2++;
-				}
-				return true;
-			}
+		case TypeString:   return _value.asString == other._value.asString || _value.asString->data == other._value.asString->data;
+		case TypeBinary:   return _value.asBinary == other._value.asBinary || _value.asBinary->data == other._value.asBinary->data;
+		case TypeArray:    return _value.asArray == other._value.asArray || _value.asArray->data == other._value.asArray->data;
+		case TypeStruct:   return _value.asStruct == other._value.asStruct || _value.asStruct->data == other._value.asStruct->data;
 		case TypeException:
 			return (_value.asException->code == other._value.asException->code
 				&& _value.asException->message == other._value.asException->message);
@@ -367,13 +733,13 @@ protected:
 		if (_type == TypeTime)
 			delete _value.asTime;
 		if (_type == TypeString)
-			delete _value.asString;
+			release(_value.asString);
 		if (_type == TypeBinary)
-			delete _value.asBinary;
+			release(_value.asBinary);
 		if (_type == TypeArray)
-			delete _value.asArray;
+			release(_value.asArray);
 		if (_type == TypeStruct)
-			delete _value.asStruct;
+			release(_value.asStruct);
 		if (_type == TypeException)
 			delete _value.asException;
 		_type = TypeInvalid;
@@ -381,17 +747,17 @@ protected:
     void assertArray(int size) const {
 		if (_type != TypeArray)
 		  throw Exception("type error: expected an array", 4);
-		else if (int(_value.asArray->size()) < size)
+		else if (int(_value.asArray->data.size()) < size)
 		  throw Exception("range error: array index too large", 4);
 	}
 	void assertArray(int size)
 	{
 		if (_type == TypeInvalid) {
 			_type = TypeArray;
-			_value.asArray = new Array(size);
+			_value.asArray = new shared<Array>(Array(size));
 		} else if (_type == TypeArray) {
-			if (int(_value.asArray->size()) < size)
-			_value.asArray->resize(size);
+			if (int(_value.asArray->data.size()) < size)
+			unshare(_value.asArray).resize(size);
 		} else
 			throw Exception("type error: expected an array", 4);
 	}
@@ -399,22 +765,784 @@ protected:
 	{
 		if (_type == TypeInvalid) {
 			_type = TypeStruct;
-			_value.asStruct = new Struct();
-		}
+			_value.asStruct = new shared<Struct>(Struct());
+		} else if (_type != TypeStruct)
+			throw Exception("type error: expected a struct", 4);
 	}
 };
 
-std::ostream& operator<<(std::ostream& os, value& v);
+/*
+ * Initializes libcurl and libxml2 once per process; it also runs before
+ * main() and on first use, so calling it is only needed from code that
+ * starts threads during static initialization. Afterwards the free
+ * functions may be called from any number of threads: each thread keeps
+ * its own curl handle, so consecutive calls to a server reuse the
+ * connection, and its own XML parser context. Values, clients and
+ * servers are not shared between threads unless stated otherwise.
+ */
+void init();
+
+/*
+ * DNS answers and TLS sessions are cached process-wide. warmup() sends an
+ * OPTIONS request to each url on the calling thread's curl handle, so that
+ * thread's first calls find an open connection and other threads skip the
+ * lookup and resume TLS. shm:// urls are skipped. Returns how many were
+ * reached within timeout seconds.
+ *
+ * Connections are warmed per thread: each thread's handle has its own
+ * connection cache, not shared with other threads, so a thread that should
+ * start on an open connection has to call warmup() itself. The cache holds
+ * one connection per url while warming and goes back to libcurl's default
+ * of 5 afterwards; past that, later calls close the oldest idle ones.
+ */
+int warmup(const std::vector<std::string>& urls, double timeout = 5);
+
+std::ostream& operator<<(std::ostream& os, const value& v);
 bool failed(value& res);
+/* whether a raw methodResponse is a fault, without decoding it */
+bool failed(std::string& strXml);
 std::string extract_method_name(std::string& strXml);
 std::string extract_failt_message(std::string& strXml);
+/* a fault response decodes to a TypeException value carrying the
+ * faultString and faultCode; so does a malformed scalar such as
+ * <double>1.5abc</double>, as a type error (code 4) */
 value parse(std::string& strXml);
 std::string serialize(std::string method, std::vector<value>& requests);
 std::string serialize(value& response);
+/* threads <= 0 uses every core; large arrays and structs are split up.
+ * The calling thread works too, helped by one process-wide pool of at
+ * most hardware_concurrency() - 1 threads, started on first use */
+std::string serialize(std::string method, std::vector<value>& requests, int threads);
+std::string serialize(value& response, int threads);
+value parse(std::string& strXml, int threads);
+/* url may also be unix:///path/to.sock, which posts to /RPC2 over that
+ * socket, or shm://name for a server::listen_shm() on the same host */
 const value call(std::string url, std::string method, std::vector<value>& requests, std::map<std::string, std::string>& headers);
 const value call(std::string url, std::string method, std::vector<value>& requests);
 value::Binary binary_fromfile(std::string filename);
 bool binary_tofile(std::string filename, value::Binary binary);
+int post(std::string url, std::string method, std::string request, std::string& response, std::map<std::string, std::string>& headers);
+
+/*
+ * Timing breakdown of a single call, in seconds. The curl phases are
+ * cumulative from the start of the transfer, as CURLINFO_*_TIME reports
+ * them; encode and decode cover serialize() and parse().
+ */
+struct call_stats {
+	std::string method;
+	int result;
+	bool fault;
+	bool hedged;
+	bool hedge_won;
+	long http_status;
+	double encode;
+	double namelookup;
+	double connect;
+	double appconnect;
+	double pretransfer;
+	double starttransfer;
+	double total;
+	double decode;
+	size_t request_bytes;
+	size_t response_bytes;
+	call_stats() : result(0), fault(false), hedged(false), hedge_won(false), http_status(0), encode(0), namelookup(0), connect(0),
+		appconnect(0), pretransfer(0), starttransfer(0), total(0), decode(0),
+		request_bytes(0), response_bytes(0) {}
+};
+
+int post(std::string url, std::string method, std::string request, std::string& response, std::map<std::string, std::string>& headers, call_stats* stats);
+const value call(std::string url, std::string method, std::vector<value>& requests, std::map<std::string, std::string>& headers, call_stats& stats);
+
+/*
+ * Per-call limits, in seconds; 0 means none. A call that runs out of time
+ * fails with -2 like any other transfer error. Hedging is only for
+ * idempotent methods: when hedge_urls is set and no answer has come
+ * within hedge_delay (or, if that is 0, the method's observed p95), the
+ * same request goes to the next hedge url and the first answer wins.
+ * Hedged calls always feed the stats registry. With limit_concurrency
+ * the call first takes a slot from endpoint_limiter(url), waiting up to
+ * queue_timeout for one; a call that gets none fails with -4 unsent.
+ */
+struct call_options {
+	double connect_timeout;
+	double timeout;
+	std::vector<std::string> hedge_urls;
+	double hedge_delay;
+	bool limit_concurrency;
+	double queue_timeout;
+	call_options() : connect_timeout(0), timeout(0), hedge_delay(0), limit_concurrency(false), queue_timeout(0) {}
+};
+
+const value call(std::string url, std::string method, std::vector<value>& requests, const call_options& options);
+
+/*
+ * Process-wide bounds on what one document may cost; 0 means unbounded.
+ * max_body caps the bytes of a response, and of a request the server
+ * reads, and aborts the transfer as soon as it is crossed instead of
+ * buffering the rest. max_depth (element nesting), max_elements and
+ * max_decoded (bytes of text content) are counted by the parsers as they
+ * go, which stop at the first breach. Each breach has its own code: -5
+ * body, -6 depth, -7 elements, -8 text. call() and parse() return it as
+ * a fault value, parse_lazy() and parse_call() throw it, and the server
+ * answers with it. max_depth defaults to 256, as deep as libxml2 goes.
+ */
+struct decode_limits {
+	size_t max_body;
+	int max_depth;
+	size_t max_elements;
+	size_t max_decoded;
+	decode_limits() : max_body(0), max_depth(256), max_elements(0), max_decoded(0) {}
+};
+
+void set_decode_limits(const decode_limits& limits);
+decode_limits get_decode_limits();
+
+/*
+ * Adaptive cap on the calls in flight to one endpoint. Both algorithms
+ * cut the limit by backoff on a transfer error (-2) or HTTP error (-3)
+ * and only raise it while at least half of it is in use. Aimd then adds
+ * one for every limit successful calls. Gradient also takes the fastest
+ * recent call as the latency without queueing and scales the limit by
+ * fastest * tolerance / latency (at most 1) plus sqrt(limit) headroom,
+ * so it shrinks as soon as calls start to queue at the backend.
+ * acquire() waits up to max_wait seconds for a slot and fails at once
+ * when max_queue callers are already waiting. Safe to share between
+ * threads.
+ */
+class concurrency_limiter {
+public:
+	enum algorithm { Aimd, Gradient };
+	concurrency_limiter(algorithm a = Gradient, int initial_limit = 20, int min_limit = 1, int max_limit = 1000);
+	~concurrency_limiter();
+	bool acquire(double max_wait = 0);
+	void release(double latency, int result);
+	void set_algorithm(algorithm a);
+	void set_bounds(int min_limit, int max_limit);
+	void set_max_queue(int max_queue);
+	void set_backoff(double backoff, double tolerance);
+	int limit() const;
+	int in_flight() const;
+	unsigned long rejected() const;
+private:
+	concurrency_limiter(const concurrency_limiter&);
+	concurrency_limiter& operator=(const concurrency_limiter&);
+	algorithm _algorithm;
+	double _limit;
+	int _min_limit;
+	int _max_limit;
+	int _in_flight;
+	int _waiting;
+	int _max_queue;
+	double _backoff;
+	double _tolerance;
+	double _fastest;
+	double _window_fastest;
+	int _samples;
+	unsigned long _rejected;
+	struct lock;
+	lock* _lock;
+};
+
+/* the process-wide limiter for url, created with the defaults on first use */
+concurrency_limiter* endpoint_limiter(const std::string& url);
+
+/*
+ * A request rendered once up front. Parameters are serialized as they are
+ * added; every value() (TypeInvalid) inside them, at any depth, becomes a
+ * slot that render() fills from args in document order. The result is the
+ * same document serialize(method, params) would build.
+ */
+class request_template {
+public:
+	request_template(std::string method);
+	request_template& operator<<(const value& param);
+	size_t slots() const { return _fragments.size() - 1; }
+	const std::string& method() const { return _method; }
+	void render(const std::vector<value>& args, std::string& out) const;
+	std::string render(const std::vector<value>& args) const;
+private:
+	std::string _method;
+	std::vector<std::string> _fragments;
+	int _params;
+};
+
+const value call(std::string url, const request_template& tmpl, const std::vector<value>& args);
+
+/*
+ * A client keeps one curl handle, and with it the server connection, open
+ * across calls. It is not thread-safe; give each thread its own.
+ */
+class client {
+public:
+	client(std::string url);
+	~client();
+	int post(std::string request, std::string& response, call_stats* stats = NULL);
+	const value call(std::string method, std::vector<value>& requests);
+	const value call(std::string method, std::vector<value>& requests, call_stats& stats);
+	const value call(const request_template& tmpl, const std::vector<value>& args);
+	std::map<std::string, std::string>& headers() { return _headers; }
+	call_options& options() { return _options; }
+	const std::string& url() const { return _url; }
+private:
+	client(const client&);
+	client& operator=(const client&);
+	void* _curl;
+	std::string _url;
+	std::map<std::string, std::string> _headers;
+	call_options _options;
+};
+
+/*
+ * Spreads calls over the replicas of one service. LeastOutstanding picks
+ * the replica with the fewest calls in flight; PowerOfTwo compares two
+ * random replicas by latency EWMA times (outstanding + 1). Each replica
+ * keeps a pool of clients, so connections are reused. After
+ * max_failures consecutive transport failures, transfer errors (-2) or
+ * HTTP error statuses (-3), a replica is ejected for eject_time seconds;
+ * if every replica is ejected they are all used. Codes raised on this
+ * side, such as a limiter rejection (-4) or a breached body limit (-5),
+ * neither count nor reset the run.
+ * Safe to share between threads.
+ */
+class endpoint_group {
+public:
+	enum policy { LeastOutstanding, PowerOfTwo };
+	struct endpoint {
+		std::string url;
+		long outstanding;
+		double latency;
+		int consecutive_failures;
+		double ejected_until;
+		unsigned long calls;
+		unsigned long failures;
+		unsigned long ejections;
+		std::vector<client*> idle;
+	};
+
+	endpoint_group(const std::vector<std::string>& urls, policy p = PowerOfTwo);
+	~endpoint_group();
+	const value call(std::string method, std::vector<value>& requests);
+	const value call(std::string method, std::vector<value>& requests, call_stats& stats);
+	call_options& options() { return _options; }
+	void set_ejection(int max_failures, double eject_time);
+	std::vector<endpoint> snapshot() const;
+private:
+	endpoint_group(const endpoint_group&);
+	endpoint_group& operator=(const endpoint_group&);
+	size_t pick();
+	policy _policy;
+	call_options _options;
+	int _max_failures;
+	double _eject_time;
+	unsigned long _seed;
+	std::vector<endpoint> _endpoints;
+	struct lock;
+	lock* _lock;
+};
+
+/*
+ * Multiplexes concurrent calls over HTTP/2. Any number of threads may
+ * call at once; their requests travel as streams over at most
+ * max_connections connections, driven by one background thread.
+ * http:// URLs speak h2c with prior knowledge, https:// URLs negotiate
+ * h2 through ALPN. Deadlines and limit_concurrency in options() apply,
+ * hedging does not. Set headers() and options() before sharing the
+ * client between threads.
+ */
+class http2_client {
+public:
+	http2_client(std::string url, int max_connections = 1);
+	~http2_client();
+	int post(std::string request, std::string& response, call_stats* stats = NULL);
+	const value call(std::string method, std::vector<value>& requests);
+	const value call(std::string method, std::vector<value>& requests, call_stats& stats);
+	const value call(const request_template& tmpl, const std::vector<value>& args);
+	std::map<std::string, std::string>& headers() { return _headers; }
+	call_options& options() { return _options; }
+	const std::string& url() const { return _url; }
+
+	struct impl;
+private:
+	http2_client(const http2_client&);
+	http2_client& operator=(const http2_client&);
+	std::string _url;
+	std::map<std::string, std::string> _headers;
+	call_options _options;
+	impl* _impl;
+};
+
+/*
+ * HDR-style latency histogram: microsecond values fall into power-of-two
+ * ranges split into 32 linear sub-buckets, which keeps the relative error
+ * near 3% over the whole range. Recording is lock-free.
+ */
+class latency_histogram {
+public:
+	enum { sub_bits = 5, sub_count = 1 << sub_bits, bucket_count = (32 - sub_bits + 1) * sub_count };
+	latency_histogram() { reset(); }
+	void record(double seconds);
+	void merge(const latency_histogram& other);
+	void reset();
+	unsigned long count() const { return _count; }
+	double sum() const { return _sum_us * 1e-6; }
+	double max() const { return _max_us * 1e-6; }
+	double percentile(double p) const;
+	unsigned long count_below(double seconds) const;
+	static int bucket_of(unsigned long us);
+	static unsigned long bucket_limit(int bucket);
+private:
+	latency_histogram(const latency_histogram&);
+	latency_histogram& operator=(const latency_histogram&);
+	std::atomic<unsigned long> _buckets[bucket_count];
+	std::atomic<unsigned long> _count;
+	std::atomic<unsigned long> _sum_us;
+	std::atomic<unsigned long> _max_us;
+};
+
+struct method_stats {
+	std::atomic<unsigned long> calls;
+	std::atomic<unsigned long> errors;
+	std::atomic<unsigned long> faults;
+	std::atomic<unsigned long> hedges;
+	std::atomic<unsigned long> hedge_wins;
+	std::atomic<unsigned long> request_bytes;
+	std::atomic<unsigned long> response_bytes;
+	std::atomic<unsigned long> encode_us;
+	std::atomic<unsigned long> network_us;
+	std::atomic<unsigned long> decode_us;
+	latency_histogram latency;
+	method_stats() { reset(); }
+	void reset();
+};
+
+/*
+ * Per-method statistics registry, off by default. The hook, if set, sees
+ * every call_stats whether or not the registry is enabled; it may be
+ * replaced while other threads are calling, which finish with the old one.
+ */
+void enable_stats(bool enable);
+void set_stats_hook(std::function<void(const call_stats&)> hook);
+void record_stats(const call_stats& stats);
+const method_stats* find_stats(const std::string& method);
+std::vector<std::string> stats_methods();
+std::string stats_prometheus();
+void reset_stats();
+
+/*
+ * Traffic capture. While a capture file is open every call() and every
+ * server dispatch appends one record: who saw it ('C' client, 'S' server),
+ * the wall clock start time, the duration, post()'s result and the raw
+ * request and response documents. The file carries a format version;
+ * capture_start() will not append to, and capture_reader will not read,
+ * a file of another version.
+ */
+struct capture_record {
+	char source;
+	unsigned long long timestamp_ns;
+	double duration;
+	int result;
+	std::string method;
+	std::string request;
+	std::string response;
+	capture_record() : source('C'), timestamp_ns(0), duration(0), result(0) {}
+};
+
+bool capture_start(std::string filename);
+void capture_stop();
+bool capturing();
+void capture_write(const capture_record& record);
+
+class capture_reader {
+public:
+	capture_reader(std::string filename);
+	~capture_reader();
+	bool good() const { return _fp != NULL; }
+	bool next(capture_record& record);
+private:
+	capture_reader(const capture_reader&);
+	capture_reader& operator=(const capture_reader&);
+	FILE* _fp;
+	unsigned long long _left;
+};
+
+/*
+ * Lazy decoding.
+ *
+ * parse_lazy() keeps the response text and builds only a flat index of
+ * where each value, struct member and array element lives in it. Scalars,
+ * base64 and nested containers are decoded when they are read through
+ * operator[] or the getters; to_value() materializes a subtree. The text
+ * is read as UTF-8. Input that is not an XML-RPC document comes back as a
+ * string holding the whole text, as with parse(). A getter whose scalar
+ * text is malformed throws a type error (code 4); parse_call() throws it
+ * too, and the server answers with it as a fault. Text, references and
+ * CDATA are decoded here by decode_text() on the SSE2 scanning kernels;
+ * parse() still takes its text already decoded from the libxml2 tree.
+ */
+namespace detail {
+	struct lazy_node {
+		unsigned char type;
+		unsigned char escaped;
+		unsigned int begin, end;
+		unsigned int name_begin, name_end;
+		unsigned int next;
+		unsigned int count;
+		unsigned int first;
+	};
+
+	/* children holds every container's child nodes in order, each
+	 * container's run starting at its first, for indexed access */
+	struct lazy_document {
+		std::string xml;
+		std::vector<lazy_node> nodes;
+		std::vector<unsigned int> children;
+		unsigned int root;
+		unsigned int method_begin, method_end;
+		bool fault;
+	};
+}
+
+class lazy_value {
+public:
+	lazy_value() : _node(0) {}
+	lazy_value(std::shared_ptr<const detail::lazy_document> doc, unsigned int node) : _doc(doc), _node(node) {}
+
+	value::Type getType() const {
+		return _doc ? (value::Type)_doc->nodes[_node].type : value::TypeInvalid;
+	}
+	bool getBoolean() const;
+	int getInt() const;
+	long long getI8() const;
+	double getDouble() const;
+	struct tm getTime() const;
+	std::string getString() const;
+	value::Binary getBinary() const;
+	size_t size() const;
+	bool hasMember(const std::string& name) const;
+	std::vector<std::string> listMembers() const;
+	std::string to_str() const { return to_value().to_str(); }
+	value to_value() const;
+
+	lazy_value operator[](int i) const;
+	lazy_value operator[](const std::string& name) const;
+	lazy_value operator[](const char* name) const { return (*this)[std::string(name)]; }
+	/* the n-th struct member in wire order, its decoded name in name */
+	lazy_value member(size_t n, std::string& name) const;
+
+	bool fault() const { return _doc && _doc->fault; }
+
+private:
+	std::string_view raw() const;
+	std::shared_ptr<const detail::lazy_document> _doc;
+	unsigned int _node;
+};
+
+lazy_value parse_lazy(std::string strXml);
+bool failed(const lazy_value& res);
+bool parse_call(std::string strXml, std::string& method, value::Array& params);
+
+/*
+ * Typed struct binding.
+ *
+ *   struct post { std::string title; std::string description; int postid; };
+ *   TINYXMLRPC_STRUCT(post, title, description, postid)
+ *
+ * TINYXMLRPC_STRUCT must be used at global scope. Bound types (and
+ * std::vector of them) can then be decoded straight from a response with
+ * parse(strXml, result) or call(url, req, result), and encoded as call
+ * parameters through request, without going through value::Struct.
+ * Decoding runs on the lazy tokenizer above, looking each wire member up
+ * in a hash index over the bound fields; encoding appends to the text
+ * the way serialize() writes it. Neither builds a libxml2 tree.
+ */
+template<class T> struct struct_traits;
+
+template<class T> struct codec;
+
+namespace detail {
+	constexpr unsigned int fnv1a(const char* s, size_t n, unsigned int h = 2166136261u) {
+		return n == 0 ? h : fnv1a(s + 1, n - 1, (h ^ (unsigned char)*s) * 16777619u);
+	}
+
+	void type_error(const char* expected);
+	lazy_value response_param(std::string strXml);
+	std::string post_or_throw(std::string url, std::string request);
+	void write_value(std::string& out, const value& v, std::vector<std::string>* holes);
+	value::Exception body_exceeded(size_t limit);
+	/* text kernels for the string writer and the lazy decoder; the eager
+	 * parse() does not use them */
+	size_t escape_span(const char* p, size_t size);
+	size_t text_span(const char* p, size_t size);
+	void write_escaped(std::string& out, const char* p, size_t size);
+	void decode_text(const char* p, const char* e, std::string& out);
+}
+
+template<class T> struct member {
+	const char* name;
+	size_t len;
+	unsigned int hash;
+	void (*decode)(T&, const lazy_value&);
+	void (*encode)(const T&, std::string&);
+};
+
+template<class T, class F, F T::*M> void decode_member(T& obj, const lazy_value& in) {
+	codec<F>::decode(obj.*M, in);
+}
+
+template<class T, class F, F T::*M> void encode_member(const T& obj, std::string& out) {
+	codec<F>::encode(obj.*M, out);
+}
+
+namespace detail {
+	/* open addressing over a bound type's members, built on first use */
+	template<class T> class member_index {
+	public:
+		static const member_index& get() {
+			static const member_index index;
+			return index;
+		}
+		const member<T>* find(const char* name, size_t len) const {
+			unsigned int hash = fnv1a(name, len);
+			for(size_t slot = hash & _mask; _slots[slot]; slot = (slot + 1) & _mask) {
+				const member<T>& m = _members[_slots[slot] - 1];
+				if (m.hash == hash && m.len == len && !memcmp(m.name, name, len))
+					return &m;
+			}
+			return NULL;
+		}
+	private:
+		member_index() {
+			size_t count;
+			_members = struct_traits<T>::members(count);
+			size_t capacity = 8;
+			while (capacity < count * 2) capacity *= 2;
+			_slots.assign(capacity, 0);
+			_mask = capacity - 1;
+			for(size_t n = 0; n < count; n++) {
+				size_t slot = _members[n].hash & _mask;
+				while (_slots[slot]) slot = (slot + 1) & _mask;
+				_slots[slot] = (unsigned char)(n + 1);
+			}
+		}
+		const member<T>* _members;
+		std::vector<unsigned char> _slots;
+		size_t _mask;
+	};
+}
+
+#define TINYXMLRPC_CODEC(T) \
+template<> struct codec<T> { \
+	static void decode(T& v, const lazy_value& in); \
+	static void encode(const T& v, std::string& out); \
+}
+TINYXMLRPC_CODEC(int);
+TINYXMLRPC_CODEC(long long);
+TINYXMLRPC_CODEC(bool);
+TINYXMLRPC_CODEC(double);
+TINYXMLRPC_CODEC(std::string);
+TINYXMLRPC_CODEC(struct tm);
+TINYXMLRPC_CODEC(value::Binary);
+TINYXMLRPC_CODEC(value::Struct);
+TINYXMLRPC_CODEC(value);
+#undef TINYXMLRPC_CODEC
+
+template<class T> struct codec<std::vector<T> > {
+	static void decode(std::vector<T>& v, const lazy_value& in) {
+		if (in.getType() != value::TypeArray)
+			detail::type_error("an array");
+		size_t size = in.size();
+		v.clear();
+		v.reserve(size);
+		for(size_t n = 0; n < size; n++) {
+			v.push_back(T());
+			codec<T>::decode(v.back(), in[(int)n]);
+		}
+	}
+	static void encode(const std::vector<T>& v, std::string& out) {
+		if (v.empty()) {
+			out += "<value><array><data/></array></value>";
+			return;
+		}
+		out += "<value><array><data>";
+		typename std::vector<T>::const_iterator it;
+		for(it = v.begin(); it != v.end(); it++)
+			codec<T>::encode(*it, out);
+		out += "</data></array></value>";
+	}
+};
+
+template<class T> struct codec {
+	static void decode(T& obj, const lazy_value& in) {
+		if (in.getType() != value::TypeStruct)
+			detail::type_error("a struct");
+		const detail::member_index<T>& index = detail::member_index<T>::get();
+		std::string name;
+		size_t size = in.size();
+		for(size_t n = 0; n < size; n++) {
+			lazy_value v = in.member(n, name);
+			const member<T>* m = index.find(name.data(), name.size());
+			if (m)
+				m->decode(obj, v);
+		}
+	}
+	static void encode(const T& obj, std::string& out) {
+		size_t count;
+		const member<T>* members = struct_traits<T>::members(count);
+		out += "<value><struct>";
+		for(size_t n = 0; n < count; n++) {
+			out += "<member><name>";
+			out.append(members[n].name, members[n].len);
+			out += "</name>";
+			members[n].encode(obj, out);
+			out += "</member>";
+		}
+		out += "</struct></value>";
+	}
+};
+
+class request {
+public:
+	request(std::string method);
+	template<class T> request& operator<<(const T& v) {
+		_xml += _params++ ? "<param>" : "<params><param>";
+		codec<T>::encode(v, _xml);
+		_xml += "</param>";
+		return *this;
+	}
+	request& operator<<(const char* v) {
+		return *this << std::string(v);
+	}
+	std::string str() const;
+private:
+	std::string _xml;
+	int _params;
+};
+
+template<class T> void parse(const std::string& strXml, T& result) {
+	codec<T>::decode(result, detail::response_param(strXml));
+}
+
+const value call(std::string url, request& req);
+
+template<class T> void call(std::string url, request& req, T& result) {
+	codec<T>::decode(result, detail::response_param(detail::post_or_throw(url, req.str())));
+}
+
+#define TINYXMLRPC_MEMBER_(T, f) \
+	{ #f, sizeof(#f) - 1, ::tinyxmlrpc::detail::fnv1a(#f, sizeof(#f) - 1), \
+	  &::tinyxmlrpc::decode_member<T, decltype(T::f), &T::f>, \
+	  &::tinyxmlrpc::encode_member<T, decltype(T::f), &T::f> },
+#define TINYXMLRPC_FE_1(m, T, f) m(T, f)
+#define TINYXMLRPC_FE_2(m, T, f, ...) m(T, f) TINYXMLRPC_FE_1(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_3(m, T, f, ...) m(T, f) TINYXMLRPC_FE_2(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_4(m, T, f, ...) m(T, f) TINYXMLRPC_FE_3(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_5(m, T, f, ...) m(T, f) TINYXMLRPC_FE_4(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_6(m, T, f, ...) m(T, f) TINYXMLRPC_FE_5(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_7(m, T, f, ...) m(T, f) TINYXMLRPC_FE_6(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_8(m, T, f, ...) m(T, f) TINYXMLRPC_FE_7(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_9(m, T, f, ...) m(T, f) TINYXMLRPC_FE_8(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_10(m, T, f, ...) m(T, f) TINYXMLRPC_FE_9(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_11(m, T, f, ...) m(T, f) TINYXMLRPC_FE_10(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_12(m, T, f, ...) m(T, f) TINYXMLRPC_FE_11(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_13(m, T, f, ...) m(T, f) TINYXMLRPC_FE_12(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_14(m, T, f, ...) m(T, f) TINYXMLRPC_FE_13(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_15(m, T, f, ...) m(T, f) TINYXMLRPC_FE_14(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_16(m, T, f, ...) m(T, f) TINYXMLRPC_FE_15(m, T, __VA_ARGS__)
+#define TINYXMLRPC_FE_N_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define TINYXMLRPC_FE_(m, T, ...) \
+	TINYXMLRPC_FE_N_(__VA_ARGS__, TINYXMLRPC_FE_16, TINYXMLRPC_FE_15, TINYXMLRPC_FE_14, TINYXMLRPC_FE_13, \
+		TINYXMLRPC_FE_12, TINYXMLRPC_FE_11, TINYXMLRPC_FE_10, TINYXMLRPC_FE_9, TINYXMLRPC_FE_8, \
+		TINYXMLRPC_FE_7, TINYXMLRPC_FE_6, TINYXMLRPC_FE_5, TINYXMLRPC_FE_4, TINYXMLRPC_FE_3, \
+		TINYXMLRPC_FE_2, TINYXMLRPC_FE_1)(m, T, __VA_ARGS__)
+
+#define TINYXMLRPC_STRUCT(T, ...) \
+namespace tinyxmlrpc { \
+template<> struct struct_traits<T> { \
+	static const member<T>* members(size_t& count) { \
+		static const member<T> table[] = { TINYXMLRPC_FE_(TINYXMLRPC_MEMBER_, T, __VA_ARGS__) }; \
+		count = sizeof(table) / sizeof(table[0]); \
+		return table; \
+	} \
+}; \
+}
+
+/*
+ * Tracing spans, compiled in with -DTINYXMLRPC_TRACE (and USDT probes
+ * tinyxmlrpc:span_begin/span_end with -DTINYXMLRPC_TRACE_USDT). Each thread
+ * records finished spans into its own ring buffer of trace::ring_size
+ * events; trace::chrome_json() dumps them in Chrome trace-event format.
+ * Without the flag TINYXMLRPC_TRACE_SPAN compiles to nothing.
+ */
+#ifdef TINYXMLRPC_TRACE
+namespace trace {
+enum { ring_size = 4096 };
+class span {
+public:
+	explicit span(const char* name);
+	~span();
+private:
+	span(const span&);
+	span& operator=(const span&);
+	const char* _name;
+	unsigned long long _begin;
+};
+std::string chrome_json();
+void clear();
+}
+#define TINYXMLRPC_TRACE_SPAN(name) ::tinyxmlrpc::trace::span tinyxmlrpc_trace_span_(name)
+#else
+#define TINYXMLRPC_TRACE_SPAN(name) ((void)0)
+#endif
+
+namespace detail {
+	/* shared-memory transport (Linux only, tinyxmlrpc_shm.cxx) */
+	struct shm_segment;
+	shm_segment* shm_create(const std::string& name, int slots, size_t slot_size);
+	void shm_serve(shm_segment* segment, std::function<std::string(std::string&)> dispatch);
+	void shm_stop(shm_segment* segment);
+	void shm_destroy(shm_segment* segment);
+	int shm_post(const std::string& name, const std::string& request, std::string& response, long timeout_ms);
+}
+
+/*
+ * Embedded XML-RPC server over HTTP/1.1 (POSIX only, tinyxmlrpc_server.cxx).
+ * Every connection is served by its own thread and kept alive between
+ * calls. The same port speaks h2c, by prior knowledge or by Upgrade;
+ * the streams of an HTTP/2 connection are dispatched concurrently.
+ * listen_unix() binds a Unix domain socket instead of a TCP port, for
+ * clients on the same host using unix:// URLs; it returns 0 or -1.
+ * Handlers get the decoded params and return the result; a thrown
+ * value::Exception goes back to the caller as a fault. add_constant()
+ * registers a method that always answers with result, rendered once up
+ * front. Responses go out with a single writev(). Request headers are
+ * capped at 64 KiB whatever max_body says: HTTP/1.1 answers 431, h2
+ * ends the connection with ENHANCE_YOUR_CALM.
+ */
+class server {
+public:
+	typedef std::function<value(value::Array& params)> method;
+
+	server();
+	~server();
+	void add_method(std::string name, method handler);
+	void add_constant(std::string name, value result);
+	int listen(std::string host, int port);
+	int listen_unix(std::string path);
+	/* additionally serves shm://name URLs to other processes through a
+	 * shared memory segment of slots messages of up to slot_size bytes,
+	 * dispatched by threads (Linux only); returns 0 or -1 */
+	int listen_shm(std::string name, int threads = 1, int slots = 64, size_t slot_size = 1 << 16);
+	void start();
+	void stop();
+	std::string dispatch(std::string& request);
+	int port() const;
+
+	struct impl;
+private:
+	server(const server&);
+	server& operator=(const server&);
+	impl* _impl;
+};
 
 }
 
@@ -0,0 +1,1134 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <deque>
+#include <algorithm>
+#include <chrono>
+
+#include "tinyxmlrpc.h"
+
+namespace tinyxmlrpc {
+
+struct server::impl {
+	std::map<std::string, method> methods;
+	std::map<std::string, std::shared_ptr<const std::string> > constants;
+	std::mutex faults_lock;
+	std::map<std::pair<int, std::string>, std::shared_ptr<const std::string> > faults;
+	int listen_fd;
+	int port;
+	std::string unix_path;
+	detail::shm_segment* shm;
+	int shm_threads;
+	std::vector<std::thread> shm_workers;
+	bool stopping;
+	std::thread acceptor;
+	std::mutex lock;
+	std::condition_variable idle;
+	std::set<int> connections;
+};
+
+server::server() {
+	_impl = new impl;
+	_impl->listen_fd = -1;
+	_impl->port = -1;
+	_impl->stopping = false;
+	_impl->shm = NULL;
+	_impl->shm_threads = 0;
+}
+
+server::~server() {
+	stop();
+	delete _impl;
+}
+
+void server::add_method(std::string name, method handler) {
+	_impl->constants.erase(name);
+	_impl->methods[name] = handler;
+}
+
+void server::add_constant(std::string name, value result) {
+	_impl->methods.erase(name);
+	_impl->constants[name] = std::make_shared<const std::string>(serialize(result, 1));
+}
+
+int server::port() const {
+	return _impl->port;
+}
+
+int server::listen(std::string host, int port) {
+	struct addrinfo hints = {0}, *res = NULL;
+	char service[scalar::int_size];
+	scalar::format_int(service, port);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host.empty() ? NULL : host.c_str(), service, &hints, &res) != 0)
+		return -1;
+	int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	int on = 1;
+	if (fd < 0 ||
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+			bind(fd, res->ai_addr, res->ai_addrlen) != 0 ||
+			::listen(fd, 128) != 0) {
+		if (fd >= 0) close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	getsockname(fd, (struct sockaddr*)&addr, &len);
+	if (addr.ss_family == AF_INET6)
+		_impl->port = ntohs(((struct sockaddr_in6*)&addr)->sin6_port);
+	else
+		_impl->port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+	_impl->listen_fd = fd;
+	return _impl->port;
+}
+
+int server::listen_unix(std::string path) {
+	struct sockaddr_un addr = {0};
+	if (path.size() >= sizeof(addr.sun_path))
+		return -1;
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	unlink(path.c_str());
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(fd, 128) != 0) {
+		close(fd);
+		return -1;
+	}
+	_impl->unix_path = path;
+	_impl->port = -1;
+	_impl->listen_fd = fd;
+	return 0;
+}
+
+int server::listen_shm(std::string name, int threads, int slots, size_t slot_size) {
+	if (_impl->shm)
+		return -1;
+	_impl->shm = detail::shm_create(name, slots, slot_size);
+	if (!_impl->shm)
+		return -1;
+	_impl->shm_threads = std::max(threads, 1);
+	return 0;
+}
+
+/* a response body: a pre-rendered document, or a payload rendered into
+ * a pooled buffer that goes out between the constant framing */
+struct reply {
+	std::shared_ptr<const std::string> fixed;
+	const std::string* payload;
+	const char* type;
+
+	reply() : payload(NULL), type("text/xml") {}
+	int pieces(struct iovec* iov) const {
+		static const char head[] = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<methodResponse><params><param>";
+		static const char tail[] = "</param></params></methodResponse>\n";
+		if (fixed) {
+			iov[0].iov_base = (void*)fixed->data();
+			iov[0].iov_len = fixed->size();
+			return 1;
+		}
+		iov[0].iov_base = (void*)head;
+		iov[0].iov_len = sizeof(head) - 1;
+		iov[1].iov_base = (void*)payload->data();
+		iov[1].iov_len = payload->size();
+		iov[2].iov_base = (void*)tail;
+		iov[2].iov_len = sizeof(tail) - 1;
+		return 3;
+	}
+	size_t size() const {
+		struct iovec iov[3];
+		size_t size = 0;
+		for(int n = pieces(iov); n-- > 0;)
+			size += iov[n].iov_len;
+		return size;
+	}
+	std::string str() const {
+		struct iovec iov[3];
+		std::string out;
+		out.reserve(size());
+		for(int n = 0, count = pieces(iov); n < count; n++)
+			out.append((const char*)iov[n].iov_base, iov[n].iov_len);
+		return out;
+	}
+};
+
+/* handlers tend to throw the same few faults; the first 64 distinct ones
+ * are kept rendered */
+static
+std::shared_ptr<const std::string> fault(server::impl* d, value::Exception& e) {
+	std::pair<int, std::string> key(e.code, e.message);
+	std::lock_guard<std::mutex> guard(d->faults_lock);
+	std::map<std::pair<int, std::string>, std::shared_ptr<const std::string> >::iterator it = d->faults.find(key);
+	if (it != d->faults.end())
+		return it->second;
+	std::shared_ptr<const std::string> xml = std::make_shared<const std::string>(e.to_xml());
+	if (d->faults.size() < 64)
+		d->faults[key] = xml;
+	return xml;
+}
+
+static const std::shared_ptr<const std::string> not_allowed =
+	std::make_shared<const std::string>("<html><body>405 Method Not Allowed</body></html>");
+static const std::shared_ptr<const std::string> header_too_large =
+	std::make_shared<const std::string>("<html><body>431 Request Header Fields Too Large</body></html>");
+
+/* request headers are bounded on their own, whatever max_body says */
+static const size_t max_header_size = 64 << 10;
+
+/* the payload buffer is reused by every call on the same thread */
+static
+reply dispatch_call(server::impl* d, std::string& request, std::string& method) {
+	static const std::shared_ptr<const std::string> not_well_formed =
+		std::make_shared<const std::string>(value::Exception("parse error: not well formed", -32700).to_xml());
+	thread_local std::string payload;
+	reply out;
+	out.payload = &payload;
+	value::Array params;
+	try {
+		if (!parse_call(request, method, params)) {
+			out.fixed = not_well_formed;
+			return out;
+		}
+	} catch(value::Exception& e) {
+		out.fixed = fault(d, e);
+		return out;
+	}
+	std::map<std::string, server::method>::iterator it = d->methods.find(method);
+	if (it == d->methods.end()) {
+		std::map<std::string, std::shared_ptr<const std::string> >::iterator constant = d->constants.find(method);
+		if (constant != d->constants.end())
+			out.fixed = constant->second;
+		else
+			out.fixed = std::make_shared<const std::string>(
+				value::Exception("requested method not found: " + method, -32601).to_xml());
+		return out;
+	}
+	try {
+		value result = it->second(params);
+		if (payload.capacity() > (1 << 20))
+			std::string().swap(payload);
+		payload.clear();
+		detail::write_value(payload, result, NULL);
+	} catch(value::Exception& e) {
+		out.fixed = fault(d, e);
+	}
+	return out;
+}
+
+static
+reply dispatch_reply(server::impl* d, std::string& request) {
+	TINYXMLRPC_TRACE_SPAN("dispatch");
+	std::string method;
+	if (!capturing())
+		return dispatch_call(d, request, method);
+
+	capture_record record;
+	record.source = 'S';
+	record.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	reply out = dispatch_call(d, request, method);
+	record.response = out.str();
+	record.duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	record.method = method;
+	record.request = request;
+	capture_write(record);
+	return out;
+}
+
+std::string server::dispatch(std::string& request) {
+	return dispatch_reply(_impl, request).str();
+}
+
+static
+bool send_all(int fd, const char* data, size_t size) {
+	while (size > 0) {
+		ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+/* writev() without SIGPIPE; iov is consumed as it goes out */
+static
+bool send_vector(int fd, struct iovec* iov, size_t count) {
+	while (true) {
+		while (count > 0 && iov->iov_len == 0)
+			iov++, count--;
+		if (count == 0) return true;
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = std::min(count, (size_t)IOV_MAX);
+		ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		for(; count > 0 && (size_t)n >= iov->iov_len; iov++, count--)
+			n -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+static
+bool fill(int fd, std::string& buf) {
+	char chunk[16384];
+	while (true) {
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		buf.append(chunk, n);
+		return true;
+	}
+}
+
+static
+std::string header_value(const std::string& head, const char* name) {
+	size_t len = strlen(name);
+	size_t pos = head.find("\r\n");
+	while (pos != std::string::npos && pos + 2 < head.size()) {
+		size_t line = pos + 2;
+		pos = head.find("\r\n", line);
+		size_t end = pos == std::string::npos ? head.size() : pos;
+		if (end - line > len && head[line + len] == ':' && !strncasecmp(head.c_str() + line, name, len)) {
+			size_t v = line + len + 1;
+			while (v < end && (head[v] == ' ' || head[v] == '\t')) v++;
+			return head.substr(v, end - v);
+		}
+	}
+	return "";
+}
+
+/*
+ * HTTP/2 over cleartext (h2c): a connection that opens with the client
+ * preface (prior knowledge) or whose first request carries Upgrade: h2c
+ * is served as HTTP/2 instead of HTTP/1.1. Streams are dispatched concurrently, each on its own thread, and the
+ * responses share the socket under the connection lock, respecting the
+ * peer's flow-control windows. HPACK is decoded in full; responses are
+ * encoded with literals only, so the encoder needs no table.
+ */
+namespace http2 {
+
+static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+static const size_t preface_size = 24;
+
+enum frame_type { DATA = 0, HEADERS = 1, PRIORITY = 2, RST_STREAM = 3, SETTINGS = 4,
+	PUSH_PROMISE = 5, PING = 6, GOAWAY = 7, WINDOW_UPDATE = 8, CONTINUATION = 9 };
+enum { END_STREAM = 0x1, ACK = 0x1, END_HEADERS = 0x4, PADDED = 0x8, PRIORITY_FLAG = 0x20 };
+enum { SETTINGS_HEADER_TABLE_SIZE = 0x1, SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE = 0x4, SETTINGS_MAX_FRAME_SIZE = 0x5 };
+enum { NO_ERROR = 0x0, PROTOCOL_ERROR = 0x1, FLOW_CONTROL_ERROR = 0x3,
+	FRAME_SIZE_ERROR = 0x6, REFUSED_STREAM = 0x7, COMPRESSION_ERROR = 0x9,
+	ENHANCE_YOUR_CALM = 0xb };
+
+static const size_t default_window = 65535;
+static const size_t max_frame_size = 16384;
+static const int max_streams = 100;
+
+/* RFC 7541 appendix A */
+static const char* const static_table[][2] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+	{ ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+	{ ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+	{ ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+	{ "accept-ranges", "" }, { "accept", "" },
+	{ "access-control-allow-origin", "" }, { "age", "" }, { "allow", "" },
+	{ "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" },
+	{ "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" },
+	{ "content-type", "" }, { "cookie", "" }, { "date", "" }, { "etag", "" },
+	{ "expect", "" }, { "expires", "" }, { "from", "" }, { "host", "" },
+	{ "if-match", "" }, { "if-modified-since", "" }, { "if-none-match", "" },
+	{ "if-range", "" }, { "if-unmodified-since", "" },
+	{ "last-modified", "" }, { "link", "" }, { "location", "" },
+	{ "max-forwards", "" }, { "proxy-authenticate", "" },
+	{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" },
+	{ "refresh", "" }, { "retry-after", "" }, { "server", "" },
+	{ "set-cookie", "" }, { "strict-transport-security", "" },
+	{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" },
+	{ "via", "" }, { "www-authenticate", "" },
+};
+static const size_t static_entries = sizeof(static_table) / sizeof(static_table[0]);
+
+/* RFC 7541 appendix B; the code is canonical, so the lengths define it */
+static const unsigned char huffman_lengths[257] = {
+	13,23,28,28,28,28,28,28,28,24,30,28,28,30,28,28,28,28,28,28,28,28,30,28,28,28,28,28,28,28,28,28,
+	6,10,10,12,13,6,8,11,10,10,8,11,8,6,6,6,5,5,5,6,6,6,6,6,6,6,7,8,15,6,12,10,
+	13,6,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,8,7,8,13,19,13,14,6,
+	15,5,6,5,6,5,6,6,6,5,7,7,6,6,6,5,6,7,6,5,5,6,7,7,7,7,7,15,11,14,13,28,
+	20,22,20,20,22,22,22,23,22,23,23,23,23,23,24,23,24,24,22,23,24,23,23,23,23,21,22,23,22,23,23,24,
+	22,21,20,22,22,23,23,21,23,22,22,24,21,22,23,23,21,21,22,21,23,22,23,23,20,22,22,22,23,22,22,23,
+	26,26,20,19,22,23,22,25,26,26,26,27,27,26,24,25,19,21,26,27,27,26,27,24,21,21,26,26,28,27,27,27,
+	20,24,20,21,22,21,21,23,22,22,25,25,24,24,26,23,26,27,26,26,27,27,27,27,27,28,27,27,27,27,27,26,
+	30,
+};
+
+struct huffman_table {
+	unsigned first[31];
+	unsigned count[31];
+	unsigned offset[31];
+	unsigned short symbols[257];
+
+	huffman_table() {
+		unsigned n = 0, code = 0;
+		for(int len = 0; len <= 30; len++) {
+			first[len] = code;
+			offset[len] = n;
+			count[len] = 0;
+			for(int s = 0; s < 257; s++)
+				if (huffman_lengths[s] == len)
+					symbols[n++] = s, count[len]++;
+			code = (code + count[len]) << 1;
+		}
+	}
+};
+
+static
+bool huffman_decode(const unsigned char* p, size_t size, std::string& out) {
+	static const huffman_table table;
+	unsigned code = 0;
+	int len = 0;
+	for(size_t n = 0; n < size; n++) {
+		for(int bit = 7; bit >= 0; bit--) {
+			code = (code << 1) | ((p[n] >> bit) & 1);
+			if (++len > 30) return false;
+			if (code - table.first[len] < table.count[len]) {
+				unsigned short symbol = table.symbols[table.offset[len] + code - table.first[len]];
+				if (symbol == 256) return false;
+				out += (char)symbol;
+				code = 0;
+				len = 0;
+			}
+		}
+	}
+	/* the padding is a prefix of EOS: fewer than eight 1-bits */
+	return len < 8 && code == (1u << len) - 1;
+}
+
+static
+bool read_int(const unsigned char*& p, const unsigned char* e, int prefix, size_t& v) {
+	unsigned mask = (1u << prefix) - 1;
+	v = *p++ & mask;
+	if (v < mask) return true;
+	for(int shift = 0; p < e && shift < 28; shift += 7) {
+		unsigned char b = *p++;
+		v += (size_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+static
+bool read_string(const unsigned char*& p, const unsigned char* e, std::string& s) {
+	if (p >= e) return false;
+	bool huffman = *p & 0x80;
+	size_t len;
+	if (!read_int(p, e, 7, len) || len > (size_t)(e - p)) return false;
+	s.clear();
+	if (huffman && !huffman_decode(p, len, s)) return false;
+	if (!huffman) s.assign((const char*)p, len);
+	p += len;
+	return true;
+}
+
+typedef std::pair<std::string, std::string> header;
+
+struct hpack_decoder {
+	std::deque<header> table;
+	size_t size;
+	size_t max_size;
+
+	hpack_decoder() : size(0), max_size(4096) {}
+	void evict(size_t limit) {
+		while (size > limit && !table.empty()) {
+			size -= table.back().first.size() + table.back().second.size() + 32;
+			table.pop_back();
+		}
+	}
+	bool lookup(size_t index, header& h) {
+		if (index == 0) return false;
+		if (index <= static_entries) {
+			h.first = static_table[index - 1][0];
+			h.second = static_table[index - 1][1];
+			return true;
+		}
+		index -= static_entries + 1;
+		if (index >= table.size()) return false;
+		h = table[index];
+		return true;
+	}
+	bool decode(const unsigned char* p, size_t n, std::vector<header>& headers) {
+		const unsigned char* e = p + n;
+		while (p < e) {
+			size_t index;
+			header h;
+			if (*p & 0x80) {
+				if (!read_int(p, e, 7, index) || !lookup(index, h)) return false;
+				headers.push_back(h);
+				continue;
+			}
+			if ((*p & 0xe0) == 0x20) {
+				if (!read_int(p, e, 5, index) || index > 4096) return false;
+				max_size = index;
+				evict(max_size);
+				continue;
+			}
+			bool indexing = (*p & 0xc0) == 0x40;
+			if (!read_int(p, e, indexing ? 6 : 4, index)) return false;
+			if (index) {
+				if (!lookup(index, h)) return false;
+			} else if (!read_string(p, e, h.first))
+				return false;
+			if (!read_string(p, e, h.second)) return false;
+			if (indexing) {
+				size_t entry = h.first.size() + h.second.size() + 32;
+				evict(max_size - std::min(entry, max_size));
+				if (entry <= max_size) {
+					table.push_front(h);
+					size += entry;
+				}
+			}
+			headers.push_back(h);
+		}
+		return true;
+	}
+};
+
+static
+void write_int(std::string& out, unsigned char flags, int prefix, size_t v) {
+	unsigned mask = (1u << prefix) - 1;
+	if (v < mask) {
+		out += (char)(flags | v);
+		return;
+	}
+	out += (char)(flags | mask);
+	for(v -= mask; v >= 0x80; v >>= 7)
+		out += (char)(0x80 | (v & 0x7f));
+	out += (char)v;
+}
+
+/* literal header field without indexing, name from the static table */
+static
+void write_literal(std::string& out, size_t name_index, const std::string& value) {
+	write_int(out, 0x00, 4, name_index);
+	write_int(out, 0x00, 7, value.size());
+	out += value;
+}
+
+static
+void frame_header(std::string& out, size_t length, int type, int flags, uint32_t stream) {
+	unsigned char h[9] = {
+		(unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length,
+		(unsigned char)type, (unsigned char)flags,
+		(unsigned char)((stream >> 24) & 0x7f), (unsigned char)(stream >> 16),
+		(unsigned char)(stream >> 8), (unsigned char)stream,
+	};
+	out.append((const char*)h, 9);
+}
+
+static
+uint32_t read32(const unsigned char* p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+struct stream {
+	std::string method;
+	std::string body;
+	long window;
+	bool reset;
+	bool oversized;
+	bool started;
+};
+
+struct connection {
+	server::impl* d;
+	int fd;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::map<uint32_t, stream> streams;
+	long window;
+	long initial_window;
+	size_t peer_max_frame;
+	int active;
+	bool closed;
+
+	bool send_locked(const std::string& data) {
+		if (closed) return false;
+		if (!send_all(fd, data.data(), data.size())) {
+			closed = true;
+			changed.notify_all();
+			return false;
+		}
+		return true;
+	}
+	bool send_locked(std::vector<struct iovec>& iov) {
+		if (closed) return false;
+		if (!send_vector(fd, iov.data(), iov.size())) {
+			closed = true;
+			changed.notify_all();
+			return false;
+		}
+		return true;
+	}
+	bool send_frame(int type, int flags, uint32_t id, const char* payload, size_t size) {
+		std::string out;
+		frame_header(out, size, type, flags, id);
+		out.append(payload, size);
+		std::lock_guard<std::mutex> guard(lock);
+		return send_locked(out);
+	}
+	void window_update(uint32_t id, uint32_t increment) {
+		char payload[4] = { (char)(increment >> 24), (char)(increment >> 16), (char)(increment >> 8), (char)increment };
+		send_frame(WINDOW_UPDATE, 0, id, payload, 4);
+	}
+	void reset_locked(uint32_t id, uint32_t code) {
+		char payload[4] = { (char)(code >> 24), (char)(code >> 16), (char)(code >> 8), (char)code };
+		std::string out;
+		frame_header(out, 4, RST_STREAM, 0, id);
+		out.append(payload, 4);
+		send_locked(out);
+	}
+	/* every dispatch thread is counted in active and waited for on close */
+	void start_locked(uint32_t id) {
+		streams[id].started = true;
+		active++;
+		std::thread(&connection::dispatch, this, id).detach();
+	}
+	void goaway(uint32_t last, uint32_t code) {
+		char payload[8] = { (char)(last >> 24), (char)(last >> 16), (char)(last >> 8), (char)last,
+			(char)(code >> 24), (char)(code >> 16), (char)(code >> 8), (char)code };
+		send_frame(GOAWAY, 0, 0, payload, 8);
+	}
+	void respond(uint32_t id, const std::string& status, const reply& body);
+	void dispatch(uint32_t id);
+};
+
+/* DATA frames point into the body; only their headers are built here */
+void connection::respond(uint32_t id, const std::string& status, const reply& body) {
+	struct iovec pieces[3];
+	int piece = 0;
+	size_t offset = 0;
+	body.pieces(pieces);
+	size_t size = body.size();
+
+	std::string block;
+	if (status == "200")
+		block += (char)0x88;
+	else
+		write_literal(block, 8, status);
+	write_literal(block, 31, body.type);
+	char length[scalar::int_size];
+	scalar::format_int(length, (int)size);
+	write_literal(block, 28, length);
+
+	std::unique_lock<std::mutex> guard(lock);
+	std::deque<std::string> headers;
+	std::vector<struct iovec> out;
+	headers.push_back(std::string());
+	frame_header(headers.back(), block.size(), HEADERS, END_HEADERS | (size == 0 ? END_STREAM : 0), id);
+	headers.back() += block;
+	out.push_back(iovec{ (void*)headers.back().data(), headers.back().size() });
+	size_t sent = 0;
+	while (sent < size) {
+		std::map<uint32_t, stream>::iterator it = streams.find(id);
+		if (closed || it == streams.end() || it->second.reset) return;
+		long room = std::min(window, it->second.window);
+		if (room <= 0) {
+			if (!out.empty() && !send_locked(out)) return;
+			out.clear();
+			headers.clear();
+			changed.wait(guard);
+			continue;
+		}
+		size_t chunk = std::min(std::min((size_t)room, peer_max_frame), size - sent);
+		headers.push_back(std::string());
+		frame_header(headers.back(), chunk, DATA, sent + chunk == size ? END_STREAM : 0, id);
+		out.push_back(iovec{ (void*)headers.back().data(), headers.back().size() });
+		for(size_t left = chunk; left > 0;) {
+			size_t take = std::min(left, pieces[piece].iov_len - offset);
+			out.push_back(iovec{ (char*)pieces[piece].iov_base + offset, take });
+			offset += take;
+			left -= take;
+			if (offset == pieces[piece].iov_len)
+				piece++, offset = 0;
+		}
+		sent += chunk;
+		window -= chunk;
+		it->second.window -= chunk;
+	}
+	send_locked(out);
+}
+
+void connection::dispatch(uint32_t id) {
+	std::string method, request;
+	bool oversized;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stream& s = streams[id];
+		method.swap(s.method);
+		request.swap(s.body);
+		oversized = s.oversized;
+	}
+	reply body;
+	if (method != "POST") {
+		body.fixed = not_allowed;
+		body.type = "text/html";
+		respond(id, "405", body);
+	} else if (oversized) {
+		body.fixed = std::make_shared<const std::string>(detail::body_exceeded(get_decode_limits().max_body).to_xml());
+		respond(id, "413", body);
+	} else
+		respond(id, "200", dispatch_reply(d, request));
+	std::lock_guard<std::mutex> guard(lock);
+	streams.erase(id);
+	active--;
+	changed.notify_all();
+}
+
+static
+bool read_frame(int fd, std::string& buf, unsigned char head[9], std::string& payload) {
+	while (buf.size() < 9)
+		if (!fill(fd, buf)) return false;
+	memcpy(head, buf.data(), 9);
+	size_t length = ((size_t)head[0] << 16) | ((size_t)head[1] << 8) | head[2];
+	if (length > max_frame_size) {
+		payload.clear();
+		return true;
+	}
+	while (buf.size() < 9 + length)
+		if (!fill(fd, buf)) return false;
+	payload.assign(buf, 9, length);
+	buf.erase(0, 9 + length);
+	return true;
+}
+
+/* strips padding and priority fields from a DATA or HEADERS payload */
+static
+bool unpad(int type, int flags, std::string& payload) {
+	size_t pad = 0, skip = 0;
+	if (flags & PADDED) {
+		if (payload.empty()) return false;
+		pad = (unsigned char)payload[0];
+		skip = 1;
+	}
+	if (type == HEADERS && (flags & PRIORITY_FLAG)) skip += 5;
+	if (skip + pad > payload.size()) return false;
+	payload = payload.substr(skip, payload.size() - skip - pad);
+	return true;
+}
+
+/* upgrade is the HTTP/1.1 request that asked for h2c, answered as stream 1 */
+static
+void serve(server::impl* d, int fd, std::string& buf, stream* upgrade) {
+	connection c;
+	c.d = d;
+	c.fd = fd;
+	c.window = default_window;
+	c.initial_window = default_window;
+	c.peer_max_frame = max_frame_size;
+	c.active = 0;
+	c.closed = false;
+
+	char settings[6] = { 0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, (char)max_streams };
+	c.send_frame(SETTINGS, 0, 0, settings, sizeof(settings));
+	while (buf.size() < preface_size)
+		if (!fill(fd, buf)) return;
+	if (buf.compare(0, preface_size, preface))
+		return;
+	buf.erase(0, preface_size);
+
+	uint32_t last_stream = 0, continuing = 0;
+	size_t consumed = 0;
+	if (upgrade) {
+		std::lock_guard<std::mutex> guard(c.lock);
+		stream& s = c.streams[1];
+		s = *upgrade;
+		s.window = c.initial_window;
+		s.reset = false;
+		s.oversized = false;
+		s.started = false;
+		last_stream = 1;
+		c.start_locked(1);
+	}
+
+	hpack_decoder decoder;
+	std::string payload, block;
+	int block_flags = 0;
+	unsigned char head[9];
+	uint32_t error = NO_ERROR;
+	while (error == NO_ERROR && read_frame(fd, buf, head, payload)) {
+		size_t length = ((size_t)head[0] << 16) | ((size_t)head[1] << 8) | head[2];
+		int type = head[3], flags = head[4];
+		uint32_t id = read32(head + 5) & 0x7fffffff;
+		if (length > max_frame_size) {
+			error = FRAME_SIZE_ERROR;
+			break;
+		}
+		if (continuing && (type != CONTINUATION || id != continuing)) {
+			error = PROTOCOL_ERROR;
+			break;
+		}
+
+		switch (type) {
+		case SETTINGS:
+			if (flags & ACK) break;
+			if (id != 0 || length % 6) {
+				error = FRAME_SIZE_ERROR;
+				break;
+			}
+			for(size_t n = 0; n < length; n += 6) {
+				const unsigned char* p = (const unsigned char*)payload.data() + n;
+				int key = (p[0] << 8) | p[1];
+				uint32_t v = read32(p + 2);
+				std::lock_guard<std::mutex> guard(c.lock);
+				if (key == SETTINGS_INITIAL_WINDOW_SIZE) {
+					if (v > 0x7fffffff) {
+						error = FLOW_CONTROL_ERROR;
+						break;
+					}
+					std::map<uint32_t, stream>::iterator it;
+					for(it = c.streams.begin(); it != c.streams.end(); it++)
+						it->second.window += (long)v - c.initial_window;
+					c.initial_window = v;
+					c.changed.notify_all();
+				} else if (key == SETTINGS_MAX_FRAME_SIZE && v >= max_frame_size && v <= 0xffffff)
+					c.peer_max_frame = v;
+			}
+			c.send_frame(SETTINGS, ACK, 0, "", 0);
+			break;
+		case PING:
+			if (!(flags & ACK) && length == 8)
+				c.send_frame(PING, ACK, 0, payload.data(), 8);
+			break;
+		case WINDOW_UPDATE:
+			if (length == 4) {
+				uint32_t increment = read32((const unsigned char*)payload.data()) & 0x7fffffff;
+				std::lock_guard<std::mutex> guard(c.lock);
+				if (id == 0)
+					c.window += increment;
+				else if (c.streams.count(id))
+					c.streams[id].window += increment;
+				c.changed.notify_all();
+			}
+			break;
+		case RST_STREAM: {
+			std::lock_guard<std::mutex> guard(c.lock);
+			std::map<uint32_t, stream>::iterator it = c.streams.find(id);
+			if (it == c.streams.end())
+				break;
+			if (!it->second.started)
+				c.streams.erase(it);
+			else {
+				it->second.reset = true;
+				c.changed.notify_all();
+			}
+			break;
+		}
+		case GOAWAY:
+			goto done;
+		case PUSH_PROMISE:
+			error = PROTOCOL_ERROR;
+			break;
+		case HEADERS:
+			if (!unpad(type, flags, payload) || id == 0 || !(id & 1) || id <= last_stream) {
+				error = PROTOCOL_ERROR;
+				break;
+			}
+			last_stream = id;
+			block = payload;
+			block_flags = flags;
+			continuing = id;
+			/* fall through */
+		case CONTINUATION:
+			if (type == CONTINUATION) {
+				if (!continuing) {
+					error = PROTOCOL_ERROR;
+					break;
+				}
+				block += payload;
+			}
+			/* the block has to be decoded to keep the HPACK table in
+			 * step, so an oversized one ends the connection */
+			if (block.size() > max_header_size) {
+				error = ENHANCE_YOUR_CALM;
+				break;
+			}
+			if (flags & END_HEADERS) {
+				continuing = 0;
+				std::vector<header> headers;
+				if (!decoder.decode((const unsigned char*)block.data(), block.size(), headers)) {
+					error = COMPRESSION_ERROR;
+					break;
+				}
+				std::lock_guard<std::mutex> guard(c.lock);
+				/* the advertised stream limit is enforced, not just announced */
+				if (c.streams.size() >= (size_t)max_streams) {
+					c.reset_locked(id, REFUSED_STREAM);
+					break;
+				}
+				stream& s = c.streams[id];
+				s.window = c.initial_window;
+				s.reset = false;
+				s.oversized = false;
+				s.started = false;
+				for(size_t n = 0; n < headers.size(); n++)
+					if (headers[n].first == ":method")
+						s.method = headers[n].second;
+				if (block_flags & END_STREAM)
+					c.start_locked(id);
+			}
+			break;
+		case DATA: {
+			if (!unpad(type, flags, payload)) {
+				error = PROTOCOL_ERROR;
+				break;
+			}
+			/* the connection window is topped up once half of it is used */
+			consumed += length;
+			if (consumed >= default_window / 2) {
+				c.window_update(0, consumed);
+				consumed = 0;
+			}
+			std::lock_guard<std::mutex> guard(c.lock);
+			std::map<uint32_t, stream>::iterator it = c.streams.find(id);
+			if (it == c.streams.end() || it->second.started) break;
+			/* an oversized request is answered at once, and its stream
+			 * window is never reopened */
+			size_t limit = get_decode_limits().max_body;
+			if (limit && it->second.body.size() + payload.size() > limit) {
+				it->second.oversized = true;
+				std::string().swap(it->second.body);
+				c.start_locked(id);
+				break;
+			}
+			it->second.body += payload;
+			if (flags & END_STREAM)
+				c.start_locked(id);
+			else if (length > 0) {
+				char increment[4] = { (char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length };
+				std::string out;
+				frame_header(out, 4, WINDOW_UPDATE, 0, id);
+				out.append(increment, 4);
+				c.send_locked(out);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	if (error != NO_ERROR)
+		c.goaway(last_stream, error);
+done:
+	std::unique_lock<std::mutex> guard(c.lock);
+	c.closed = true;
+	c.changed.notify_all();
+	while (c.active > 0)
+		c.changed.wait(guard);
+}
+
+}
+
+static
+void serve_connection(server::impl* d, int fd) {
+	std::string buf;
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	while (buf.size() < http2::preface_size && !buf.compare(0, buf.size(), http2::preface, buf.size()))
+		if (!fill(fd, buf)) goto done;
+	if (!buf.compare(0, http2::preface_size, http2::preface)) {
+		http2::serve(d, fd, buf, NULL);
+		goto done;
+	}
+	while (true) {
+		size_t eoh, limit = get_decode_limits().max_body;
+		while ((eoh = buf.find("\r\n\r\n")) == std::string::npos && buf.size() <= max_header_size)
+			if (!fill(fd, buf)) goto done;
+		if (eoh == std::string::npos || eoh > max_header_size) {
+			char header[160];
+			struct iovec iov[2];
+			iov[0].iov_base = header;
+			iov[0].iov_len = snprintf(header, sizeof(header), "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+				"Content-Type: text/html\r\n"
+				"Content-Length: %zu\r\nConnection: close\r\n\r\n", header_too_large->size());
+			iov[1].iov_base = (void*)header_too_large->data();
+			iov[1].iov_len = header_too_large->size();
+			send_vector(fd, iov, 2);
+			goto done;
+		}
+		{
+			std::string head = buf.substr(0, eoh);
+			buf.erase(0, eoh + 4);
+			size_t length = strtoul(header_value(head, "Content-Length").c_str(), NULL, 10);
+			/* refused before any of the body is read */
+			if (limit && length > limit) {
+				std::string fault = detail::body_exceeded(limit).to_xml();
+				char header[160];
+				struct iovec iov[2];
+				iov[0].iov_base = header;
+				iov[0].iov_len = snprintf(header, sizeof(header), "HTTP/1.1 413 Payload Too Large\r\n"
+					"Content-Type: text/xml\r\n"
+					"Content-Length: %zu\r\nConnection: close\r\n\r\n", fault.size());
+				iov[1].iov_base = (void*)fault.data();
+				iov[1].iov_len = fault.size();
+				send_vector(fd, iov, 2);
+				break;
+			}
+			if (!strcasecmp(header_value(head, "Expect").c_str(), "100-continue"))
+				if (!send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25)) break;
+			while (buf.size() < length)
+				if (!fill(fd, buf)) goto done;
+			std::string request = buf.substr(0, length);
+			buf.erase(0, length);
+
+			if (!strcasecmp(header_value(head, "Upgrade").c_str(), "h2c") &&
+					head.find("HTTP2-Settings") != std::string::npos) {
+				static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+					"Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+				if (!send_all(fd, switching, sizeof(switching) - 1)) break;
+				http2::stream upgrade;
+				upgrade.method = head.substr(0, head.find(' '));
+				upgrade.body = request;
+				http2::serve(d, fd, buf, &upgrade);
+				break;
+			}
+
+			const char* status = "200 OK";
+			reply body;
+			if (head.compare(0, 5, "POST ") != 0) {
+				status = "405 Method Not Allowed";
+				body.fixed = not_allowed;
+				body.type = "text/html";
+			} else
+				body = dispatch_reply(d, request);
+			bool keep_alive = strcasecmp(header_value(head, "Connection").c_str(), "close") != 0 &&
+				head.find("HTTP/1.0") == std::string::npos;
+			char header[160];
+			struct iovec iov[4];
+			int count = body.pieces(iov + 1);
+			iov[0].iov_base = header;
+			iov[0].iov_len = snprintf(header, sizeof(header), "HTTP/1.1 %s\r\n"
+				"Content-Type: %s\r\n"
+				"Content-Length: %zu\r\n%s\r\n",
+				status, body.type, body.size(), keep_alive ? "" : "Connection: close\r\n");
+			if (!send_vector(fd, iov, count + 1) || !keep_alive) break;
+		}
+	}
+done:
+	close(fd);
+	std::lock_guard<std::mutex> guard(d->lock);
+	d->connections.erase(fd);
+	d->idle.notify_all();
+}
+
+void server::start() {
+	if (_impl->shm && _impl->shm_workers.empty())
+		for(int n = 0; n < _impl->shm_threads; n++)
+			_impl->shm_workers.push_back(std::thread(detail::shm_serve, _impl->shm,
+				[this](std::string& request) { return dispatch(request); }));
+	if (_impl->listen_fd < 0 || _impl->acceptor.joinable())
+		return;
+	_impl->stopping = false;
+	_impl->acceptor = std::thread([this]() {
+		impl* d = _impl;
+		while (true) {
+			int fd = accept(d->listen_fd, NULL, NULL);
+			if (fd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) continue;
+				break;
+			}
+			std::lock_guard<std::mutex> guard(d->lock);
+			if (d->stopping) {
+				close(fd);
+				break;
+			}
+			d->connections.insert(fd);
+			std::thread(serve_connection, d, fd).detach();
+		}
+	});
+}
+
+void server::stop() {
+	{
+		std::lock_guard<std::mutex> guard(_impl->lock);
+		_impl->stopping = true;
+		if (_impl->listen_fd >= 0)
+			shutdown(_impl->listen_fd, SHUT_RDWR);
+		std::set<int>::iterator it;
+		for(it = _impl->connections.begin(); it != _impl->connections.end(); it++)
+			shutdown(*it, SHUT_RDWR);
+	}
+	if (_impl->acceptor.joinable())
+		_impl->acceptor.join();
+	if (_impl->listen_fd >= 0) {
+		close(_impl->listen_fd);
+		_impl->listen_fd = -1;
+	}
+	if (!_impl->unix_path.empty()) {
+		unlink(_impl->unix_path.c_str());
+		_impl->unix_path = "";
+	}
+	if (_impl->shm) {
+		detail::shm_stop(_impl->shm);
+		for(size_t n = 0; n < _impl->shm_workers.size(); n++)
+			_impl->shm_workers[n].join();
+		_impl->shm_workers.clear();
+		detail::shm_destroy(_impl->shm);
+		_impl->shm = NULL;
+	}
+	std::unique_lock<std::mutex> guard(_impl->lock);
+	while (!_impl->connections.empty())
+		_impl->idle.wait(guard);
+}
+
+}
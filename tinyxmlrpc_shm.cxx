@@ -0,0 +1,425 @@
+/* Copyright 2009 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+#include "tinyxmlrpc.h"
+
+/*
+ * Shared-memory transport. The server creates a POSIX shared memory
+ * segment holding a fixed number of slots and a bounded MPMC queue of
+ * slot indexes. A client claims a free slot, writes the serialized
+ * request into it and queues its index; a server thread dequeues it,
+ * dispatches, writes the response into the same slot and flips its
+ * state. Both sides spin briefly and then sleep on a futex, so an idle
+ * server costs nothing and a busy one makes no syscalls per message.
+ */
+namespace tinyxmlrpc {
+
+namespace detail {
+
+static const uint32_t shm_magic = 0x31525854; /* "TXR1" */
+
+enum { SLOT_FREE, SLOT_WRITING, SLOT_REQUEST, SLOT_RESPONSE, SLOT_ABANDONED };
+
+struct shm_cell {
+	std::atomic<uint32_t> seq;
+	uint32_t slot;
+};
+
+struct shm_slot {
+	std::atomic<uint32_t> state;
+	std::atomic<uint32_t> waiting;
+	uint32_t size;
+	uint32_t reserved;
+};
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t slot_size;
+	uint32_t queue_size;
+	std::atomic<uint32_t> alive;
+	alignas(64) std::atomic<uint32_t> enqueue_pos;
+	alignas(64) std::atomic<uint32_t> dequeue_pos;
+	alignas(64) std::atomic<uint32_t> doorbell;
+	std::atomic<uint32_t> sleeping;
+};
+
+struct shm_segment {
+	std::string path;
+	void* base;
+	size_t size;
+	shm_header* header;
+	shm_cell* cells;
+	char* slots;
+	size_t stride;
+	std::atomic<bool> stopping;
+};
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain 32-bit");
+
+static
+size_t align64(size_t n) {
+	return (n + 63) & ~(size_t)63;
+}
+
+static
+size_t layout(uint32_t slots, uint32_t slot_size, uint32_t queue_size, size_t& cells, size_t& first_slot, size_t& stride) {
+	cells = align64(sizeof(shm_header));
+	first_slot = align64(cells + queue_size * sizeof(shm_cell));
+	stride = align64(sizeof(shm_slot) + slot_size);
+	return first_slot + slots * stride;
+}
+
+static
+void attach(shm_segment* s, void* base, size_t size) {
+	size_t cells, first_slot;
+	s->base = base;
+	s->size = size;
+	s->header = (shm_header*)base;
+	layout(s->header->slots, s->header->slot_size, s->header->queue_size, cells, first_slot, s->stride);
+	s->cells = (shm_cell*)((char*)base + cells);
+	s->slots = (char*)base + first_slot;
+	s->stopping = false;
+}
+
+static
+shm_slot* slot_at(shm_segment* s, uint32_t index) {
+	return (shm_slot*)(s->slots + index * s->stride);
+}
+
+static
+char* slot_data(shm_slot* slot) {
+	return (char*)(slot + 1);
+}
+
+static
+void futex_wait(std::atomic<uint32_t>* word, uint32_t expected, long timeout_ms) {
+	struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static
+void futex_wake(std::atomic<uint32_t>* word, int count) {
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+/* spinning only pays when the other side runs on another core */
+static
+int spin_limit() {
+	static const int limit = std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+	return limit;
+}
+
+static inline
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* Vyukov's bounded MPMC queue, with sequence numbers in each cell */
+static
+bool enqueue(shm_segment* s, uint32_t slot) {
+	shm_header* h = s->header;
+	uint32_t mask = h->queue_size - 1;
+	uint32_t pos = h->enqueue_pos.load(std::memory_order_relaxed);
+	while (true) {
+		shm_cell* cell = &s->cells[pos & mask];
+		int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (h->enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cell->slot = slot;
+				cell->seq.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0)
+			return false;
+		else
+			pos = h->enqueue_pos.load(std::memory_order_relaxed);
+	}
+}
+
+static
+bool dequeue(shm_segment* s, uint32_t& slot) {
+	shm_header* h = s->header;
+	uint32_t mask = h->queue_size - 1;
+	uint32_t pos = h->dequeue_pos.load(std::memory_order_relaxed);
+	while (true) {
+		shm_cell* cell = &s->cells[pos & mask];
+		int32_t diff = (int32_t)(cell->seq.load(std::memory_order_acquire) - (pos + 1));
+		if (diff == 0) {
+			if (h->dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				slot = cell->slot;
+				cell->seq.store(pos + mask + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0)
+			return false;
+		else
+			pos = h->dequeue_pos.load(std::memory_order_relaxed);
+	}
+}
+
+shm_segment* shm_create(const std::string& name, int slots, size_t slot_size) {
+	if (slots < 1 || slot_size < 1 || slot_size > 0x7fffffff)
+		return NULL;
+	uint32_t queue_size = 1;
+	while (queue_size < (uint32_t)slots)
+		queue_size <<= 1;
+	size_t cells, first_slot, stride;
+	size_t size = layout(slots, slot_size, queue_size, cells, first_slot, stride);
+
+	std::string path = "/" + name;
+	shm_unlink(path.c_str());
+	int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		return NULL;
+	void* base = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		shm_unlink(path.c_str());
+		return NULL;
+	}
+
+	/* the fresh mapping is zero-filled, which is every atomic's initial state */
+	shm_header* h = (shm_header*)base;
+	h->magic = shm_magic;
+	h->slots = slots;
+	h->slot_size = slot_size;
+	h->queue_size = queue_size;
+	shm_segment* s = new shm_segment;
+	s->path = path;
+	attach(s, base, size);
+	for(uint32_t n = 0; n < queue_size; n++)
+		s->cells[n].seq.store(n, std::memory_order_relaxed);
+	h->alive.store(1, std::memory_order_release);
+	return s;
+}
+
+void shm_serve(shm_segment* s, std::function<std::string(std::string&)> dispatch) {
+	shm_header* h = s->header;
+	while (!s->stopping) {
+		uint32_t bell = h->doorbell.load();
+		uint32_t index;
+		bool found = dequeue(s, index);
+		for(int spin = 0; !found && spin < spin_limit() && !s->stopping; spin++) {
+			cpu_relax();
+			found = dequeue(s, index);
+		}
+		if (!found) {
+			h->sleeping.fetch_add(1);
+			if (h->doorbell.load() == bell && !s->stopping)
+				futex_wait(&h->doorbell, bell, -1);
+			h->sleeping.fetch_sub(1);
+			continue;
+		}
+
+		if (index >= h->slots)
+			continue;
+		shm_slot* slot = slot_at(s, index);
+		uint32_t expected = SLOT_ABANDONED;
+		if (slot->state.compare_exchange_strong(expected, SLOT_FREE))
+			continue;
+		/* size is written by the client, never read past the slot on its word */
+		std::string response;
+		uint32_t size = slot->size;
+		if (size > h->slot_size)
+			response = value::Exception("request exceeds the shared memory slot size", -32600).to_xml();
+		else {
+			std::string request(slot_data(slot), size);
+			response = dispatch(request);
+		}
+		if (response.size() > h->slot_size)
+			response = value::Exception("response exceeds the shared memory slot size", -32603).to_xml();
+		memcpy(slot_data(slot), response.data(), response.size());
+		slot->size = response.size();
+		expected = SLOT_REQUEST;
+		if (!slot->state.compare_exchange_strong(expected, SLOT_RESPONSE)) {
+			slot->state.store(SLOT_FREE);
+			continue;
+		}
+		if (slot->waiting.load())
+			futex_wake(&slot->state, 1);
+	}
+}
+
+void shm_stop(shm_segment* s) {
+	s->stopping = true;
+	s->header->alive.store(0);
+	s->header->doorbell.fetch_add(1);
+	futex_wake(&s->header->doorbell, INT_MAX);
+}
+
+void shm_destroy(shm_segment* s) {
+	munmap(s->base, s->size);
+	shm_unlink(s->path.c_str());
+	delete s;
+}
+
+/*
+ * Client side. Mappings are cached per name; one whose server has gone
+ * away is dropped from the cache but never unmapped, since another
+ * thread may still be waiting on it.
+ */
+static std::mutex mappings_lock;
+static std::map<std::string, shm_segment*> mappings;
+
+static
+shm_segment* shm_open_segment(const std::string& name, shm_segment* stale) {
+	std::lock_guard<std::mutex> guard(mappings_lock);
+	std::map<std::string, shm_segment*>::iterator it = mappings.find(name);
+	if (it != mappings.end() && it->second != stale)
+		return it->second;
+	if (it != mappings.end())
+		mappings.erase(it);
+
+	std::string path = "/" + name;
+	int fd = shm_open(path.c_str(), O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void* base = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(shm_header))
+		base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+	shm_header* h = (shm_header*)base;
+	size_t cells, first_slot, stride;
+	if (h->magic != shm_magic || !h->alive.load(std::memory_order_acquire) ||
+			layout(h->slots, h->slot_size, h->queue_size, cells, first_slot, stride) > (size_t)st.st_size) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+	shm_segment* s = new shm_segment;
+	s->path = path;
+	attach(s, base, st.st_size);
+	mappings[name] = s;
+	return s;
+}
+
+static
+long remaining_ms(std::chrono::steady_clock::time_point deadline) {
+	return (long)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+}
+
+int shm_post(const std::string& name, const std::string& request, std::string& response, long timeout_ms) {
+	shm_segment* s = shm_open_segment(name, NULL);
+	if (s && !s->header->alive.load())
+		s = shm_open_segment(name, s);
+	if (!s) {
+		response = "cannot open shared memory segment " + name;
+		return -2;
+	}
+	shm_header* h = s->header;
+	if (request.size() > h->slot_size) {
+		response = "request exceeds the shared memory slot size";
+		return -1;
+	}
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeout_ms > 0 ? timeout_ms : 0);
+
+	static thread_local uint32_t hint = 0;
+	shm_slot* slot = NULL;
+	uint32_t index = 0;
+	while (!slot) {
+		for(uint32_t n = 0; n < h->slots && !slot; n++) {
+			index = (hint + n) % h->slots;
+			uint32_t expected = SLOT_FREE;
+			if (slot_at(s, index)->state.compare_exchange_strong(expected, SLOT_WRITING))
+				slot = slot_at(s, index);
+		}
+		if (slot) break;
+		if (!h->alive.load() || (timeout_ms > 0 && remaining_ms(deadline) <= 0)) {
+			response = h->alive.load() ? "timed out waiting for a shared memory slot" : "shared memory server went away";
+			return -2;
+		}
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+	hint = index;
+
+	memcpy(slot_data(slot), request.data(), request.size());
+	slot->size = request.size();
+	slot->state.store(SLOT_REQUEST);
+	/* the slot was never queued, so the server cannot be holding it */
+	if (!enqueue(s, index)) {
+		slot->state.store(SLOT_FREE);
+		response = "shared memory request queue is full";
+		return -1;
+	}
+	h->doorbell.fetch_add(1);
+	if (h->sleeping.load())
+		futex_wake(&h->doorbell, 1);
+
+	for(int spin = 0; spin < spin_limit() && slot->state.load(std::memory_order_acquire) == SLOT_REQUEST; spin++)
+		cpu_relax();
+	while (slot->state.load() == SLOT_REQUEST) {
+		long wait_ms = 100;
+		if (timeout_ms > 0)
+			wait_ms = std::min(wait_ms, std::max(remaining_ms(deadline), 0L));
+		bool gone = !h->alive.load();
+		if (gone || (timeout_ms > 0 && wait_ms <= 0)) {
+			uint32_t expected = SLOT_REQUEST;
+			if (slot->state.compare_exchange_strong(expected, SLOT_ABANDONED)) {
+				response = gone ? "shared memory server went away" : "operation timed out";
+				return -2;
+			}
+			break;
+		}
+		slot->waiting.store(1);
+		if (slot->state.load() == SLOT_REQUEST)
+			futex_wait(&slot->state, SLOT_REQUEST, wait_ms);
+		slot->waiting.store(0);
+	}
+	size_t limit = get_decode_limits().max_body;
+	int ret = 0;
+	if (slot->size > h->slot_size) {
+		response = "shared memory response exceeds the slot size";
+		ret = -2;
+	} else if (limit && slot->size > limit) {
+		response = body_exceeded(limit).message;
+		ret = -5;
+	} else
+		response.assign(slot_data(slot), slot->size);
+	slot->state.store(SLOT_FREE);
+	return ret;
+}
+
+}
+
+}
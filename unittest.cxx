@@ -0,0 +1,910 @@
+#include "tinyxmlrpc.h"
+#include <libxml/tree.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <float.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+struct bound_post {
+	std::string title;
+	int postid;
+	double score;
+	std::vector<std::string> tags;
+	tinyxmlrpc::value extra;
+};
+TINYXMLRPC_STRUCT(bound_post, title, postid, score, tags, extra)
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* ---- scalar codec ---- */
+
+static std::string fmt_double(double v) {
+	char buf[tinyxmlrpc::scalar::double_size];
+	return std::string(buf, tinyxmlrpc::scalar::format_double(buf, v));
+}
+
+static void test_scalar() {
+	/* fixed notation, fewest digits that read back */
+	CHECK(fmt_double(1.5) == "1.5");
+	CHECK(fmt_double(-0.25) == "-0.25");
+	CHECK(fmt_double(1e21) == "1000000000000000000000");
+	CHECK(fmt_double(1e-7) == "0.0000001");
+	const double edges[] = { DBL_MAX, -DBL_MAX, DBL_MIN, 5e-324, -5e-324, 0.1, 1.0 / 3 };
+	for(size_t n = 0; n < sizeof(edges) / sizeof(edges[0]); n++) {
+		std::string text = fmt_double(edges[n]);
+		double back = 0;
+		CHECK(text.find_first_of("eE") == std::string::npos);
+		CHECK(tinyxmlrpc::scalar::parse_double(text, back) && back == edges[n]);
+	}
+	const double bad[] = { HUGE_VAL, -HUGE_VAL, NAN };
+	for(size_t n = 0; n < sizeof(bad) / sizeof(bad[0]); n++) {
+		bool thrown = false;
+		try {
+			fmt_double(bad[n]);
+		} catch (tinyxmlrpc::value::Exception& e) {
+			thrown = e.code == 4;
+		}
+		CHECK(thrown);
+	}
+	/* to_str keeps the six decimals it always printed */
+	CHECK(tinyxmlrpc::value(1.5).to_str() == "1.500000");
+
+	/* to_str keeps the slashed time form; the wire uses the compact one */
+	struct tm t = {};
+	CHECK(tinyxmlrpc::scalar::parse_time("20240307T08:09:10", t));
+	CHECK(tinyxmlrpc::value(t).to_str() == "2024/03/07 08:09:10");
+	char buf[tinyxmlrpc::scalar::time_size];
+	CHECK(std::string(buf, tinyxmlrpc::scalar::format_time(buf, t)) == "20240307T08:09:10");
+}
+
+static std::string response(const std::string& inner) {
+	return "<?xml version=\"1.0\"?><methodResponse><params><param><value>" + inner +
+		"</value></param></params></methodResponse>";
+}
+
+/* a malformed scalar is a type error on every decode path */
+static void test_malformed_scalars() {
+	const char* const bad[] = {
+		"<double>1.5abc</double>", "<int>12x</int>", "<i4>99999999999</i4>", "<i8>1e3</i8>",
+		"<boolean>yes</boolean>", "<dateTime.iso8601>2024-03-07Tnoon</dateTime.iso8601>",
+	};
+	for(size_t n = 0; n < sizeof(bad) / sizeof(bad[0]); n++) {
+		std::string xml = response(bad[n]);
+		tinyxmlrpc::value v = tinyxmlrpc::parse(xml);
+		CHECK(v.getType() == tinyxmlrpc::value::TypeException && v.getException().code == 4);
+
+		bool thrown = false;
+		try {
+			tinyxmlrpc::parse_lazy(xml).to_value();
+		} catch (tinyxmlrpc::value::Exception& e) {
+			thrown = e.code == 4;
+		}
+		CHECK(thrown);
+
+		std::string method;
+		tinyxmlrpc::value::Array params;
+		std::string call = "<methodCall><methodName>m</methodName><params><param><value>" +
+			std::string(bad[n]) + "</value></param></params></methodCall>";
+		thrown = false;
+		try {
+			tinyxmlrpc::parse_call(call, method, params);
+		} catch (tinyxmlrpc::value::Exception& e) {
+			thrown = e.code == 4;
+		}
+		CHECK(thrown);
+	}
+	bool thrown = false;
+	try {
+		double d;
+		tinyxmlrpc::parse(response(bad[0]), d);
+	} catch (tinyxmlrpc::value::Exception& e) {
+		thrown = e.code == 4;
+	}
+	CHECK(thrown);
+
+	/* an empty scalar still reads as zero */
+	std::string xml = response("<double></double>");
+	tinyxmlrpc::value v = tinyxmlrpc::parse(xml);
+	CHECK(v.getType() == tinyxmlrpc::value::TypeDouble && v.getDouble() == 0);
+	xml = response("<double> 1.5 </double>");
+	CHECK(tinyxmlrpc::parse_lazy(xml).getDouble() == 1.5);
+}
+
+/* a breached decode limit is a fault, never the part read before it */
+static void test_decode_limits() {
+	tinyxmlrpc::decode_limits saved = tinyxmlrpc::get_decode_limits(), limits;
+	limits.max_depth = 10;
+	limits.max_elements = 200;
+	limits.max_decoded = 1000;
+	tinyxmlrpc::set_decode_limits(limits);
+
+	std::string deep, wide, text;
+	for(int n = 0; n < 20; n++)
+		deep += "<array><data><value>";
+	deep += "<i4>1</i4>";
+	for(int n = 0; n < 20; n++)
+		deep += "</value></data></array>";
+	wide = "<array><data>";
+	for(int n = 0; n < 100; n++)
+		wide += "<value><i4>1</i4></value>";
+	wide += "</data></array>";
+	text = "<array><data>";
+	for(int n = 0; n < 20; n++)
+		text += "<value><string>" + std::string(100, 'x') + "</string></value>";
+	text += "</data></array>";
+	const struct {
+		std::string inner;
+		int code;
+	} cases[] = { { deep, -6 }, { wide, -7 }, { text, -8 } };
+
+	for(size_t n = 0; n < sizeof(cases) / sizeof(cases[0]); n++) {
+		std::string xml = response(cases[n].inner);
+		tinyxmlrpc::value v = tinyxmlrpc::parse(xml);
+		CHECK(v.getType() == tinyxmlrpc::value::TypeException && v.getException().code == cases[n].code);
+		v = tinyxmlrpc::parse(xml, 2);
+		CHECK(v.getType() == tinyxmlrpc::value::TypeException && v.getException().code == cases[n].code);
+
+		int code = 0;
+		try {
+			tinyxmlrpc::parse_lazy(xml).to_value();
+		} catch (tinyxmlrpc::value::Exception& e) {
+			code = e.code;
+		}
+		CHECK(code == cases[n].code);
+
+		std::string method;
+		tinyxmlrpc::value::Array params;
+		std::string call = "<methodCall><methodName>m</methodName><params><param><value>" +
+			cases[n].inner + "</value></param></params></methodCall>";
+		code = 0;
+		try {
+			tinyxmlrpc::parse_call(call, method, params);
+		} catch (tinyxmlrpc::value::Exception& e) {
+			code = e.code;
+		}
+		CHECK(code == cases[n].code && params.empty());
+	}
+
+	/* just inside every limit the same shapes decode whole */
+	limits.max_depth = 256;
+	limits.max_elements = 1000;
+	limits.max_decoded = 4000;
+	tinyxmlrpc::set_decode_limits(limits);
+	for(size_t n = 0; n < sizeof(cases) / sizeof(cases[0]); n++) {
+		std::string xml = response(cases[n].inner);
+		CHECK(tinyxmlrpc::parse(xml).getType() != tinyxmlrpc::value::TypeException);
+		CHECK(tinyxmlrpc::parse_lazy(xml).to_value().getType() == tinyxmlrpc::value::TypeArray);
+	}
+	tinyxmlrpc::set_decode_limits(saved);
+}
+
+/* ---- struct storage ---- */
+
+static std::string member_names(const tinyxmlrpc::value::Struct& st) {
+	std::string names;
+	for(tinyxmlrpc::value::Struct::const_iterator it = st.begin(); it != st.end(); it++)
+		names += std::string(it->first.c_str()) + ",";
+	return names;
+}
+
+static void test_struct_order() {
+	/* members iterate in name order, as std::map kept them */
+	tinyxmlrpc::value::Struct st;
+	st["b"] = 2;
+	st["a"] = 1;
+	st["ab"] = 3;
+	st["B"] = 4;
+	CHECK(member_names(st) == "B,a,ab,b,");
+	CHECK(st["a"].getInt() == 1 && st["ab"].getInt() == 3 && st.size() == 4);
+	st.erase("ab");
+	CHECK(member_names(st) == "B,a,b,");
+
+	/* past index_threshold the index follows inserts in the middle */
+	tinyxmlrpc::value::Struct big;
+	for(int n = 99; n >= 0; n--) {
+		char name[8];
+		snprintf(name, sizeof(name), "m%02d", n);
+		big[name] = n;
+	}
+	bool found = big.size() == 100;
+	int n = 0;
+	for(tinyxmlrpc::value::Struct::const_iterator it = big.begin(); it != big.end(); it++, n++) {
+		char name[8];
+		snprintf(name, sizeof(name), "m%02d", n);
+		found &= it->first == tinyxmlrpc::symbol(name) && it->second.getInt() == n;
+		found &= big.find(name) == it;
+	}
+	CHECK(found);
+
+	/* decoders sort once; of a repeated name the last one wins */
+	std::string xml = response("<struct><member><name>z</name><value><i4>1</i4></value></member>"
+		"<member><name>a</name><value><i4>2</i4></value></member>"
+		"<member><name>z</name><value><i4>3</i4></value></member></struct>");
+	tinyxmlrpc::value v = tinyxmlrpc::parse(xml);
+	CHECK(v.getType() == tinyxmlrpc::value::TypeStruct && v.to_str() == "[a=\"2\", z=\"3\"]");
+	CHECK(tinyxmlrpc::parse_lazy(xml).to_value().to_str() == "[a=\"2\", z=\"3\"]");
+	tinyxmlrpc::value::Struct bound;
+	tinyxmlrpc::parse(xml, bound);
+	CHECK(member_names(bound) == "a,z," && bound["z"].getInt() == 3);
+	CHECK(tinyxmlrpc::serialize(v).find("<name>a</name>") < tinyxmlrpc::serialize(v).find("<name>z</name>"));
+}
+
+/* ---- typed binding ---- */
+
+static void test_binding() {
+	bound_post post;
+	post.title = "a < b & \"c\"";
+	post.postid = 7;
+	post.score = 0.5;
+	post.tags.push_back("x");
+	post.extra = 3;
+
+	/* encodes to the document serialize() writes for the same value */
+	tinyxmlrpc::request req("blog.put");
+	req << post << 1;
+	tinyxmlrpc::value::Struct st;
+	st["title"] = post.title;
+	st["postid"] = post.postid;
+	st["score"] = post.score;
+	tinyxmlrpc::value::Array tags;
+	tags.push_back(std::string("x"));
+	st["tags"] = tags;
+	st["extra"] = 3;
+	std::vector<tinyxmlrpc::value> params;
+	params.push_back(st);
+	params.push_back(1);
+	std::string expected = tinyxmlrpc::serialize("blog.put", params);
+	/* the binding writes members in declaration order */
+	CHECK(req.str().size() == expected.size());
+	tinyxmlrpc::request scalars("m");
+	scalars << 5 << "a<b\r" << 2.25 << true << 1234567890123LL << post.tags;
+	std::vector<tinyxmlrpc::value> same;
+	same.push_back(5);
+	same.push_back(std::string("a<b\r"));
+	same.push_back(2.25);
+	same.push_back(true);
+	same.push_back(1234567890123LL);
+	same.push_back(tags);
+	CHECK(scalars.str() == tinyxmlrpc::serialize("m", same));
+	CHECK(tinyxmlrpc::request("m").str() == "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<methodCall><methodName>m</methodName><params/></methodCall>\n");
+
+	/* decodes by name in any order, skipping unknown and escaped members */
+	std::string body = "<struct>"
+		"<member><name>unknown</name><value><i4>1</i4></value></member>"
+		"<member><name>score</name><value><double>2.5</double></value></member>"
+		"<member><name>t&#105;tle</name><value>plain &amp; text</value></member>"
+		"<member><name>tags</name><value><array><data><value>a</value><value><string>b</string></value></data></array></value></member>"
+		"<member><name>postid</name><value><int>9</int></value></member>"
+		"<member><name>extra</name><value><struct><member><name>k</name><value><boolean>1</boolean></value></member></struct></value></member>"
+		"</struct>";
+	bound_post got;
+	tinyxmlrpc::parse(response(body), got);
+	CHECK(got.title == "plain & text" && got.postid == 9 && got.score == 2.5);
+	CHECK(got.tags.size() == 2 && got.tags[0] == "a" && got.tags[1] == "b");
+	CHECK(got.extra.getType() == tinyxmlrpc::value::TypeStruct && got.extra["k"].getBoolean());
+
+	std::vector<bound_post> many;
+	tinyxmlrpc::parse(response("<array><data><value>" + body + "</value></data></array>"), many);
+	CHECK(many.size() == 1 && many[0].postid == 9);
+
+	/* type mismatches, faults and missing params throw */
+	const std::string bad[] = {
+		response("<struct><member><name>postid</name><value><string>9</string></value></member></struct>"),
+		response("<array><data/></array>"),
+		"<methodResponse><params/></methodResponse>",
+		"<methodResponse><fault><value><struct><member><name>faultCode</name><value><int>12</int></value></member>"
+			"<member><name>faultString</name><value>nope</value></member></struct></value></fault></methodResponse>",
+		"not xml",
+	};
+	const int codes[] = { 4, 4, 4, 12, 4 };
+	for(size_t n = 0; n < sizeof(bad) / sizeof(bad[0]); n++) {
+		int code = -1;
+		try {
+			bound_post p;
+			tinyxmlrpc::parse(bad[n], p);
+		} catch (tinyxmlrpc::value::Exception& e) {
+			code = e.code;
+		}
+		CHECK(code == codes[n]);
+	}
+}
+
+/* ---- parallel encoder and decoder ---- */
+
+static void test_parallel() {
+	tinyxmlrpc::value::Array rows;
+	for(int n = 0; n < 20000; n++) {
+		tinyxmlrpc::value::Struct row;
+		row["id"] = n;
+		row["name"] = "row <name> & value";
+		row["weight"] = n * 0.25;
+		rows.push_back(row);
+	}
+	tinyxmlrpc::value response = rows;
+	std::string expected = tinyxmlrpc::serialize(response, 1);
+	CHECK(expected.size() > (1 << 20));
+
+	/* concurrent callers share the pool and each get their own result */
+	std::atomic<int> good(0);
+	std::vector<std::thread> callers;
+	for(int n = 0; n < 4; n++)
+		callers.push_back(std::thread([&]() {
+			for(int i = 0; i < 3; i++) {
+				std::string xml = tinyxmlrpc::serialize(response, 4);
+				tinyxmlrpc::value back = tinyxmlrpc::parse(xml, 4);
+				if (xml == expected && back.size() == 20000 && back[19999]["id"].getInt() == 19999)
+					good++;
+			}
+		}));
+	for(size_t n = 0; n < callers.size(); n++)
+		callers[n].join();
+	CHECK(good == 12);
+
+	/* an error in a chunk reaches the caller */
+	rows[12345]["weight"] = HUGE_VAL;
+	response = rows;
+	bool thrown = false;
+	try {
+		tinyxmlrpc::serialize(response, 4);
+	} catch (tinyxmlrpc::value::Exception& e) {
+		thrown = e.code == 4;
+	}
+	CHECK(thrown);
+}
+
+/* ---- libxml-free writer ---- */
+
+static std::string dom_dump(xmlDocPtr doc) {
+	xmlChar* text;
+	int size;
+	xmlDocDumpFormatMemoryEnc(doc, &text, &size, "utf-8", 0);
+	std::string out((char*)text, size);
+	xmlFree(text);
+	xmlFreeDoc(doc);
+	return out;
+}
+
+/* what the libxml2 tree serializer writes for a call with one string
+ * param and one struct member named by the same text */
+static std::string dom_call(const std::string& method, const std::string& text) {
+	xmlDocPtr doc = xmlNewDoc((xmlChar*)"1.0");
+	xmlNodePtr call = xmlNewNode(NULL, (xmlChar*)"methodCall");
+	xmlDocSetRootElement(doc, call);
+	xmlNewTextChild(call, NULL, (xmlChar*)"methodName", (xmlChar*)method.c_str());
+	xmlNodePtr params = xmlNewChild(call, NULL, (xmlChar*)"params", NULL);
+	xmlNodePtr value = xmlNewChild(xmlNewChild(params, NULL, (xmlChar*)"param", NULL), NULL, (xmlChar*)"value", NULL);
+	xmlNewTextChild(value, NULL, (xmlChar*)"string", (xmlChar*)text.c_str());
+	value = xmlNewChild(xmlNewChild(params, NULL, (xmlChar*)"param", NULL), NULL, (xmlChar*)"value", NULL);
+	xmlNodePtr member = xmlNewChild(xmlNewChild(value, NULL, (xmlChar*)"struct", NULL), NULL, (xmlChar*)"member", NULL);
+	xmlNewTextChild(member, NULL, (xmlChar*)"name", (xmlChar*)text.c_str());
+	value = xmlNewChild(member, NULL, (xmlChar*)"value", NULL);
+	xmlNewTextChild(value, NULL, (xmlChar*)"i4", (xmlChar*)"1");
+	return dom_dump(doc);
+}
+
+static void test_writer() {
+	const std::string texts[] = {
+		"plain",
+		std::string("before\0after", 12),
+		std::string("\0", 1),
+		"\x01\x02\x08\x0b\x0c\x1f\x7f",
+		"cr\rlf\ncrlf\r\ntab\t",
+		"\r",
+		"<&>\"' ]]> &amp;",
+		"utf-8 \xc3\xa9 \xe2\x82\xac",
+		"",
+	};
+	for(size_t n = 0; n < sizeof(texts) / sizeof(texts[0]); n++) {
+		const std::string& text = texts[n];
+		std::string expected = dom_call(text.empty() ? "m" : text, text);
+
+		tinyxmlrpc::value::Struct st;
+		st[text] = 1;
+		std::vector<tinyxmlrpc::value> params;
+		params.push_back(text);
+		params.push_back(st);
+		std::string method = text.empty() ? "m" : text;
+		std::string written = tinyxmlrpc::serialize(method, params);
+		CHECK(written == expected);
+		if (written != expected)
+			fprintf(stderr, "  text %zu:\n  dom:    %s  writer: %s", n, expected.c_str(), written.c_str());
+
+		/* the template, with the string as a constant and as a slot */
+		tinyxmlrpc::request_template constant(method);
+		constant << text << st;
+		CHECK(constant.render(std::vector<tinyxmlrpc::value>()) == expected);
+		tinyxmlrpc::request_template slotted(method);
+		slotted << tinyxmlrpc::value() << st;
+		CHECK(slotted.render(std::vector<tinyxmlrpc::value>(1, text)) == expected);
+
+		/* and the typed binding's request */
+		tinyxmlrpc::request req(method);
+		req << text << st;
+		CHECK(req.str() == expected);
+	}
+}
+
+/* ---- HTTP/2 listener: raw frames over a socket ---- */
+
+struct frame {
+	int type, flags;
+	uint32_t id;
+	std::string payload;
+};
+
+static std::string h2_frame(int type, int flags, uint32_t id, const std::string& payload) {
+	std::string out;
+	size_t n = payload.size();
+	out += (char)(n >> 16);
+	out += (char)(n >> 8);
+	out += (char)n;
+	out += (char)type;
+	out += (char)flags;
+	out += (char)(id >> 24);
+	out += (char)(id >> 16);
+	out += (char)(id >> 8);
+	out += (char)id;
+	return out + payload;
+}
+
+static uint32_t be32(const std::string& s, size_t at) {
+	return ((uint32_t)(unsigned char)s[at] << 24) | ((uint32_t)(unsigned char)s[at + 1] << 16) |
+		((uint32_t)(unsigned char)s[at + 2] << 8) | (unsigned char)s[at + 3];
+}
+
+static int h2_connect(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	std::string hello = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" + h2_frame(4, 0, 0, "");
+	send(fd, hello.data(), hello.size(), MSG_NOSIGNAL);
+	return fd;
+}
+
+static void h2_send(int fd, const std::string& data) {
+	send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+}
+
+/* reads frames until the peer closes or is quiet for wait_ms */
+static std::vector<frame> h2_read(int fd, int wait_ms, bool* closed = NULL) {
+	std::string buf;
+	char chunk[65536];
+	struct pollfd p = { fd, POLLIN, 0 };
+	if (closed) *closed = false;
+	while (poll(&p, 1, wait_ms) > 0) {
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n <= 0) {
+			if (closed) *closed = true;
+			break;
+		}
+		buf.append(chunk, n);
+	}
+	std::vector<frame> frames;
+	while (buf.size() >= 9) {
+		size_t n = ((size_t)(unsigned char)buf[0] << 16) | ((size_t)(unsigned char)buf[1] << 8) | (unsigned char)buf[2];
+		if (buf.size() < 9 + n) break;
+		frame f = { (unsigned char)buf[3], (unsigned char)buf[4], be32(buf, 5) & 0x7fffffff, buf.substr(9, n) };
+		frames.push_back(f);
+		buf.erase(0, 9 + n);
+	}
+	return frames;
+}
+
+static uint32_t h2_goaway(const std::vector<frame>& frames) {
+	for(size_t n = 0; n < frames.size(); n++)
+		if (frames[n].type == 7 && frames[n].payload.size() >= 8)
+			return be32(frames[n].payload, 4);
+	return (uint32_t)-1;
+}
+
+static std::string h2_body(const std::vector<frame>& frames, uint32_t id) {
+	std::string body;
+	for(size_t n = 0; n < frames.size(); n++)
+		if (frames[n].type == 0 && frames[n].id == id)
+			body += frames[n].payload;
+	return body;
+}
+
+static bool h2_ok(const std::vector<frame>& frames, uint32_t id) {
+	for(size_t n = 0; n < frames.size(); n++)
+		if (frames[n].type == 1 && frames[n].id == id)
+			return !frames[n].payload.empty() && (unsigned char)frames[n].payload[0] == 0x88;
+	return false;
+}
+
+static const char echo_call[] = "<methodCall><methodName>echo</methodName><params>"
+	"<param><value><i4>5</i4></value></param></params></methodCall>";
+
+static void test_h2_server() {
+	tinyxmlrpc::server srv;
+	srv.add_method("echo", [](tinyxmlrpc::value::Array& params) {
+		return params.empty() ? tinyxmlrpc::value() : params[0];
+	});
+	int port = srv.listen("127.0.0.1", 0);
+	CHECK(port > 0);
+	if (port <= 0) return;
+	srv.start();
+	std::string call = echo_call;
+	/* :scheme http, :path / */
+	std::string rest = "\x86\x84";
+
+	/* HPACK: a Huffman coded :method added to the dynamic table, then
+	 * referenced by index on the next stream */
+	{
+		int fd = h2_connect(port);
+		std::string first = std::string("\x42\x84\xd7\xab\x76\xff", 6) + rest;
+		std::string second = "\xbe" + rest;
+		h2_send(fd, h2_frame(1, 0x4, 1, first) + h2_frame(0, 0x1, 1, call) +
+			h2_frame(1, 0x4, 3, second) + h2_frame(0, 0x1, 3, call));
+		std::vector<frame> frames = h2_read(fd, 300);
+		CHECK(h2_ok(frames, 1));
+		CHECK(h2_ok(frames, 3));
+		CHECK(h2_body(frames, 1).find("<i4>5</i4>") != std::string::npos);
+		CHECK(h2_body(frames, 3).find("<i4>5</i4>") != std::string::npos);
+		close(fd);
+	}
+
+	/* HPACK errors end the connection with COMPRESSION_ERROR */
+	{
+		const std::string bad[] = {
+			std::string("\x42\x84\xd7\xab\x76\x00", 6),	/* Huffman padding not all ones */
+			std::string("\x42\x85\xd7\xab\x76\xff\xff", 7),	/* a whole byte of padding */
+			std::string("\xff\x80\x80\x80\x80\x01", 6),	/* index past both tables */
+			std::string("\xbe", 1),				/* empty dynamic table */
+			std::string("\x42\x90\xd7", 3),			/* string longer than the block */
+			std::string("\x3f\xe1\xff\xff\xff\x0f", 6),	/* table size past the limit */
+		};
+		for(size_t n = 0; n < sizeof(bad) / sizeof(bad[0]); n++) {
+			int fd = h2_connect(port);
+			h2_send(fd, h2_frame(1, 0x5, 1, bad[n]));
+			CHECK(h2_goaway(h2_read(fd, 300)) == 0x9);
+			close(fd);
+		}
+	}
+
+	/* a header block split over CONTINUATION frames */
+	{
+		int fd = h2_connect(port);
+		h2_send(fd, h2_frame(1, 0, 1, "\x83") + h2_frame(9, 0, 1, "\x86") +
+			h2_frame(9, 0x4, 1, "\x84") + h2_frame(0, 0x1, 1, call));
+		std::vector<frame> frames = h2_read(fd, 300);
+		CHECK(h2_ok(frames, 1));
+		CHECK(h2_body(frames, 1).find("<i4>5</i4>") != std::string::npos);
+		close(fd);
+	}
+
+	/* anything but CONTINUATION inside a header block, or CONTINUATION
+	 * outside one, is a PROTOCOL_ERROR */
+	{
+		int fd = h2_connect(port);
+		h2_send(fd, h2_frame(1, 0, 1, "\x83") + h2_frame(6, 0, 0, "12345678"));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x1);
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(1, 0, 1, "\x83") + h2_frame(9, 0x4, 3, "\x86"));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x1);
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(9, 0x4, 1, "\x83"));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x1);
+		close(fd);
+	}
+
+	/* SETTINGS: acknowledged when well formed, FRAME_SIZE_ERROR for a
+	 * partial entry or a stream id, FLOW_CONTROL_ERROR for a window
+	 * past 2^31-1 */
+	{
+		int fd = h2_connect(port);
+		h2_send(fd, h2_frame(4, 0, 0, std::string("\x00\x05\x00\x00\x40\x00", 6)));
+		std::vector<frame> frames = h2_read(fd, 300);
+		bool acked = false;
+		for(size_t n = 0; n < frames.size(); n++)
+			acked |= frames[n].type == 4 && (frames[n].flags & 1);
+		CHECK(acked);
+		CHECK(h2_goaway(frames) == (uint32_t)-1);
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(4, 0, 0, std::string("\x00\x04\x00\x00", 4)));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x6);
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(4, 0, 1, std::string("\x00\x04\x00\x00\x00\x01", 6)));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x6);
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(4, 0, 0, std::string("\x00\x04\x80\x00\x00\x00", 6)));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x3);
+		close(fd);
+	}
+
+	/* streams past SETTINGS_MAX_CONCURRENT_STREAMS are refused, and a
+	 * stream the client resets frees its slot */
+	{
+		int fd = h2_connect(port);
+		std::string out;
+		for(uint32_t n = 0; n < 101; n++)
+			out += h2_frame(1, 0x4, 1 + 2 * n, "\x83" + rest);
+		out += h2_frame(3, 0, 1, std::string("\x00\x00\x00\x08", 4));
+		out += h2_frame(1, 0x4, 203, "\x83" + rest);
+		out += h2_frame(0, 0x1, 203, call);
+		h2_send(fd, out);
+		std::vector<frame> frames = h2_read(fd, 500);
+		int refused = 0;
+		for(size_t n = 0; n < frames.size(); n++)
+			if (frames[n].type == 3) {
+				refused++;
+				CHECK(frames[n].id == 201);
+				CHECK(be32(frames[n].payload, 0) == 0x7);
+			}
+		CHECK(refused == 1);
+		CHECK(h2_ok(frames, 203));
+		close(fd);
+	}
+
+	/* truncated and oversized frames: the connection ends, the server
+	 * keeps serving */
+	{
+		int fd = h2_connect(port);
+		h2_send(fd, std::string("\x00\x00\x64\x01\x04\x00\x00\x00\x01\x83\x86", 11));
+		shutdown(fd, SHUT_WR);
+		bool closed;
+		h2_read(fd, 500, &closed);
+		CHECK(closed);
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, std::string("\x00\x00", 2));
+		close(fd);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		struct sockaddr_in addr = {};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+		h2_send(fd, "PRI * HTTP/2.0\r\n\r\nSM");
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(0, 0, 1, std::string(16385, 'x')));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x6);
+		close(fd);
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(1, 0x5 | 0x8, 1, std::string("\x10\x83", 2)));
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0x1);
+		close(fd);
+
+		fd = h2_connect(port);
+		h2_send(fd, h2_frame(1, 0x4, 1, "\x83" + rest) + h2_frame(0, 0x1, 1, call));
+		CHECK(h2_ok(h2_read(fd, 300), 1));
+		close(fd);
+	}
+
+	/* a header block past 64 KiB is ENHANCE_YOUR_CALM, a GET is a 405
+	 * with an HTML body */
+	{
+		int fd = h2_connect(port);
+		std::string out = h2_frame(1, 0, 1, "\x83");
+		for(int n = 0; n < 5; n++)
+			out += h2_frame(9, 0, 1, std::string(16384, '\x40'));
+		h2_send(fd, out);
+		CHECK(h2_goaway(h2_read(fd, 300)) == 0xb);
+		close(fd);
+		fd = h2_connect(port);
+		/* :method GET; the reply carries content-type as a plain literal */
+		h2_send(fd, h2_frame(1, 0x5, 1, "\x82" + rest));
+		std::vector<frame> frames = h2_read(fd, 300);
+		bool html = false;
+		for(size_t n = 0; n < frames.size(); n++)
+			if (frames[n].type == 1 && frames[n].id == 1)
+				html = frames[n].payload.find("text/html") != std::string::npos;
+		CHECK(html);
+		close(fd);
+	}
+	srv.stop();
+}
+
+/* one request over HTTP/1.1, returns whatever came back before close */
+static std::string http_exchange(int port, const std::string& request) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	std::string reply;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+		char chunk[4096];
+		struct pollfd p = { fd, POLLIN, 0 };
+		while (poll(&p, 1, 300) > 0) {
+			ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+			if (n <= 0) break;
+			reply.append(chunk, n);
+		}
+	}
+	close(fd);
+	return reply;
+}
+
+static void test_http_server() {
+	tinyxmlrpc::decode_limits saved = tinyxmlrpc::get_decode_limits(), limits = saved;
+	limits.max_body = 0;
+	tinyxmlrpc::set_decode_limits(limits);
+	tinyxmlrpc::server srv;
+	srv.add_method("echo", [](tinyxmlrpc::value::Array& params) {
+		return params.empty() ? tinyxmlrpc::value() : params[0];
+	});
+	int port = srv.listen("127.0.0.1", 0);
+	CHECK(port > 0);
+	if (port > 0) {
+		srv.start();
+		std::string call = echo_call;
+		char head[128];
+		snprintf(head, sizeof(head), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n", call.size());
+		std::string reply = http_exchange(port, head + std::string("\r\n") + call);
+		CHECK(reply.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+		CHECK(reply.find("Content-Type: text/xml\r\n") != std::string::npos);
+
+		/* headers are capped even with no body limit */
+		reply = http_exchange(port, head + ("X-Pad: " + std::string(70 << 10, 'x')) + "\r\n\r\n" + call);
+		CHECK(reply.compare(0, 12, "HTTP/1.1 431") == 0);
+		CHECK(reply.find("Content-Type: text/html\r\n") != std::string::npos);
+		reply = http_exchange(port, "POST / HTTP/1.1\r\nX-Pad: " + std::string(70 << 10, 'x'));
+		CHECK(reply.compare(0, 12, "HTTP/1.1 431") == 0);
+
+		reply = http_exchange(port, "GET / HTTP/1.1\r\nConnection: close\r\n\r\n");
+		CHECK(reply.compare(0, 12, "HTTP/1.1 405") == 0);
+		CHECK(reply.find("Content-Type: text/html\r\n") != std::string::npos);
+		CHECK(reply.find("<html>") != std::string::npos);
+
+		/* a body past max_body is answered with the -5 fault */
+		limits.max_body = 256;
+		tinyxmlrpc::set_decode_limits(limits);
+		call = "<methodCall><methodName>echo</methodName><params><param><value><string>" +
+			std::string(1000, 'x') + "</string></value></param></params></methodCall>";
+		snprintf(head, sizeof(head), "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n", call.size());
+		reply = http_exchange(port, head + call);
+		size_t eoh = reply.find("\r\n\r\n");
+		CHECK(eoh != std::string::npos);
+		if (eoh != std::string::npos) {
+			std::string xml = reply.substr(eoh + 4);
+			tinyxmlrpc::value v = tinyxmlrpc::parse(xml);
+			CHECK(v.getType() == tinyxmlrpc::value::TypeException && v.getException().code == -5);
+		}
+		srv.stop();
+	}
+	tinyxmlrpc::set_decode_limits(saved);
+}
+
+/* ---- capture files ---- */
+
+static void test_capture() {
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/tinyxmlrpc-unittest-%d.cap", (int)getpid());
+	unlink(path);
+	tinyxmlrpc::capture_record record;
+	record.source = 'S';
+	record.timestamp_ns = 1ULL << 40;
+	record.result = -3;
+	record.method = "echo";
+	record.request = "<methodCall/>";
+	record.response = std::string(100000, 'x');
+	/* the second session appends after the first */
+	for(int n = 0; n < 2; n++) {
+		CHECK(tinyxmlrpc::capture_start(path));
+		tinyxmlrpc::capture_write(record);
+		tinyxmlrpc::capture_stop();
+	}
+	{
+		tinyxmlrpc::capture_reader reader(path);
+		CHECK(reader.good());
+		tinyxmlrpc::capture_record read;
+		int count = 0;
+		while (reader.next(read)) {
+			count++;
+			CHECK(read.source == 'S' && read.timestamp_ns == record.timestamp_ns && read.result == -3);
+			CHECK(read.method == record.method && read.request == record.request && read.response == record.response);
+		}
+		CHECK(count == 2);
+	}
+
+	/* a record cut short ends the file instead of reading past it */
+	CHECK(truncate(path, 9 + 45 + 4 + 13 + 100000 + 45 + 50) == 0);
+	{
+		tinyxmlrpc::capture_reader reader(path);
+		tinyxmlrpc::capture_record read;
+		CHECK(reader.next(read));
+		CHECK(!reader.next(read));
+	}
+
+	/* a file of another version is neither read nor appended to */
+	FILE* fp = fopen(path, "wb");
+	fwrite("TXRCAP1\n\x01", 9, 1, fp);
+	fclose(fp);
+	CHECK(!tinyxmlrpc::capture_reader(path).good());
+	CHECK(!tinyxmlrpc::capture_start(path));
+	CHECK(!tinyxmlrpc::capturing());
+	unlink(path);
+}
+
+/* only transport failures count toward ejecting a replica */
+static void test_endpoint_group() {
+	tinyxmlrpc::server srv;
+	srv.add_method("big", [](tinyxmlrpc::value::Array&) {
+		return tinyxmlrpc::value(std::string(10000, 'x'));
+	});
+	int port = srv.listen("127.0.0.1", 0);
+	CHECK(port > 0);
+	if (port <= 0) return;
+	srv.start();
+	char url[64];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/RPC2", port);
+	tinyxmlrpc::decode_limits saved = tinyxmlrpc::get_decode_limits(), limits = saved;
+	limits.max_body = 1024;
+	tinyxmlrpc::set_decode_limits(limits);
+	tinyxmlrpc::value::Array none;
+	{
+		tinyxmlrpc::endpoint_group group(std::vector<std::string>(1, url));
+		group.set_ejection(2, 60);
+		for(int n = 0; n < 4; n++) {
+			tinyxmlrpc::call_stats stats;
+			group.call("big", none, stats);
+			CHECK(stats.result == -5);
+		}
+		std::vector<tinyxmlrpc::endpoint_group::endpoint> e = group.snapshot();
+		CHECK(e[0].failures == 0 && e[0].ejections == 0 && e[0].consecutive_failures == 0);
+	}
+	tinyxmlrpc::set_decode_limits(saved);
+	srv.stop();
+	{
+		/* nothing listens on port 1 */
+		tinyxmlrpc::endpoint_group group(std::vector<std::string>(1, "http://127.0.0.1:1/RPC2"));
+		group.set_ejection(2, 60);
+		for(int n = 0; n < 2; n++) {
+			tinyxmlrpc::call_stats stats;
+			group.call("big", none, stats);
+			CHECK(stats.result == -2);
+		}
+		std::vector<tinyxmlrpc::endpoint_group::endpoint> e = group.snapshot();
+		CHECK(e[0].failures == 2 && e[0].ejections == 1);
+	}
+}
+
+int main() {
+	test_scalar();
+	test_malformed_scalars();
+	test_decode_limits();
+	test_struct_order();
+	test_binding();
+	test_writer();
+	test_parallel();
+	test_h2_server();
+	test_http_server();
+	test_endpoint_group();
+	test_capture();
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}